@@ -0,0 +1,181 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* asyncpathwriter.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+#include "asyncpathwriter.h"
+
+#include <sys/stat.h>
+#include <chrono>
+
+namespace
+{
+double SecondsSince(std::chrono::steady_clock::time_point aStart)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - aStart).count()/1e6;
+}
+}
+
+AsyncPathWriter::AsyncPathWriter():_queueBatches(1), _finishing(false),
+  _batches(0), _stalls(0), _stallSeconds(0.0), _writeSeconds(0.0),
+  _maxQueued(0)
+{
+}
+
+AsyncPathWriter::~AsyncPathWriter()
+{
+  if (IsRunning())
+  {
+    Finish();
+  }
+}
+
+void AsyncPathWriter::Start(const std::string& aFileName,
+  PathFormat aFormat, bool aCompress, uint64_t aCount,
+  const float* aVoxelToWorld, const float4& aGridOrigin,
+  unsigned int aQueueBatches)
+{
+  _fileName = aFileName;
+  _queueBatches = aQueueBatches > 0 ? aQueueBatches : 1;
+  _finishing = false;
+
+  _writer.SetVoxelToWorld(aVoxelToWorld);
+  _writer.SetGridOrigin(aGridOrigin);
+  _writer.Open(aFileName, aFormat, aCompress, aCount);
+
+  _thread = std::thread(&AsyncPathWriter::WriterLoop, this);
+}
+
+void AsyncPathWriter::Push(PathBatch& aBatch)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (_queue.size() >= _queueBatches)
+  {
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    _stalls++;
+    while (_queue.size() >= _queueBatches)
+    {
+      _taken.wait(lock);
+    }
+    _stallSeconds += SecondsSince(start);
+  }
+
+  _queue.push_back(PathBatch());
+  _queue.back().points.swap(aBatch.points);
+  _queue.back().lengths.swap(aBatch.lengths);
+  if (_queue.size() > _maxQueued)
+  {
+    _maxQueued = _queue.size();
+  }
+  _queued.notify_one();
+}
+
+void AsyncPathWriter::Finish()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _finishing = true;
+  }
+  _queued.notify_one();
+  _thread.join();
+
+  _writer.Close();
+}
+
+void AsyncPathWriter::Report(std::ostream& aOut) const
+{
+  struct stat fileStat;
+  double fileMegabytes = 0.0;
+  if (stat(_fileName.c_str(), &fileStat) == 0)
+  {
+    fileMegabytes = fileStat.st_size/1e6;
+  }
+  const double megabytes = _writer.GetBytes()/1e6;
+
+  aOut<<"Path writer: "<< _writer.GetCount() <<" streamlines in "<<
+    _batches <<" batches to "<< _fileName <<"\n";
+  aOut<<"\t"<< megabytes <<" MB ("<< fileMegabytes <<" MB on disk) in "<<
+    _writeSeconds <<" s";
+  if (_writeSeconds > 0.0)
+  {
+    aOut<<", "<< megabytes/_writeSeconds <<" MB/s";
+  }
+  aOut<<"\n";
+  if (fileMegabytes > 0.0)
+  {
+    aOut<<"\t"<< _writer.GetPoints() <<" points, "<<
+      _writer.GetPoints()*sizeof(float4)/1e6/fileMegabytes <<
+        "x smaller than float4 paths\n";
+  }
+  aOut<<"\tQueue: up to "<< _maxQueued <<" of "<< _queueBatches <<
+    " batches waiting, tracking stalled "<< _stalls <<" times for "<<
+      _stallSeconds <<" s\n";
+}
+
+//Private method: the writer thread, until Finish() and an empty queue.
+void AsyncPathWriter::WriterLoop()
+{
+  PathBatch batch;
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (_queue.empty() && !_finishing)
+      {
+        _queued.wait(lock);
+      }
+      if (_queue.empty())
+      {
+        return;
+      }
+      batch.points.swap(_queue.front().points);
+      batch.lengths.swap(_queue.front().lengths);
+      _queue.pop_front();
+    }
+    _taken.notify_one();
+
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    const float4* path = batch.points.data();
+    for (unsigned int n = 0; n < batch.lengths.size(); n++)
+    {
+      _writer.WriteStreamline(path, batch.lengths[n]);
+      path += batch.lengths[n];
+    }
+    _writeSeconds += SecondsSince(start);
+    _batches++;
+  }
+}
+
+//EOF
@@ -0,0 +1,107 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* asyncpathwriter.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef  OCLPTX_ASYNCPATHWRITER_H_
+#define  OCLPTX_ASYNCPATHWRITER_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "customtypes.h"
+#include "streamlinewriter.h"
+
+// Finished streamlines of one batch: their points back to back, and
+// the number of points of each.
+struct PathBatch
+{
+  std::vector<float4> points;
+  std::vector<unsigned int> lengths;
+};
+
+// Writes batches of streamlines on a thread of its own, so the device
+// can track the next batch meanwhile. Batches wait in a queue of
+// bounded length; Push() blocks while it is full (backpressure), which
+// keeps host memory in check when the disk is slower than the device.
+class AsyncPathWriter
+{
+  public:
+    AsyncPathWriter();
+    ~AsyncPathWriter();
+
+    // Opens the file (see StreamlineWriter) and starts the writer
+    // thread. Up to aQueueBatches batches (at least 1) wait to be
+    // written before Push() blocks.
+    void Start(const std::string& aFileName, PathFormat aFormat,
+      bool aCompress, uint64_t aCount, const float* aVoxelToWorld,
+      const float4& aGridOrigin, unsigned int aQueueBatches);
+    bool IsRunning() const {return _thread.joinable();}
+
+    // Queues aBatch, taking its contents.
+    void Push(PathBatch& aBatch);
+
+    // Writes every queued batch, closes the file and stops the thread.
+    void Finish();
+
+    // Writer throughput, file size against float4 paths, and the time
+    // Push() spent blocked.
+    void Report(std::ostream& aOut) const;
+
+  private:
+    void WriterLoop();
+
+    StreamlineWriter _writer;
+    std::string _fileName;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _queued;
+    std::condition_variable _taken;
+    std::deque<PathBatch> _queue;
+    unsigned int _queueBatches;
+    bool _finishing;
+
+    uint64_t _batches;
+    uint64_t _stalls;       // Push() calls that found the queue full
+    double _stallSeconds;
+    double _writeSeconds;   // writer thread busy
+    size_t _maxQueued;
+};
+
+#endif
+
+//EOF
@@ -0,0 +1,82 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* cachesimulator.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "cachesimulator.h"
+
+CacheSimulator::CacheSimulator(size_t aSizeBytes, unsigned int aWays,
+  unsigned int aLineBytes):_ways(aWays), _lineShift(0), _sets(1),
+  _accesses(0), _misses(0)
+{
+  while ((1u << _lineShift) < aLineBytes)
+  {
+    _lineShift++;
+  }
+  if (aSizeBytes >= static_cast<size_t>(aWays) << _lineShift)
+  {
+    _sets = (aSizeBytes >> _lineShift)/aWays;
+  }
+  Reset();
+}
+
+void CacheSimulator::Reset()
+{
+  _tags.assign(_sets*_ways, ~static_cast<uint64_t>(0));
+  _accesses = 0;
+  _misses = 0;
+}
+
+bool CacheSimulator::Access(uint64_t aAddress)
+{
+  const uint64_t line = aAddress >> _lineShift;
+  uint64_t* set = &_tags[(line % _sets)*_ways];
+  _accesses++;
+
+  unsigned int way = 0;
+  while (way < _ways && set[way] != line)
+  {
+    way++;
+  }
+  const bool hit = (way < _ways);
+  if (!hit)
+  {
+    _misses++;
+    way = _ways - 1;   // evict the least recently used
+  }
+  for (; way > 0; way--)
+  {
+    set[way] = set[way - 1];
+  }
+  set[0] = line;
+  return hit;
+}
+
+//EOF
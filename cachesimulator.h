@@ -0,0 +1,67 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* cachesimulator.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef  OCLPTX_CACHESIMULATOR_H_
+#define  OCLPTX_CACHESIMULATOR_H_
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+// Set associative LRU cache model, for replaying recorded voxel access
+// traces against different memory layouts.
+class CacheSimulator
+{
+  public:
+    CacheSimulator(size_t aSizeBytes, unsigned int aWays,
+      unsigned int aLineBytes = 64);
+
+    // Touches the line holding aAddress. Returns true on a hit.
+    bool Access(uint64_t aAddress);
+    void Reset();
+
+    uint64_t GetAccesses() const {return _accesses;}
+    uint64_t GetMisses() const {return _misses;}
+
+  private:
+    unsigned int _ways;
+    unsigned int _lineShift;
+    size_t _sets;
+    // per set, most recently used first; ~0 marks an empty way
+    std::vector<uint64_t> _tags;
+    uint64_t _accesses;
+    uint64_t _misses;
+};
+
+#endif
+
+//EOF
@@ -0,0 +1,247 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* codectest.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+// Round trip test of StreamlineCodec: streamlines are encoded into a
+// packed path file, plain and gzipped, and read back the way
+// oclptxdecode reads them. Checks every point is within half a quantum
+// of the original, the header survives, and decoding stops at the end
+// marker. Exits non-zero on any failure.
+//
+//    codectest
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "customtypes.h"
+#include "streamlinecodec.h"
+
+//
+// Declarations
+//
+std::vector<std::vector<float4> > TestStreamlines(float step_length);
+unsigned int RoundTrip(const std::vector<std::vector<float4> >& paths,
+  float step_length, bool gzip);
+
+int main()
+{
+  const float step_length = 0.25f; // basic.cl's step
+  std::vector<std::vector<float4> > paths = TestStreamlines(step_length);
+
+  unsigned int failures = 0;
+  failures += RoundTrip(paths, step_length, false);
+  failures += RoundTrip(paths, step_length, true);
+
+  std::cout<<"codectest: "<<paths.size()<<" streamlines, "<<failures<<
+    " failures"<<std::endl;
+  return failures == 0 ? 0 : 1;
+}
+
+//
+// Streamlines for the edge cases of the format: a smoothly bending
+// tract (small residuals), a single point (first point only), a first
+// point far from the origin (multi-byte varints), jumps much longer
+// than a step in both directions (large residuals, negative zigzag),
+// and 127/128 points (the count's varint going to two bytes).
+//
+std::vector<std::vector<float4> > TestStreamlines(float step_length)
+{
+  std::vector<std::vector<float4> > paths;
+  float4 point = {0.0f, 0.0f, 0.0f, 0.0f};
+
+  std::vector<float4> bending;
+  point.x = 45.3f; point.y = 60.1f; point.z = 30.7f;
+  for (unsigned int s = 0; s < 2000; s++)
+  {
+    float angle = s*0.01f;
+    point.x += step_length*cos(angle)*cos(0.3f*angle);
+    point.y += step_length*sin(angle)*cos(0.3f*angle);
+    point.z += step_length*sin(0.3f*angle);
+    bending.push_back(point);
+  }
+  paths.push_back(bending);
+
+  point.x = 0.0f; point.y = 0.0f; point.z = 0.0f;
+  paths.push_back(std::vector<float4>(1, point));
+
+  point.x = 4095.97f; point.y = 0.01f; point.z = 1023.5f;
+  paths.push_back(std::vector<float4>(1, point));
+
+  std::vector<float4> jumps;
+  point.x = 10.0f; point.y = 200.0f; point.z = 3.0f;
+  jumps.push_back(point);
+  point.x += 150.0f; point.y -= 199.9f; point.z += 0.1f;
+  jumps.push_back(point);
+  point.x -= 150.0f; point.y += 199.9f; point.z += 2000.0f;
+  jumps.push_back(point);
+  point.x += step_length; point.z -= 2000.0f;
+  jumps.push_back(point);
+  paths.push_back(jumps);
+
+  for (unsigned int n = 127; n <= 128; n++)
+  {
+    std::vector<float4> straight;
+    point.x = 20.0f; point.y = 20.0f; point.z = 20.0f;
+    for (unsigned int s = 0; s < n; s++)
+    {
+      straight.push_back(point);
+      point.y += step_length;
+    }
+    paths.push_back(straight);
+  }
+
+  return paths;
+}
+
+//
+// Encodes paths into a temporary packed path file (gzipped or plain)
+// and decodes it again. Returns the number of failed checks.
+//
+unsigned int RoundTrip(const std::vector<std::vector<float4> >& paths,
+  float step_length, bool gzip)
+{
+  const char* mode = gzip ? "gzip" : "plain";
+  unsigned int failures = 0;
+
+  StreamlineCodec codec(step_length);
+  float voxel_to_world[12];
+  for (unsigned int i = 0; i < 12; i++)
+    voxel_to_world[i] = i*0.5f - 1.0f;
+
+  std::string data = codec.Header(voxel_to_world, paths.size());
+  for (unsigned int p = 0; p < paths.size(); p++)
+    codec.Encode(paths.at(p).data(), paths.at(p).size(), &data);
+  StreamlineCodec::AppendEnd(&data);
+  // anything after the end marker must not be read as a streamline
+  data.append(16, '\x7F');
+
+  char file_name[] = "/tmp/oclptx_codectestXXXXXX";
+  int fd = mkstemp(file_name);
+  if (fd < 0)
+  {
+    std::cout<<"Error: could not create a temporary file"<<std::endl;
+    exit(1);
+  }
+  close(fd);
+
+  gzFile out_file = gzopen(file_name, gzip ? "wb" : "wbT");
+  if (out_file == NULL || gzwrite(out_file, data.data(), data.size()) !=
+      static_cast<int>(data.size()))
+  {
+    std::cout<<"Error: could not write "<<file_name<<std::endl;
+    exit(1);
+  }
+  gzclose(out_file);
+
+  gzFile in_file = gzopen(file_name, "rb");
+  if (in_file == NULL)
+  {
+    std::cout<<"Error: could not open "<<file_name<<std::endl;
+    exit(1);
+  }
+
+  float read_to_world[12];
+  uint64_t count;
+  StreamlineCodec decoder =
+    StreamlineCodec::ReadHeader(in_file, read_to_world, &count);
+  if (count != paths.size() || decoder.GetQuantum() != codec.GetQuantum())
+  {
+    std::cout<<mode<<": header count "<<count<<", quantum "<<
+      decoder.GetQuantum()<<std::endl;
+    failures++;
+  }
+  for (unsigned int i = 0; i < 12; i++)
+    if (read_to_world[i] != voxel_to_world[i])
+    {
+      std::cout<<mode<<": voxel to world entry "<<i<<" differs"<<std::endl;
+      failures++;
+    }
+
+  // half a quantum of rounding, plus float error on the largest
+  // coordinates
+  const double bound = codec.GetQuantum()/2.0 + 1e-3;
+  double worst = 0.0;
+  std::vector<float4> path;
+  for (unsigned int p = 0; p < paths.size(); p++)
+  {
+    if (!decoder.Decode(in_file, &path))
+    {
+      std::cout<<mode<<": streamline "<<p<<" missing"<<std::endl;
+      failures++;
+      break;
+    }
+    if (path.size() != paths.at(p).size())
+    {
+      std::cout<<mode<<": streamline "<<p<<" has "<<path.size()<<
+        " points, expected "<<paths.at(p).size()<<std::endl;
+      failures++;
+      continue;
+    }
+    for (unsigned int i = 0; i < path.size(); i++)
+    {
+      const float4& in = paths.at(p).at(i);
+      double error = std::max(std::fabs(path.at(i).x - in.x),
+        std::max(std::fabs(path.at(i).y - in.y),
+          std::fabs(path.at(i).z - in.z)));
+      worst = std::max(worst, error);
+      if (error > bound)
+      {
+        std::cout<<mode<<": streamline "<<p<<" point "<<i<<" off by "<<
+          error<<" voxels"<<std::endl;
+        failures++;
+      }
+    }
+  }
+
+  // the count 0 marker ends the file for the decoder
+  if (decoder.Decode(in_file, &path))
+  {
+    std::cout<<mode<<": decoded past the end marker"<<std::endl;
+    failures++;
+  }
+  gzclose(in_file);
+  unlink(file_name);
+
+  std::cout<<mode<<": "<<data.size()<<" bytes, worst error "<<worst<<
+    " voxels (bound "<<bound<<")"<<std::endl;
+  return failures;
+}
+
+//EOF
@@ -85,7 +85,91 @@ struct BedpostXData
   std::vector<float*> data;
   unsigned int nx, ny, nz;  // discrete dimensions of mesh
   unsigned int ns;          //number of samples
+  unsigned int nvoxels;     // voxels stored per sample: the grid size
+                            // (see voxelindex.h), or the in-mask count
+                            // when compacted
+  bool bricked;             // grid uses the bricked voxelindex.h order
+  unsigned int x0, y0, z0;  // grid voxel (0, 0, 0) in the full image,
+                            // non-zero when cropped with --crop
+  std::vector<unsigned short*> half_data; // IEEE half copy of data, only
+                                          // filled for --fp16 runs
 };
+
+// theta, phi and f of one (voxel, sample) held together in a single
+// float4 record, so the kernel reads them with one load:
+//    data.at(fiber)[s*nvoxels + voxel] = (theta, phi, f, 0)
+// or, with unit_vectors set, the fibre direction precomputed from the
+// angles:
+//    (cos(phi)*sin(theta), sin(phi)*sin(theta), cos(theta), f)
+struct PackedSampleData
+{
+  std::vector<float4*> data;
+  unsigned int nx, ny, nz;
+  unsigned int ns;
+  unsigned int nvoxels;
+  bool bricked;
+  unsigned int x0, y0, z0;
+  bool unit_vectors;
+  std::vector<unsigned short*> half_data; // 4 IEEE halves per record,
+                                          // only filled for --fp16 runs
+};
+
+// Quantised samples: one 32 bit code per (voxel, sample), indexed like
+// BedpostXData. Bits 0-15 pick a DirectionCodebook entry, bits 16-23
+// hold f scaled to 0-255.
+struct CodebookSampleData
+{
+  std::vector<unsigned int*> data;
+  unsigned int nx, ny, nz;
+  unsigned int ns;
+  unsigned int nvoxels;
+  bool bricked;
+  unsigned int x0, y0, z0;
+};
+
+// Part of the full image held as the sample grid: image voxel
+// (x0 + x, y0 + y, z0 + z) is grid voxel (x, y, z), for 0 <= x < nx etc.
+// With --crop, the brain mask bounding box plus one voxel.
+struct GridBox
+{
+  unsigned int x0, y0, z0;
+  unsigned int nx, ny, nz;
+};
+
+// How samples are laid out on the device.
+enum SampleLayout
+{
+  kSeparateSamples,   // one float buffer each for theta, phi and f
+  kPackedSamples,     // PackedSampleData, angle records
+  kUnitVectorSamples, // PackedSampleData, unit vector records
+  kCodebookSamples    // CodebookSampleData
+};
+
+// ParticlePathsToFile output (--pathformat).
+enum PathFormat
+{
+  kTckPaths,    // binary MRtrix .tck, see StreamlineWriter
+  kCsvPaths,    // text, x, y and z rows of comma separated values per path
+  kPackedPaths  // fixed-point deltas, see StreamlineCodec
+};
+
+// Length of every tracking step in voxels, fixed in basic.cl.
+const float kStepLength = 0.25f;
+
+// Marks a voxel with no compacted samples in the voxel -> compact
+// index lookup volume.
+const unsigned int kVoxelOutsideMask = 0xFFFFFFFF;
+
+// Bits of the combined mask volume, one unsigned int per voxel in the
+// brain mask grid. Waymask i sets bit kMaskWaypointShift + i. The
+// kernel has its own copy of these (oclkernels/basic.cl). On the
+// device the words are narrowed to the bytes the bits in use need,
+// see SampleManager::GetMaskWordBytes().
+const unsigned int kMaskBrain = 0x1;
+const unsigned int kMaskExclusion = 0x2;
+const unsigned int kMaskTermination = 0x4;
+const unsigned int kMaskWaypointShift = 3;
+const unsigned int kMaxWayMasks = 32 - kMaskWaypointShift;
 //
 // Note on particle positions re:bedpostx mesh :
 // if a particle is at x,y,z, can find nearest "root" vertex:
@@ -94,6 +178,13 @@ struct BedpostXData
 //
 // elem = nssample*(X*nz*ny + Y*nz + Z)
 //
+// When samples are compacted to the brain mask, X*nz*ny + Y*nz + Z is
+// looked up in the voxel index volume first and samples are strided by
+// nvoxels instead of nx*ny*nz. With --bricked, GridVoxelOffset() in
+// voxelindex.h replaces X*nz*ny + Y*nz + Z everywhere.
+// With --crop, nx, ny, nz are those of the crop box and X, Y, Z (like
+// particle positions) count from its origin (x0, y0, z0).
+//
 // Device side, where there may be multiple directions included, simply
 // multiply by the direction #, (from 0 to n-1)
 //
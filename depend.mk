@@ -1,7 +1,9 @@
 interptest.o: interptest.cc customtypes.h
 oclenv.o: oclenv.cc oclenv.h customtypes.h
 oclptx.o: oclptx.cc oclptx.h oclenv.h customtypes.h oclptxhandler.h \
- samplemanager.h \
+ samplemanager.h cachesimulator.h memoryplanner.h asyncpathwriter.h \
+ streamlinewriter.h streamlinecodec.h \
+ voxelindex.h \
  /home/afshin/FSLDirectories/FSLDirectories/Source/fsl/include/newimage/newimageall.h \
  /home/afshin/FSLDirectories/FSLDirectories/Source/fsl/include/newimage/newimage.h \
  /home/afshin/FSLDirectories/FSLDirectories/Source/fsl/extras/include/newmat/newmatap.h \
@@ -32,7 +34,9 @@ oclptx.o: oclptx.cc oclptx.h oclenv.h customtypes.h oclptxhandler.h \
  /home/afshin/FSLDirectories/FSLDirectories/Source/fsl/include/utils/options.h \
  /home/afshin/FSLDirectories/FSLDirectories/Source/fsl/include/utils/log.h \
  interptest.cc
-oclptxhandler.o: oclptxhandler.cc oclptxhandler.h customtypes.h
+oclptxhandler.o: oclptxhandler.cc oclptxhandler.h customtypes.h voxelindex.h \
+ asyncpathwriter.h streamlinewriter.h \
+ streamlinecodec.h
 oclptxOptions.o: oclptxOptions.cc oclptxOptions.h \
  /home/afshin/FSLDirectories/FSLDirectories/Source/fsl/include/utils/options.h \
  /home/afshin/FSLDirectories/FSLDirectories/Source/fsl/include/utils/log.h \
@@ -72,4 +76,21 @@ samplemanager.o: samplemanager.cc samplemanager.h \
  oclptxOptions.h \
  /home/afshin/FSLDirectories/FSLDirectories/Source/fsl/include/utils/options.h \
  /home/afshin/FSLDirectories/FSLDirectories/Source/fsl/include/utils/log.h \
- customtypes.h
+ customtypes.h niftireader.h mappedfile.h directioncodebook.h \
+ halffloat.h samplecache.h hostarena.h voxelindex.h
+mappedfile.o: mappedfile.cc mappedfile.h
+niftireader.o: niftireader.cc niftireader.h mappedfile.h gzipinflater.h voxelindex.h
+directioncodebook.o: directioncodebook.cc directioncodebook.h customtypes.h
+samplecache.o: samplecache.cc samplecache.h mappedfile.h customtypes.h voxelindex.h
+gzipinflater.o: gzipinflater.cc gzipinflater.h
+hostarena.o: hostarena.cc hostarena.h
+cachesimulator.o: cachesimulator.cc cachesimulator.h
+memoryplanner.o: memoryplanner.cc memoryplanner.h
+streamlinewriter.o: streamlinewriter.cc streamlinewriter.h customtypes.h \
+ streamlinecodec.h
+asyncpathwriter.o: asyncpathwriter.cc asyncpathwriter.h streamlinewriter.h \
+ customtypes.h streamlinecodec.h
+streamlinecodec.o: streamlinecodec.cc streamlinecodec.h customtypes.h
+oclptxdecode.o: oclptxdecode.cc customtypes.h streamlinecodec.h \
+ streamlinewriter.h
+codectest.o: codectest.cc customtypes.h streamlinecodec.h
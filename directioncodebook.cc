@@ -0,0 +1,120 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* directioncodebook.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <cmath>
+
+#include "directioncodebook.h"
+
+namespace
+{
+  float SignNotZero(float aValue)
+  {
+    return aValue >= 0.0f ? 1.0f : -1.0f;
+  }
+
+  int ClampCell(int aCell)
+  {
+    const int last = DirectionCodebook::kGridSize - 1;
+    return aCell < 0 ? 0 : (aCell > last ? last : aCell);
+  }
+}
+
+DirectionCodebook::DirectionCodebook()
+{
+  _entries.resize(kNumEntries);
+  for (unsigned int j = 0; j < kGridSize; j++)
+  {
+    for (unsigned int i = 0; i < kGridSize; i++)
+    {
+      float x = 2.0f*(i + 0.5f)/kGridSize - 1.0f;
+      float y = 2.0f*(j + 0.5f)/kGridSize - 1.0f;
+      float z = 1.0f - std::fabs(x) - std::fabs(y);
+      if (z < 0.0f)
+      {
+        float foldedX = (1.0f - std::fabs(y))*SignNotZero(x);
+        float foldedY = (1.0f - std::fabs(x))*SignNotZero(y);
+        x = foldedX;
+        y = foldedY;
+      }
+      float norm = std::sqrt(x*x + y*y + z*z);
+      float4& entry = _entries[j*kGridSize + i];
+      entry.x = x/norm;
+      entry.y = y/norm;
+      entry.z = z/norm;
+      entry.t = 0.0f;
+    }
+  }
+}
+
+unsigned short DirectionCodebook::Encode(float aX, float aY, float aZ) const
+{
+  float l1 = std::fabs(aX) + std::fabs(aY) + std::fabs(aZ);
+  if (l1 == 0.0f)
+  {
+    return 0;
+  }
+  float x = aX/l1;
+  float y = aY/l1;
+  if (aZ < 0.0f)
+  {
+    float foldedX = (1.0f - std::fabs(y))*SignNotZero(x);
+    float foldedY = (1.0f - std::fabs(x))*SignNotZero(y);
+    x = foldedX;
+    y = foldedY;
+  }
+  int cellI = ClampCell(static_cast<int>((x + 1.0f)*0.5f*kGridSize));
+  int cellJ = ClampCell(static_cast<int>((y + 1.0f)*0.5f*kGridSize));
+
+  // The projected cell is nearly always the nearest entry, but the map
+  // is not conformal, so check its neighbours as well.
+  float norm = std::sqrt(aX*aX + aY*aY + aZ*aZ);
+  unsigned int best = cellJ*kGridSize + cellI;
+  float bestDot = -2.0f;
+  for (int dj = -1; dj <= 1; dj++)
+  {
+    for (int di = -1; di <= 1; di++)
+    {
+      unsigned int candidate =
+        ClampCell(cellJ + dj)*kGridSize + ClampCell(cellI + di);
+      const float4& entry = _entries[candidate];
+      float dot = (entry.x*aX + entry.y*aY + entry.z*aZ)/norm;
+      if (dot > bestDot)
+      {
+        bestDot = dot;
+        best = candidate;
+      }
+    }
+  }
+  return static_cast<unsigned short>(best);
+}
+
+//EOF
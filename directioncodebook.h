@@ -0,0 +1,74 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* directioncodebook.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef  OCLPTX_DIRECTIONCODEBOOK_H_
+#define  OCLPTX_DIRECTIONCODEBOOK_H_
+
+#include <vector>
+
+#include "customtypes.h"
+
+// Fixed table of 2^16 unit vectors tessellating the sphere, used to
+// store fibre directions as 16 bit indices.
+//
+// Entries are the cell centres of a 256x256 octahedral map: the sphere
+// is projected onto the octahedron |x|+|y|+|z| = 1, the lower half is
+// folded over the upper and the square is gridded evenly. Cells are
+// close to equal area and the worst case error of a nearest entry is
+// under 0.7 degrees.
+class DirectionCodebook
+{
+  public:
+    static const unsigned int kGridSize = 256;
+    static const unsigned int kNumEntries = kGridSize*kGridSize;
+
+    DirectionCodebook();
+
+    // Index of the entry closest to the direction (aX, aY, aZ), which
+    // need not be normalised.
+    unsigned short Encode(float aX, float aY, float aZ) const;
+
+    // (x, y, z, 0) unit vector of an entry.
+    const float4& Decode(unsigned short aCode) const
+    {
+      return _entries[aCode];
+    }
+
+    const float4* GetEntries() const {return _entries.data();}
+
+  private:
+    std::vector<float4> _entries;
+};
+
+#endif
+
+//EOF
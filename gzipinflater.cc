@@ -0,0 +1,477 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* gzipinflater.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <thread>
+#include <zlib.h>
+
+#include "gzipinflater.h"
+
+namespace
+{
+  const unsigned char kGzipId1 = 0x1f;
+  const unsigned char kGzipId2 = 0x8b;
+  const unsigned char kGzipDeflate = 8;
+  const unsigned char kFlagHcrc = 0x02;
+  const unsigned char kFlagExtra = 0x04;
+  const unsigned char kFlagName = 0x08;
+  const unsigned char kFlagComment = 0x10;
+
+  unsigned int ReadLe16(const char* aBuffer)
+  {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(aBuffer);
+    return b[0] | (b[1] << 8);
+  }
+
+  unsigned long ReadLe32(const char* aBuffer)
+  {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(aBuffer);
+    return static_cast<unsigned long>(b[0]) | (b[1] << 8) | (b[2] << 16) |
+      (static_cast<unsigned long>(b[3]) << 24);
+  }
+
+  // Index of the first of aRanges that ends after aOffset.
+  size_t FirstRangeAfter(const std::vector<GzipInflater::Range>& aRanges,
+    size_t aOffset)
+  {
+    return std::lower_bound(aRanges.begin(), aRanges.end(), aOffset,
+      [](const GzipInflater::Range& aRange, size_t aValue)
+      {
+        return aRange.offset + aRange.size <= aValue;
+      }) - aRanges.begin();
+  }
+
+  // Where each of aRanges starts in the packed output, plus the total
+  // size. False if a range reaches past aInflatedSize.
+  bool PackRanges(const std::vector<GzipInflater::Range>& aRanges,
+    size_t aInflatedSize, std::vector<size_t>* aRangeOut, size_t* aTotal)
+  {
+    *aTotal = 0;
+    for (size_t r = 0; r < aRanges.size(); r++)
+    {
+      if (aRanges.at(r).offset + aRanges.at(r).size > aInflatedSize)
+      {
+        return false;
+      }
+      aRangeOut->push_back(*aTotal);
+      *aTotal += aRanges.at(r).size;
+    }
+    return true;
+  }
+
+  // Copies the parts of aSpan (inflated bytes aSpanOffset onwards) that
+  // fall inside aRanges to their place in aOutput.
+  void CopyRangeOverlap(const char* aSpan, size_t aSpanOffset,
+    size_t aSpanSize, const std::vector<GzipInflater::Range>& aRanges,
+    const std::vector<size_t>& aRangeOut, char* aOutput)
+  {
+    const size_t spanEnd = aSpanOffset + aSpanSize;
+    for (size_t r = FirstRangeAfter(aRanges, aSpanOffset);
+      r < aRanges.size() && aRanges.at(r).offset < spanEnd; r++)
+    {
+      const GzipInflater::Range& range = aRanges.at(r);
+      const size_t start = std::max(range.offset, aSpanOffset);
+      const size_t end = std::min(range.offset + range.size, spanEnd);
+      if (start < end)
+      {
+        memcpy(aOutput + aRangeOut.at(r) + (start - range.offset),
+          aSpan + (start - aSpanOffset), end - start);
+      }
+    }
+  }
+}
+
+GzipInflater::GzipInflater():_blockCount(0){}
+
+bool GzipInflater::Inflate(const char* aData, size_t aSize,
+  unsigned int aThreads, std::vector<char>* aOutput,
+  const std::vector<Range>* aRanges)
+{
+  _blockCount = 0;
+  aOutput->clear();
+
+  std::vector<Block> blocks;
+  if (FindBlocks(aData, aSize, &blocks))
+  {
+    if (aRanges != NULL)
+    {
+      return InflateBlockRanges(aData, blocks, *aRanges, aThreads, aOutput);
+    }
+    const Block& last = blocks.back();
+    Range all = {0, last.outOffset + last.outSize};
+    return InflateBlockRanges(aData, blocks, std::vector<Range>(1, all),
+      aThreads, aOutput);
+  }
+  if (aRanges != NULL)
+  {
+    return InflateStreamRanges(aData, aSize, *aRanges, aOutput);
+  }
+  return InflateStream(aData, aSize, aOutput);
+}
+
+// Walks the gzip members by their BGZF block sizes without inflating
+// anything. Fails as soon as a member does not carry its size.
+bool GzipInflater::FindBlocks(const char* aData, size_t aSize,
+  std::vector<Block>* aBlocks)
+{
+  size_t pos = 0;
+  size_t outOffset = 0;
+  while (pos < aSize)
+  {
+    const char* member = aData + pos;
+    const size_t left = aSize - pos;
+    if (left < 18 ||
+      static_cast<unsigned char>(member[0]) != kGzipId1 ||
+      static_cast<unsigned char>(member[1]) != kGzipId2 ||
+      static_cast<unsigned char>(member[2]) != kGzipDeflate)
+    {
+      return false;
+    }
+    const unsigned char flags = member[3];
+    if (!(flags & kFlagExtra))
+    {
+      return false;
+    }
+
+    const size_t extraSize = ReadLe16(member + 10);
+    size_t header = 12 + extraSize;
+    size_t memberSize = 0;
+    for (size_t sub = 12; sub + 4 <= header && header <= left;)
+    {
+      const unsigned int subSize = ReadLe16(member + sub + 2);
+      if (member[sub] == 'B' && member[sub + 1] == 'C' && subSize == 2)
+      {
+        memberSize = ReadLe16(member + sub + 4) + 1;
+      }
+      sub += 4 + subSize;
+    }
+    if (memberSize == 0)
+    {
+      return false;
+    }
+
+    if (flags & kFlagName)
+    {
+      while (header < left && member[header] != 0) header++;
+      header++;
+    }
+    if (flags & kFlagComment)
+    {
+      while (header < left && member[header] != 0) header++;
+      header++;
+    }
+    if (flags & kFlagHcrc)
+    {
+      header += 2;
+    }
+    if (memberSize > left || header + 8 > memberSize)
+    {
+      return false;
+    }
+
+    Block block;
+    block.inOffset = pos + header;
+    block.inSize = memberSize - header - 8;
+    block.crc = ReadLe32(member + memberSize - 8);
+    block.outSize = ReadLe32(member + memberSize - 4);
+    block.outOffset = outOffset;
+    aBlocks->push_back(block);
+
+    outOffset += block.outSize;
+    pos += memberSize;
+  }
+  return !aBlocks->empty();
+}
+
+// Inflates the blocks that overlap aRanges. A block that lies inside
+// one range inflates straight into its slice of aOutput (always the
+// case when the range is the whole file), any other goes through a
+// scratch buffer.
+bool GzipInflater::InflateBlockRanges(const char* aData,
+  const std::vector<Block>& aBlocks, const std::vector<Range>& aRanges,
+  unsigned int aThreads, std::vector<char>* aOutput)
+{
+  const Block& last = aBlocks.back();
+  std::vector<size_t> rangeOut;
+  size_t total;
+  if (!PackRanges(aRanges, last.outOffset + last.outSize, &rangeOut,
+    &total))
+  {
+    return false;
+  }
+  aOutput->resize(total);
+
+  std::vector<size_t> needed;
+  for (size_t b = 0; b < aBlocks.size(); b++)
+  {
+    const Block& block = aBlocks.at(b);
+    const size_t r = FirstRangeAfter(aRanges, block.outOffset);
+    if (block.outSize > 0 && r < aRanges.size() &&
+      aRanges.at(r).offset < block.outOffset + block.outSize)
+    {
+      needed.push_back(b);
+    }
+  }
+  _blockCount = needed.size();
+
+  if (aThreads == 0)
+  {
+    aThreads = std::thread::hardware_concurrency();
+  }
+  aThreads = std::max(1u,
+    std::min<unsigned int>(aThreads, needed.size()));
+
+  std::atomic<size_t> nextBlock(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]()
+  {
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+    {
+      failed = true;
+      return;
+    }
+
+    std::vector<char> scratch;
+    size_t n;
+    while (!failed && (n = nextBlock++) < needed.size())
+    {
+      const Block& block = aBlocks.at(needed.at(n));
+      const size_t r = FirstRangeAfter(aRanges, block.outOffset);
+      const Range& range = aRanges.at(r);
+      const bool direct = range.offset <= block.outOffset &&
+        block.outOffset + block.outSize <= range.offset + range.size;
+      char* out;
+      if (direct)
+      {
+        out = aOutput->data() + rangeOut.at(r) +
+          (block.outOffset - range.offset);
+      }
+      else
+      {
+        scratch.resize(block.outSize);
+        out = scratch.data();
+      }
+
+      inflateReset(&stream);
+      stream.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(aData) + block.inOffset);
+      stream.avail_in = block.inSize;
+      stream.next_out = reinterpret_cast<Bytef*>(out);
+      stream.avail_out = block.outSize;
+      if (inflate(&stream, Z_FINISH) != Z_STREAM_END ||
+        stream.avail_out != 0 ||
+        crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<Bytef*>(out),
+          block.outSize) != block.crc)
+      {
+        failed = true;
+      }
+      else if (!direct)
+      {
+        CopyRangeOverlap(out, block.outOffset, block.outSize, aRanges,
+          rangeOut, aOutput->data());
+      }
+    }
+    inflateEnd(&stream);
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned int i = 1; i < aThreads; i++)
+  {
+    pool.push_back(std::thread(worker));
+  }
+  worker();
+  for (unsigned int i = 0; i < pool.size(); i++)
+  {
+    pool.at(i).join();
+  }
+  return !failed;
+}
+
+// Single zlib stream over all members, for gzip files without block
+// sizes. The last ISIZE (size mod 2^32) only sizes the first buffer.
+bool GzipInflater::InflateStream(const char* aData, size_t aSize,
+  std::vector<char>* aOutput)
+{
+  if (aSize < 18)
+  {
+    return false;
+  }
+
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  stream.next_in = Z_NULL;
+  stream.avail_in = 0;
+  if (inflateInit2(&stream, MAX_WBITS + 16) != Z_OK)
+  {
+    return false;
+  }
+
+  aOutput->resize(std::max<size_t>(ReadLe32(aData + aSize - 4), 1 << 20));
+  size_t consumed = 0;
+  size_t produced = 0;
+  int status = Z_OK;
+  while (true)
+  {
+    if (stream.avail_in == 0 && consumed < aSize)
+    {
+      const size_t chunk = std::min<size_t>(aSize - consumed, UINT_MAX);
+      stream.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(aData) + consumed);
+      stream.avail_in = chunk;
+      consumed += chunk;
+    }
+    if (produced == aOutput->size())
+    {
+      aOutput->resize(aOutput->size()*2);
+    }
+    const size_t room =
+      std::min<size_t>(aOutput->size() - produced, UINT_MAX);
+    stream.next_out = reinterpret_cast<Bytef*>(aOutput->data() + produced);
+    stream.avail_out = room;
+
+    status = inflate(&stream, Z_NO_FLUSH);
+    produced += room - stream.avail_out;
+
+    if (status == Z_STREAM_END)
+    {
+      // concatenated members (e.g. from pigz or cat)
+      if ((stream.avail_in == 0 && consumed == aSize) ||
+        (stream.avail_in > 0 && *stream.next_in != kGzipId1))
+      {
+        break;
+      }
+      inflateReset(&stream);
+    }
+    else if (status != Z_OK && status != Z_BUF_ERROR)
+    {
+      break;
+    }
+    else if (status == Z_BUF_ERROR && stream.avail_in == 0 &&
+      consumed == aSize)
+    {
+      // truncated input
+      break;
+    }
+  }
+  inflateEnd(&stream);
+
+  aOutput->resize(produced);
+  return status == Z_STREAM_END;
+}
+
+// Single zlib stream through a fixed window, keeping only aRanges and
+// stopping once the last one is complete.
+bool GzipInflater::InflateStreamRanges(const char* aData, size_t aSize,
+  const std::vector<Range>& aRanges, std::vector<char>* aOutput)
+{
+  std::vector<size_t> rangeOut;
+  size_t total;
+  if (aSize < 18 || !PackRanges(aRanges, static_cast<size_t>(-1),
+    &rangeOut, &total))
+  {
+    return false;
+  }
+  aOutput->resize(total);
+  if (aRanges.empty())
+  {
+    return true;
+  }
+  const size_t end = aRanges.back().offset + aRanges.back().size;
+
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  stream.next_in = Z_NULL;
+  stream.avail_in = 0;
+  if (inflateInit2(&stream, MAX_WBITS + 16) != Z_OK)
+  {
+    return false;
+  }
+
+  std::vector<char> window(1 << 20);
+  size_t consumed = 0;
+  size_t produced = 0;
+  int status = Z_OK;
+  while (produced < end)
+  {
+    if (stream.avail_in == 0 && consumed < aSize)
+    {
+      const size_t chunk = std::min<size_t>(aSize - consumed, UINT_MAX);
+      stream.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(aData) + consumed);
+      stream.avail_in = chunk;
+      consumed += chunk;
+    }
+    stream.next_out = reinterpret_cast<Bytef*>(window.data());
+    stream.avail_out = window.size();
+
+    status = inflate(&stream, Z_NO_FLUSH);
+    const size_t got = window.size() - stream.avail_out;
+    CopyRangeOverlap(window.data(), produced, got, aRanges, rangeOut,
+      aOutput->data());
+    produced += got;
+
+    if (status == Z_STREAM_END)
+    {
+      if ((stream.avail_in == 0 && consumed == aSize) ||
+        (stream.avail_in > 0 && *stream.next_in != kGzipId1))
+      {
+        break;
+      }
+      inflateReset(&stream);
+    }
+    else if (status != Z_OK && status != Z_BUF_ERROR)
+    {
+      break;
+    }
+    else if (status == Z_BUF_ERROR && stream.avail_in == 0 &&
+      consumed == aSize)
+    {
+      break;
+    }
+  }
+  inflateEnd(&stream);
+
+  return produced >= end;
+}
+
+//EOF
@@ -0,0 +1,95 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* gzipinflater.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef  OCLPTX_GZIPINFLATER_H_
+#define  OCLPTX_GZIPINFLATER_H_
+
+#include <cstddef>
+#include <vector>
+
+// Decompresses an in-memory .gz file. Files made of BGZF blocks
+// (bgzip, or any writer that records each member's size in a "BC"
+// extra field) are split at block boundaries and inflated on several
+// threads. A plain gzip stream can only be inflated front to back, so
+// those fall back to a single zlib stream.
+class GzipInflater
+{
+  public:
+    // Part of the inflated data, in bytes.
+    struct Range
+    {
+      size_t offset;
+      size_t size;
+    };
+
+    GzipInflater();
+
+    // Inflates aSize bytes at aData into aOutput using up to aThreads
+    // threads (0 = one per core). Returns false if the data is not
+    // valid gzip or a block fails its size/CRC check.
+    // Given aRanges (sorted, not overlapping), aOutput only receives
+    // those parts of the inflated data, back to back: BGZF blocks
+    // outside every range are skipped, and a plain stream stops after
+    // the last range (so its trailing CRC is not checked).
+    bool Inflate(const char* aData, size_t aSize, unsigned int aThreads,
+      std::vector<char>* aOutput, const std::vector<Range>* aRanges = NULL);
+
+    // Independently inflated blocks in the last Inflate() call, 0 when
+    // it had to fall back to a single stream.
+    size_t GetBlockCount() const {return _blockCount;}
+
+  private:
+    struct Block
+    {
+      size_t inOffset;    // start of the raw deflate data
+      size_t inSize;
+      size_t outOffset;
+      size_t outSize;
+      unsigned long crc;
+    };
+
+    bool FindBlocks(const char* aData, size_t aSize,
+      std::vector<Block>* aBlocks);
+    bool InflateStream(const char* aData, size_t aSize,
+      std::vector<char>* aOutput);
+    bool InflateBlockRanges(const char* aData,
+      const std::vector<Block>& aBlocks, const std::vector<Range>& aRanges,
+      unsigned int aThreads, std::vector<char>* aOutput);
+    bool InflateStreamRanges(const char* aData, size_t aSize,
+      const std::vector<Range>& aRanges, std::vector<char>* aOutput);
+
+    size_t _blockCount;
+};
+
+#endif
+
+//EOF
@@ -0,0 +1,131 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* halffloat.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef  OCLPTX_HALFFLOAT_H_
+#define  OCLPTX_HALFFLOAT_H_
+
+#include <cstring>
+#include <stdint.h>
+
+// IEEE 754 binary16 conversion, matching what vload_half expects on the
+// device. Rounds to nearest even; out of range values become infinity.
+inline unsigned short FloatToHalf(float aValue)
+{
+  uint32_t bits;
+  memcpy(&bits, &aValue, sizeof(bits));
+
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const uint32_t exponent = (bits >> 23) & 0xFF;
+  uint32_t mantissa = bits & 0x007FFFFF;
+
+  // NaN and infinity
+  if (exponent == 0xFF)
+  {
+    return sign | 0x7C00 | (mantissa ? 0x0200 : 0);
+  }
+
+  int halfExponent = static_cast<int>(exponent) - 127 + 15;
+  if (halfExponent >= 0x1F)
+  {
+    return sign | 0x7C00;
+  }
+  if (halfExponent <= 0)
+  {
+    // subnormal half, or zero
+    if (halfExponent < -10)
+    {
+      return sign;
+    }
+    mantissa |= 0x00800000;
+    const int shift = 14 - halfExponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t remainder = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1)))
+    {
+      half++;
+    }
+    return sign | half;
+  }
+
+  uint32_t half = (halfExponent << 10) | (mantissa >> 13);
+  const uint32_t remainder = mantissa & 0x1FFF;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+  {
+    // may carry into the exponent, which is still correct rounding
+    half++;
+  }
+  return sign | half;
+}
+
+inline float HalfToFloat(unsigned short aValue)
+{
+  const uint32_t sign = (aValue & 0x8000) << 16;
+  uint32_t exponent = (aValue >> 10) & 0x1F;
+  uint32_t mantissa = aValue & 0x03FF;
+  uint32_t bits;
+
+  if (exponent == 0x1F)
+  {
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  }
+  else if (exponent == 0)
+  {
+    if (mantissa == 0)
+    {
+      bits = sign;
+    }
+    else
+    {
+      // normalise the subnormal half
+      exponent = 127 - 15 + 1;
+      while ((mantissa & 0x0400) == 0)
+      {
+        mantissa <<= 1;
+        exponent--;
+      }
+      bits = sign | (exponent << 23) | ((mantissa & 0x03FF) << 13);
+    }
+  }
+  else
+  {
+    bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  }
+
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+#endif
+
+//EOF
@@ -0,0 +1,128 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* hostarena.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <algorithm>
+#include <iostream>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "hostarena.h"
+
+HostArena::HostArena(size_t aCapacity):
+  _mapping(NULL), _mappingSize(0), _base(NULL), _capacity(0), _used(0),
+  _allocations(0), _locked(false)
+{
+  if (aCapacity == 0)
+  {
+    aCapacity = static_cast<size_t>(sysconf(_SC_PHYS_PAGES))*
+      sysconf(_SC_PAGESIZE);
+  }
+  aCapacity = (aCapacity + kHugePageSize - 1)/kHugePageSize*kHugePageSize;
+
+  // Address space only; MAP_NORESERVE keeps untouched pages free.
+  _mappingSize = aCapacity + kHugePageSize;
+  void* mapping = mmap(NULL, _mappingSize, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED)
+  {
+    _mappingSize = 0;
+    return;
+  }
+  _mapping = static_cast<char*>(mapping);
+
+  uintptr_t start = reinterpret_cast<uintptr_t>(_mapping);
+  start = (start + kHugePageSize - 1)/kHugePageSize*kHugePageSize;
+  _base = reinterpret_cast<char*>(start);
+  _capacity = aCapacity;
+#ifdef MADV_HUGEPAGE
+  madvise(_base, _capacity, MADV_HUGEPAGE);
+#endif
+}
+
+HostArena::~HostArena()
+{
+  if (_mapping != NULL)
+  {
+    munmap(_mapping, _mappingSize);
+  }
+}
+
+void* HostArena::AllocateBytes(size_t aBytes)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  const size_t offset = (_used + kAlignment - 1)/kAlignment*kAlignment;
+  if (_base == NULL || aBytes > _capacity - std::min(offset, _capacity))
+  {
+    throw std::bad_alloc();
+  }
+  char* block = _base + offset;
+  if (_locked && aBytes > 0 && mlock(block, aBytes) != 0)
+  {
+    std::cout<<"Could not lock "<<aBytes/1e6<<" MB of host memory "
+      "(RLIMIT_MEMLOCK), later arrays are not locked"<<std::endl;
+    _locked = false;
+  }
+  _used = offset + aBytes;
+  _allocations++;
+  return block;
+}
+
+bool HostArena::Lock()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_base == NULL)
+  {
+    return false;
+  }
+  _locked = (_used == 0 || mlock(_base, _used) == 0);
+  return _locked;
+}
+
+void HostArena::PrintUsage(std::ostream& aOut) const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  struct rusage usage;
+  long peakRssKb = 0;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+  {
+    peakRssKb = usage.ru_maxrss;
+  }
+  aOut<<"Host Arena Used (MB): "<<_used/1e6<<" in "<<_allocations<<
+    " arrays"<<(_locked ? ", locked" : "")<<"\n";
+  aOut<<"Host Arena Reserved (MB): "<<_capacity/1e6<<"\n";
+  aOut<<"Peak RSS (MB): "<<peakRssKb/1024.0<<"\n";
+}
+
+//EOF
@@ -0,0 +1,116 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* hostarena.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef  OCLPTX_HOSTARENA_H_
+#define  OCLPTX_HOSTARENA_H_
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <ostream>
+
+// A typed window onto arena memory. Does not own anything.
+template <typename T>
+struct ArenaView
+{
+  T* data;
+  size_t count;
+
+  T& operator[](size_t i) const {return data[i];}
+  size_t Bytes() const {return count*sizeof(T);}
+};
+
+// One region of host memory that every sample, layout and mask array is
+// carved from, instead of a separate new[] per array. The region is
+// reserved (not committed) up front at hugepage alignment and marked
+// for transparent hugepages; pages are only backed when first written.
+// Allocations are cacheline aligned, zero filled and live until the
+// arena is destroyed. Allocation is thread safe.
+class HostArena
+{
+  public:
+    static const size_t kAlignment = 64;          // cacheline
+    static const size_t kHugePageSize = 2 << 20;
+
+    // Reserves aCapacity bytes of address space, 0 = physical memory.
+    explicit HostArena(size_t aCapacity = 0);
+    ~HostArena();
+
+    // Throws std::bad_alloc when the reservation is exhausted.
+    template <typename T>
+    T* Allocate(size_t aCount)
+    {
+      return static_cast<T*>(AllocateBytes(aCount*sizeof(T)));
+    }
+
+    template <typename T>
+    ArenaView<T> AllocateView(size_t aCount)
+    {
+      ArenaView<T> view = {Allocate<T>(aCount), aCount};
+      return view;
+    }
+
+    // Locks everything allocated so far into RAM (mlock), so it is
+    // never swapped out. Later allocations are locked as they are made.
+    // This is not OpenCL pinned memory: the driver still stages uploads
+    // from these pages. Returns false (and stays unlocked) if the
+    // RLIMIT_MEMLOCK limit does not allow it.
+    bool Lock();
+
+    bool IsLocked() const {return _locked;}
+    size_t GetUsed() const {return _used;}
+    size_t GetCapacity() const {return _capacity;}
+    size_t GetAllocationCount() const {return _allocations;}
+
+    // Arena use next to the process peak RSS, for the run report.
+    // Nothing is freed early, so used is also the arena's peak.
+    void PrintUsage(std::ostream& aOut) const;
+
+  private:
+    HostArena(const HostArena&);
+    HostArena& operator=(const HostArena&);
+
+    void* AllocateBytes(size_t aBytes);
+
+    char* _mapping;     // as returned by mmap, for munmap
+    size_t _mappingSize;
+    char* _base;        // hugepage aligned start of the arena
+    size_t _capacity;
+    size_t _used;
+    size_t _allocations;
+    bool _locked;
+    mutable std::mutex _mutex;
+};
+
+#endif
+
+//EOF
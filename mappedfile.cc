@@ -0,0 +1,90 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* mappedfile.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mappedfile.h"
+
+MappedFile::MappedFile():_data(NULL), _size(0){}
+
+MappedFile::~MappedFile()
+{
+  Close();
+}
+
+bool MappedFile::Open(const std::string& aFileName)
+{
+  Close();
+
+  int fd = open(aFileName.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+  {
+    close(fd);
+    return false;
+  }
+
+  void* mapping = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE,
+    fd, 0);
+  // The mapping holds its own reference to the file.
+  close(fd);
+  if (mapping == MAP_FAILED)
+  {
+    return false;
+  }
+
+  // Sample files are reordered front to back, let the kernel read ahead.
+  madvise(mapping, fileStat.st_size, MADV_SEQUENTIAL);
+
+  _data = static_cast<const char*>(mapping);
+  _size = fileStat.st_size;
+  return true;
+}
+
+void MappedFile::Close()
+{
+  if (_data != NULL)
+  {
+    munmap(const_cast<char*>(_data), _size);
+  }
+  _data = NULL;
+  _size = 0;
+}
+
+//EOF
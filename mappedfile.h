@@ -0,0 +1,65 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* mappedfile.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef  OCLPTX_MAPPEDFILE_H_
+#define  OCLPTX_MAPPEDFILE_H_
+
+#include <string>
+#include <cstddef>
+
+// Read-only memory mapping of a whole file. The mapping is released
+// when the object goes out of scope.
+class MappedFile
+{
+  public:
+    MappedFile();
+    ~MappedFile();
+
+    // Returns false (and leaves the object closed) if the file cannot
+    // be opened or mapped.
+    bool Open(const std::string& aFileName);
+    void Close();
+
+    bool IsOpen() const {return _data != NULL;}
+    const char* GetData() const {return _data;}
+    size_t GetSize() const {return _size;}
+
+  private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char* _data;
+    size_t _size;
+};
+
+#endif
+
+//EOF
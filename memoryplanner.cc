@@ -0,0 +1,356 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* memoryplanner.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#include "memoryplanner.h"
+
+namespace
+{
+const uint64_t kIndex32Range = static_cast<uint64_t>(1) << 32;
+
+// path positions and the particle steps/done/waypoints/compute index
+// entries, as in OclPtxHandler::WriteInitialPosToDevice
+const uint64_t kPositionBytes = 16;
+const uint64_t kParticleUintBuffers = 4;
+
+// share of global memory left to the driver, the kernel binary and
+// private memory
+const uint64_t kReservedFraction = 20;
+
+double Megabytes(uint64_t aBytes)
+{
+  return aBytes/1e6;
+}
+
+const char* IndexWidth(uint64_t aRange)
+{
+  return aRange > kIndex32Range ? "needs 64 bit indices" : "32 bit";
+}
+}
+
+MemoryPlanner::MemoryPlanner():_particles(0), _maxSteps(0),
+  _sampleVoxels(0), _samples(0), _sampleArrays(0), _recordBytes(0),
+  _gridVoxels(0), _maskBytes(sizeof(unsigned int)), _compact(false),
+  _slabs(0), _residentSlabs(0), _slabVoxels(0), _pathChunk(0), _density(false),
+  _visitedSlots(0), _voxelPaths(false), _globalBytes(0), _maxAllocBytes(0)
+{
+}
+
+void MemoryPlanner::SetParticles(uint64_t aParticles,
+  unsigned int aMaxSteps)
+{
+  _particles = aParticles;
+  _maxSteps = aMaxSteps;
+}
+
+void MemoryPlanner::SetSamples(uint64_t aVoxels, unsigned int aSamples,
+  unsigned int aArrays, size_t aRecordBytes)
+{
+  _sampleVoxels = aVoxels;
+  _samples = aSamples;
+  _sampleArrays = aArrays;
+  _recordBytes = aRecordBytes;
+}
+
+void MemoryPlanner::SetGrid(uint64_t aGridVoxels, unsigned int aMaskBytes,
+  bool aCompact)
+{
+  _gridVoxels = aGridVoxels;
+  _maskBytes = aMaskBytes;
+  _compact = aCompact;
+}
+
+void MemoryPlanner::SetSlabStreaming(unsigned int aSlabs,
+  unsigned int aResident, uint64_t aSlabVoxels)
+{
+  _slabs = aSlabs;
+  _residentSlabs = aResident;
+  _slabVoxels = aSlabVoxels;
+}
+
+void MemoryPlanner::SetPathChunk(unsigned int aChunk)
+{
+  _pathChunk = aChunk;
+}
+
+void MemoryPlanner::SetDensityMap(bool aDensity, unsigned int aVisitedSlots)
+{
+  _density = aDensity;
+  _visitedSlots = aVisitedSlots;
+}
+
+void MemoryPlanner::SetVoxelPaths(bool aVoxelPaths)
+{
+  _voxelPaths = aVoxelPaths;
+}
+
+void MemoryPlanner::SetDeviceLimits(uint64_t aGlobalBytes,
+  uint64_t aMaxAllocBytes)
+{
+  _globalBytes = aGlobalBytes;
+  _maxAllocBytes = aMaxAllocBytes;
+}
+
+//Private method: records in one sample buffer. With slab streaming that
+//is the resident slots, as OclPtxHandler::AddSlabStream sizes them.
+uint64_t MemoryPlanner::SampleRecordsPerBuffer() const
+{
+  if (_slabs == 0)
+  {
+    return _sampleVoxels*_samples;
+  }
+  return _slabVoxels*_samples*_residentSlabs;
+}
+
+//Private method: records of one sample array on the device, counting
+//the staging slot slab streaming adds when not every slab is resident.
+uint64_t MemoryPlanner::SampleRecordsPerArray() const
+{
+  if (_slabs == 0 || _residentSlabs >= _slabs)
+  {
+    return SampleRecordsPerBuffer();
+  }
+  return SampleRecordsPerBuffer() + _slabVoxels*_samples;
+}
+
+//Private method: path positions per particle on the device, as
+//OclPtxHandler::SetPathChunk() sizes the ring.
+uint64_t MemoryPlanner::PathSlots() const
+{
+  const uint64_t fullPath = static_cast<uint64_t>(_maxSteps) + 1;
+  if (_density || _voxelPaths)
+  {
+    return 1;
+  }
+  if (_pathChunk == 0 || _pathChunk >= fullPath)
+  {
+    return fullPath;
+  }
+  return _pathChunk < 2 ? 2 : _pathChunk;
+}
+
+//Private method: entries of a particle's visited set (density map only).
+uint64_t MemoryPlanner::VisitedSlots() const
+{
+  return _density ? _visitedSlots : 0;
+}
+
+//Private method: entries of a particle's voxel list (voxel paths only).
+uint64_t MemoryPlanner::VoxelSlots() const
+{
+  return _voxelPaths ? static_cast<uint64_t>(_maxSteps) + 1 : 0;
+}
+
+//Private method: path and status buffer bytes of one particle.
+uint64_t MemoryPlanner::BytesPerParticle() const
+{
+  const uint64_t uintBuffers =
+    kParticleUintBuffers + (_slabs > 0 ? 1 : 0) + (_density ? 2 : 0) +
+    (_voxelPaths ? 1 : 0);
+  return PathSlots()*kPositionBytes + uintBuffers*sizeof(unsigned int) +
+    (VisitedSlots() + VoxelSlots())*sizeof(unsigned int);
+}
+
+uint64_t MemoryPlanner::GetBatchParticles() const
+{
+  if (_globalBytes == 0)
+  {
+    return _particles;
+  }
+
+  const uint64_t usable = _globalBytes - _globalBytes/kReservedFraction;
+  const uint64_t fixed = GetSampleBytes() + GetGridBytes();
+  const uint64_t pathBytes = PathSlots()*kPositionBytes;
+  if (fixed >= usable ||
+      SampleRecordsPerBuffer()*_recordBytes > _maxAllocBytes ||
+      _gridVoxels*sizeof(unsigned int) > _maxAllocBytes)
+  {
+    return 0;
+  }
+
+  uint64_t batch = (usable - fixed)/BytesPerParticle();
+  if (batch > _maxAllocBytes/pathBytes)
+  {
+    batch = _maxAllocBytes/pathBytes;
+  }
+  if (VisitedSlots() > 0 &&
+      batch > _maxAllocBytes/(VisitedSlots()*sizeof(unsigned int)))
+  {
+    batch = _maxAllocBytes/(VisitedSlots()*sizeof(unsigned int));
+  }
+  if (VoxelSlots() > 0 &&
+      batch > _maxAllocBytes/(VoxelSlots()*sizeof(unsigned int)))
+  {
+    batch = _maxAllocBytes/(VoxelSlots()*sizeof(unsigned int));
+  }
+  if (batch > _particles)
+  {
+    batch = _particles;
+  }
+  return batch;
+}
+
+uint64_t MemoryPlanner::GetBatchCount() const
+{
+  const uint64_t batch = GetBatchParticles();
+  if (batch == 0)
+  {
+    return 0;
+  }
+  return (_particles + batch - 1)/batch;
+}
+
+uint64_t MemoryPlanner::GetParticleBytes() const
+{
+  return GetBatchParticles()*BytesPerParticle();
+}
+
+uint64_t MemoryPlanner::GetSampleBytes() const
+{
+  return SampleRecordsPerArray()*_recordBytes*_sampleArrays;
+}
+
+uint64_t MemoryPlanner::GetGridBytes() const
+{
+  return _gridVoxels*(_maskBytes +
+    sizeof(unsigned int)*((_compact ? 1 : 0) + (_density ? 1 : 0)));
+}
+
+uint64_t MemoryPlanner::GetTotalBytes() const
+{
+  return GetParticleBytes() + GetSampleBytes() + GetGridBytes();
+}
+
+uint64_t MemoryPlanner::GetLargestBuffer() const
+{
+  uint64_t largest = GetBatchParticles()*PathSlots()*kPositionBytes;
+  const uint64_t visited =
+    GetBatchParticles()*VisitedSlots()*sizeof(unsigned int);
+  if (visited > largest)
+  {
+    largest = visited;
+  }
+  const uint64_t voxels =
+    GetBatchParticles()*VoxelSlots()*sizeof(unsigned int);
+  if (voxels > largest)
+  {
+    largest = voxels;
+  }
+  const uint64_t samples = SampleRecordsPerBuffer()*_recordBytes;
+  if (samples > largest)
+  {
+    largest = samples;
+  }
+  if (_gridVoxels*sizeof(unsigned int) > largest)
+  {
+    largest = _gridVoxels*sizeof(unsigned int);
+  }
+  return largest;
+}
+
+uint64_t MemoryPlanner::GetPathIndexRange() const
+{
+  uint64_t slots = PathSlots() > VisitedSlots() ?
+    PathSlots() : VisitedSlots();
+  if (VoxelSlots() > slots)
+  {
+    slots = VoxelSlots();
+  }
+  return GetBatchParticles()*slots;
+}
+
+uint64_t MemoryPlanner::GetSampleIndexRange() const
+{
+  return SampleRecordsPerBuffer();
+}
+
+bool MemoryPlanner::NeedsIndex64() const
+{
+  return GetPathIndexRange() > kIndex32Range ||
+    GetSampleIndexRange() > kIndex32Range;
+}
+
+bool MemoryPlanner::Fits() const
+{
+  return _particles <= kIndex32Range && _gridVoxels <= kIndex32Range &&
+    (_particles == 0 || GetBatchParticles() > 0);
+}
+
+void MemoryPlanner::Report(std::ostream& aOut) const
+{
+  aOut<<"Memory plan:\n";
+  if (_globalBytes > 0)
+  {
+    aOut<<"\tDevice (MB): "<< Megabytes(_globalBytes) <<
+      " global, "<< Megabytes(_maxAllocBytes) <<" per buffer, "<<
+        100/kReservedFraction <<"% reserved\n";
+  }
+  aOut<<"\tBatches: "<< GetBatchCount() <<" of up to "<<
+    GetBatchParticles() <<" of the "<< _particles <<" particles\n";
+  aOut<<"\tParticles (MB): "<< Megabytes(GetParticleBytes()) <<
+    " per batch, "<< PathSlots() <<" of "<< _maxSteps + 1 <<
+      " positions each on the device\n";
+  aOut<<"\tSamples (MB): "<< Megabytes(GetSampleBytes()) <<" in "<<
+    _sampleArrays <<" buffers";
+  if (_slabs > 0)
+  {
+    aOut<<", "<< _residentSlabs + 1 <<" of "<< _slabs <<" slabs";
+  }
+  aOut<<"\n";
+  aOut<<"\tMasks"<< (_density ? " and density" : "") <<" (MB): "<< Megabytes(GetGridBytes()) <<"\n";
+  aOut<<"\tTotal (MB): "<< Megabytes(GetTotalBytes()) <<
+    ", largest buffer (MB): "<< Megabytes(GetLargestBuffer()) <<"\n";
+  aOut<<"\tPath index range: "<< GetPathIndexRange() <<", "<<
+    IndexWidth(GetPathIndexRange()) <<"\n";
+  aOut<<"\tSample index range: "<< GetSampleIndexRange() <<", "<<
+    IndexWidth(GetSampleIndexRange()) <<"\n";
+  if (_globalBytes > 0)
+  {
+    aOut<<"\tPlanned headroom (MB): "<<
+      Megabytes(_globalBytes) - Megabytes(GetTotalBytes()) <<"\n";
+  }
+  if (_particles > 0 && GetBatchParticles() == 0)
+  {
+    aOut<<"\tSamples and masks alone exceed the device (try --slabwidth"
+      " or --crop)\n";
+  }
+  if (_particles > kIndex32Range)
+  {
+    aOut<<"\tToo many particles, indices are 32 bit\n";
+  }
+  if (_gridVoxels > kIndex32Range)
+  {
+    aOut<<"\tGrid too large, voxel offsets are 32 bit (try --crop)\n";
+  }
+}
+
+//EOF
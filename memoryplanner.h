@@ -0,0 +1,130 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* memoryplanner.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef  OCLPTX_MEMORYPLANNER_H_
+#define  OCLPTX_MEMORYPLANNER_H_
+
+#include <stdint.h>
+#include <cstddef>
+#include <ostream>
+
+// Device memory a tracking job needs, worked out before anything is
+// allocated (matching the buffers OclPtxHandler creates), and the 32
+// bit limits it runs into. Given the device's memory limits it also
+// splits the particles into batches that fit.
+class MemoryPlanner
+{
+  public:
+    MemoryPlanner();
+
+    void SetParticles(uint64_t aParticles, unsigned int aMaxSteps);
+    // aSamples samples of aVoxels voxels each (BedpostXData::nvoxels),
+    // in aArrays buffers of aRecordBytes records.
+    void SetSamples(uint64_t aVoxels, unsigned int aSamples,
+      unsigned int aArrays, size_t aRecordBytes);
+    // The mask volume of aMaskBytes words, plus the voxel index if
+    // aCompact.
+    void SetGrid(uint64_t aGridVoxels, unsigned int aMaskBytes,
+      bool aCompact);
+    // --slabwidth: aResident (+1 prefetch) of aSlabs slabs on the device,
+    // each slot holding aSlabVoxels voxels (OclPtxHandler::CutSlabs).
+    void SetSlabStreaming(unsigned int aSlabs, unsigned int aResident,
+      uint64_t aSlabVoxels);
+    // --pathchunk: path positions per particle on the device, 0 = all.
+    void SetPathChunk(unsigned int aChunk);
+    // --density: a count volume on the grid and no path storage, but a
+    // visited set of aVisitedSlots voxels per particle.
+    void SetDensityMap(bool aDensity, unsigned int aVisitedSlots);
+    // --voxelpaths: one position per particle plus a list of up to
+    // max steps + 1 voxel indices and its length.
+    void SetVoxelPaths(bool aVoxelPaths);
+    // CL_DEVICE_GLOBAL_MEM_SIZE and CL_DEVICE_MAX_MEM_ALLOC_SIZE. Without
+    // them every particle goes in one batch.
+    void SetDeviceLimits(uint64_t aGlobalBytes, uint64_t aMaxAllocBytes);
+
+    // Particles per batch: all of them if they fit the device, else as
+    // many as fit (0 if not even the samples and masks do).
+    uint64_t GetBatchParticles() const;
+    uint64_t GetBatchCount() const;
+
+    // Sizes on the device, for one batch of particles.
+    uint64_t GetParticleBytes() const;  // paths, status and indices
+    uint64_t GetSampleBytes() const;
+    uint64_t GetGridBytes() const;
+    uint64_t GetTotalBytes() const;
+    uint64_t GetLargestBuffer() const;
+
+    // One past the largest index the kernel forms into the path (or
+    // visited set) and sample buffers.
+    uint64_t GetPathIndexRange() const;
+    uint64_t GetSampleIndexRange() const;
+
+    // True if either range needs the -D OCLPTX_INDEX64 kernel.
+    bool NeedsIndex64() const;
+    // False if the job exceeds a limit no kernel variant lifts:
+    // particle indices and grid voxel offsets stay 32 bit, and a batch
+    // needs at least one particle on the device.
+    bool Fits() const;
+
+    void Report(std::ostream& aOut) const;
+
+  private:
+    uint64_t SampleRecordsPerBuffer() const;
+    uint64_t SampleRecordsPerArray() const;
+    uint64_t BytesPerParticle() const;
+    uint64_t PathSlots() const;
+    uint64_t VisitedSlots() const;
+    uint64_t VoxelSlots() const;
+
+    uint64_t _particles;
+    unsigned int _maxSteps;
+    uint64_t _sampleVoxels;
+    unsigned int _samples;
+    unsigned int _sampleArrays;
+    size_t _recordBytes;
+    uint64_t _gridVoxels;
+    unsigned int _maskBytes;
+    bool _compact;
+    unsigned int _slabs;
+    unsigned int _residentSlabs;
+    uint64_t _slabVoxels;
+    unsigned int _pathChunk;
+    bool _density;
+    unsigned int _visitedSlots;
+    bool _voxelPaths;
+    uint64_t _globalBytes;
+    uint64_t _maxAllocBytes;
+};
+
+#endif
+
+//EOF
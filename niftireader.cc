@@ -0,0 +1,436 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* niftireader.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <stdint.h>
+
+#include "niftireader.h"
+#include "gzipinflater.h"
+#include "voxelindex.h"
+
+//
+// Assorted Functions Declerations
+//
+
+namespace
+{
+  const int kNiftiHeaderSize = 348;
+  const short kNiftiFloat32 = 16;
+
+  int16_t Swap16(int16_t aValue)
+  {
+    uint16_t v = static_cast<uint16_t>(aValue);
+    return static_cast<int16_t>((v >> 8) | (v << 8));
+  }
+
+  uint32_t Swap32(uint32_t aValue)
+  {
+    return (aValue >> 24) | ((aValue >> 8) & 0x0000ff00) |
+      ((aValue << 8) & 0x00ff0000) | (aValue << 24);
+  }
+
+  int32_t ReadInt32(const char* aBuffer, bool aSwapped)
+  {
+    uint32_t v;
+    memcpy(&v, aBuffer, sizeof(v));
+    return static_cast<int32_t>(aSwapped ? Swap32(v) : v);
+  }
+
+  int16_t ReadInt16(const char* aBuffer, bool aSwapped)
+  {
+    int16_t v;
+    memcpy(&v, aBuffer, sizeof(v));
+    return aSwapped ? Swap16(v) : v;
+  }
+
+  float ReadFloat(const char* aBuffer, bool aSwapped)
+  {
+    uint32_t v;
+    memcpy(&v, aBuffer, sizeof(v));
+    if (aSwapped)
+    {
+      v = Swap32(v);
+    }
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+  }
+
+  // The left-right order NEWIMAGE reads an image in: neurological when
+  // the sform (if set, else the qform) has a positive determinant.
+  // Images with neither are taken as radiological, like FSL does.
+  bool IsNeurological(const char* aBuffer, bool aSwapped)
+  {
+    const short qformCode = ReadInt16(aBuffer + 252, aSwapped);
+    const short sformCode = ReadInt16(aBuffer + 254, aSwapped);
+    if (sformCode > 0)
+    {
+      float m[3][3];
+      for (int r = 0; r < 3; r++)
+      {
+        for (int c = 0; c < 3; c++)
+        {
+          m[r][c] = ReadFloat(aBuffer + 280 + 16*r + 4*c, aSwapped);
+        }
+      }
+      const float det =
+        m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1]) -
+        m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0]) +
+        m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+      return det > 0.0f;
+    }
+    if (qformCode > 0)
+    {
+      // the quaternion is a proper rotation, qfac (pixdim[0]) gives the
+      // handedness
+      return ReadFloat(aBuffer + 76, aSwapped) >= 0.0f;
+    }
+    return false;
+  }
+}
+
+NiftiReader::NiftiReader():_inflatedBlocks(0), _image(NULL), _imageSize(0),
+  _selectCount(0), _selectRandom(false), _selectSeed(0),
+  _volumesPacked(false)
+{
+  memset(&_info, 0, sizeof(_info));
+}
+
+void NiftiReader::SelectVolumes(int aCount, bool aRandom,
+  unsigned int aSeed)
+{
+  _selectCount = aCount;
+  _selectRandom = aRandom;
+  _selectSeed = aSeed;
+}
+
+std::vector<unsigned int> NiftiReader::ChooseVolumes(int aTotal,
+  int aCount, bool aRandom, unsigned int aSeed)
+{
+  std::vector<unsigned int> volumes;
+  if (aCount <= 0 || aCount >= aTotal)
+  {
+    for (int t = 0; t < aTotal; t++)
+    {
+      volumes.push_back(t);
+    }
+    return volumes;
+  }
+
+  if (aRandom)
+  {
+    std::vector<unsigned int> all = ChooseVolumes(aTotal, 0, false, 0);
+    std::mt19937 generator(aSeed);
+    std::shuffle(all.begin(), all.end(), generator);
+    volumes.assign(all.begin(), all.begin() + aCount);
+    std::sort(volumes.begin(), volumes.end());
+  }
+  else
+  {
+    for (int i = 0; i < aCount; i++)
+    {
+      volumes.push_back(static_cast<unsigned int>(
+        static_cast<long>(i)*aTotal/aCount));
+    }
+  }
+  return volumes;
+}
+
+int NiftiReader::GetVolumeCount() const
+{
+  return _volumes.empty() ? _info.nt : _volumes.size();
+}
+
+bool NiftiReader::ParseHeader(const char* aBuffer, size_t aLength,
+  NiftiInfo* aInfo)
+{
+  if (aLength < static_cast<size_t>(kNiftiHeaderSize))
+  {
+    return false;
+  }
+
+  // sizeof_hdr doubles as the byte order marker.
+  bool swapped = false;
+  if (ReadInt32(aBuffer, false) != kNiftiHeaderSize)
+  {
+    if (ReadInt32(aBuffer, true) != kNiftiHeaderSize)
+    {
+      return false;
+    }
+    swapped = true;
+  }
+
+  // Single file images only ("n+1"), .hdr/.img pairs go through NEWIMAGE.
+  if (strncmp(aBuffer + 344, "n+1", 3) != 0)
+  {
+    return false;
+  }
+
+  const int ndim = ReadInt16(aBuffer + 40, swapped);
+  aInfo->nx = ReadInt16(aBuffer + 42, swapped);
+  aInfo->ny = ndim > 1 ? ReadInt16(aBuffer + 44, swapped) : 1;
+  aInfo->nz = ndim > 2 ? ReadInt16(aBuffer + 46, swapped) : 1;
+  aInfo->nt = ndim > 3 ? ReadInt16(aBuffer + 48, swapped) : 1;
+  aInfo->datatype = ReadInt16(aBuffer + 70, swapped);
+  aInfo->voxOffset =
+    static_cast<size_t>(ReadFloat(aBuffer + 108, swapped));
+  aInfo->sclSlope = ReadFloat(aBuffer + 112, swapped);
+  aInfo->sclInter = ReadFloat(aBuffer + 116, swapped);
+  aInfo->swapped = swapped;
+  aInfo->neurological = IsNeurological(aBuffer, swapped);
+
+  if (aInfo->nx < 1 || aInfo->ny < 1 || aInfo->nz < 1 || aInfo->nt < 1)
+  {
+    return false;
+  }
+  // A zero slope means "no scaling" in NIfTI-1.
+  if (aInfo->sclSlope == 0.0f)
+  {
+    aInfo->sclSlope = 1.0f;
+    aInfo->sclInter = 0.0f;
+  }
+  return true;
+}
+
+bool NiftiReader::OpenMapped(const std::string& aBasename)
+{
+  std::string fileName = aBasename;
+  if (fileName.size() < 4 ||
+    fileName.compare(fileName.size() - 4, 4, ".nii") != 0)
+  {
+    fileName += ".nii";
+  }
+
+  if (!_file.Open(fileName))
+  {
+    return false;
+  }
+
+  _image = _file.GetData();
+  _imageSize = _file.GetSize();
+  if (!CheckImage())
+  {
+    _file.Close();
+    return false;
+  }
+  return true;
+}
+
+bool NiftiReader::OpenCompressed(const std::string& aBasename,
+  unsigned int aThreads)
+{
+  std::string fileName = aBasename;
+  if (fileName.size() < 7 ||
+    fileName.compare(fileName.size() - 7, 7, ".nii.gz") != 0)
+  {
+    fileName += ".nii.gz";
+  }
+
+  MappedFile compressed;
+  if (!compressed.Open(fileName))
+  {
+    return false;
+  }
+
+  GzipInflater inflater;
+  std::vector<GzipInflater::Range> ranges;
+  if (_selectCount > 0)
+  {
+    //Inflate just the header first to find where each volume sits.
+    std::vector<GzipInflater::Range> header(1);
+    header.at(0).offset = 0;
+    header.at(0).size = kNiftiHeaderSize;
+    NiftiInfo info;
+    if (!inflater.Inflate(compressed.GetData(), compressed.GetSize(),
+      aThreads, &_inflated, &header) ||
+      !ParseHeader(_inflated.data(), _inflated.size(), &info))
+    {
+      _inflated.clear();
+      return false;
+    }
+    if (_selectCount < info.nt)
+    {
+      const size_t volumeBytes = static_cast<size_t>(info.nx) * info.ny *
+        info.nz * sizeof(float);
+      std::vector<unsigned int> volumes = ChooseVolumes(info.nt,
+        _selectCount, _selectRandom, _selectSeed);
+      GzipInflater::Range range = {0, info.voxOffset};
+      ranges.push_back(range);
+      for (size_t i = 0; i < volumes.size(); i++)
+      {
+        range.offset = info.voxOffset + volumes.at(i)*volumeBytes;
+        range.size = volumeBytes;
+        ranges.push_back(range);
+      }
+    }
+  }
+
+  if (!inflater.Inflate(compressed.GetData(), compressed.GetSize(),
+    aThreads, &_inflated, ranges.empty() ? NULL : &ranges))
+  {
+    _inflated.clear();
+    return false;
+  }
+  _inflatedBlocks = inflater.GetBlockCount();
+  _volumesPacked = !ranges.empty();
+
+  _image = _inflated.data();
+  _imageSize = _inflated.size();
+  if (!CheckImage())
+  {
+    std::vector<char>().swap(_inflated);
+    return false;
+  }
+  return true;
+}
+
+// Reads the header of _image and checks it holds every float32 voxel
+// it promises, in the radiological order the masks are read in. Resets
+// _image on failure.
+bool NiftiReader::CheckImage()
+{
+  bool ok = ParseHeader(_image, _imageSize, &_info) &&
+    _info.datatype == kNiftiFloat32 && !_info.neurological;
+
+  _volumes.clear();
+  if (ok && _selectCount > 0 && _selectCount < _info.nt)
+  {
+    _volumes = ChooseVolumes(_info.nt, _selectCount, _selectRandom,
+      _selectSeed);
+  }
+  if (ok)
+  {
+    const size_t storedVolumes = _volumesPacked ? _volumes.size() : _info.nt;
+    const size_t voxelBytes = static_cast<size_t>(_info.nx) * _info.ny *
+      _info.nz * storedVolumes * sizeof(float);
+    ok = _info.voxOffset + voxelBytes <= _imageSize;
+  }
+  if (!ok)
+  {
+    _image = NULL;
+    _imageSize = 0;
+  }
+  return ok;
+}
+
+void NiftiReader::CopyToBedpostLayout(float* aTarget,
+  const unsigned int* aVoxelIndex, size_t aVoxelsPerSample,
+  bool aBricked, const GridBox* aBox) const
+{
+  if (_volumes.empty())
+  {
+    ReorderToBedpostLayout(_image + _info.voxOffset, _info,
+      aTarget, aVoxelIndex, aVoxelsPerSample, aBricked, aBox);
+    return;
+  }
+
+  //One selected volume at a time, each into the next sample slot.
+  NiftiInfo volume = _info;
+  volume.nt = 1;
+  size_t sampleStride = aVoxelsPerSample;
+  if (aVoxelIndex == NULL)
+  {
+    sampleStride = aBox != NULL ?
+      GridVoxelCount(aBox->nx, aBox->ny, aBox->nz, aBricked) :
+      GridVoxelCount(_info.nx, _info.ny, _info.nz, aBricked);
+  }
+  const size_t volumeBytes = static_cast<size_t>(_info.nx) * _info.ny *
+    _info.nz * sizeof(float);
+  for (size_t i = 0; i < _volumes.size(); i++)
+  {
+    const size_t stored = _volumesPacked ? i : _volumes.at(i);
+    ReorderToBedpostLayout(_image + _info.voxOffset + stored*volumeBytes,
+      volume, aTarget + i*sampleStride, aVoxelIndex, aVoxelsPerSample,
+      aBricked, aBox);
+  }
+}
+
+// One pass in file order (x fastest) so the mapping is read strictly
+// front to back; only the writes into aTarget are strided. Rows outside
+// aBox are skipped without being touched.
+void NiftiReader::ReorderToBedpostLayout(const char* aVoxels,
+  const NiftiInfo& aInfo, float* aTarget,
+  const unsigned int* aVoxelIndex, size_t aVoxelsPerSample,
+  bool aBricked, const GridBox* aBox)
+{
+  GridBox box = {0, 0, 0, static_cast<unsigned int>(aInfo.nx),
+    static_cast<unsigned int>(aInfo.ny), static_cast<unsigned int>(aInfo.nz)};
+  if (aBox != NULL)
+  {
+    box = *aBox;
+  }
+  const size_t nx = box.nx;
+  const size_t ny = box.ny;
+  const size_t nz = box.nz;
+  const size_t volumeSize = GridVoxelCount(nx, ny, nz, aBricked);
+  const size_t sampleStride =
+    aVoxelIndex != NULL ? aVoxelsPerSample : volumeSize;
+  const bool scaled = aInfo.sclSlope != 1.0f || aInfo.sclInter != 0.0f;
+  const size_t rowBytes = static_cast<size_t>(aInfo.nx)*sizeof(float);
+  const size_t sliceBytes = rowBytes*aInfo.ny;
+
+  for (size_t t = 0; t < static_cast<size_t>(aInfo.nt); t++)
+  {
+    float* volume = aTarget + t * sampleStride;
+    const char* image = aVoxels + t*sliceBytes*aInfo.nz;
+    for (size_t z = 0; z < nz; z++)
+    {
+      for (size_t y = 0; y < ny; y++)
+      {
+        const char* source = image + (box.z0 + z)*sliceBytes +
+          (box.y0 + y)*rowBytes + box.x0*sizeof(float);
+        for (size_t x = 0; x < nx; x++, source += sizeof(float))
+        {
+          size_t voxel = GridVoxelOffset(x, y, z, nx, ny, nz, aBricked);
+          if (aVoxelIndex != NULL)
+          {
+            if (aVoxelIndex[voxel] == kVoxelOutsideMask)
+            {
+              continue;
+            }
+            voxel = aVoxelIndex[voxel];
+          }
+          float value = ReadFloat(source, aInfo.swapped);
+          if (scaled)
+          {
+            value = value * aInfo.sclSlope + aInfo.sclInter;
+          }
+          volume[voxel] = value;
+        }
+      }
+    }
+  }
+}
+
+//EOF
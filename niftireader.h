@@ -0,0 +1,133 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* niftireader.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef  OCLPTX_NIFTIREADER_H_
+#define  OCLPTX_NIFTIREADER_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "mappedfile.h"
+#include "customtypes.h"
+
+// The parts of a NIfTI-1 header needed to pull voxels straight out of
+// the file, bypassing NEWIMAGE.
+struct NiftiInfo
+{
+  int nx, ny, nz, nt;
+  short datatype;
+  size_t voxOffset;
+  float sclSlope, sclInter;
+  bool swapped;   // file was written with the other byte order
+  bool neurological;  // positive sform/qform determinant, see ParseHeader
+};
+
+class NiftiReader
+{
+  public:
+    NiftiReader();
+
+    // Reads only aCount of the file's volumes (0, or at least nt, for
+    // all of them), see ChooseVolumes(). Call before opening: a
+    // compressed file then only inflates the chosen volumes.
+    void SelectVolumes(int aCount, bool aRandom, unsigned int aSeed);
+    // aCount of the volumes 0..aTotal-1 in ascending order: evenly
+    // strided, or a random set drawn from aSeed. The same arguments give
+    // the same volumes in every file.
+    static std::vector<unsigned int> ChooseVolumes(int aTotal, int aCount,
+      bool aRandom, unsigned int aSeed);
+
+    // Maps aBasename.nii (or aBasename itself when it already names a
+    // .nii file). Returns false if there is no uncompressed file, it
+    // holds something other than float32 voxels or it is stored in
+    // neurological order (NEWIMAGE flips those in x, as it does the
+    // masks), in which case the caller should go through
+    // NEWIMAGE::read_volume4D instead.
+    bool OpenMapped(const std::string& aBasename);
+
+    // Same for aBasename.nii.gz: the file is mapped and inflated into
+    // memory on up to aThreads threads (see GzipInflater), 0 = one per
+    // core.
+    bool OpenCompressed(const std::string& aBasename, unsigned int aThreads);
+
+    // Independently inflated gzip blocks, 0 for a mapped .nii or a gzip
+    // file that had to be inflated as one stream.
+    size_t GetInflatedBlocks() const {return _inflatedBlocks;}
+
+    const NiftiInfo& GetInfo() const {return _info;}
+    // Volumes CopyToBedpostLayout() writes: nt, or the selected count.
+    int GetVolumeCount() const;
+
+    // Streams every (selected) volume into the BedpostXData layout:
+    //   aTarget[t*(nx*ny*nz) + x*(ny*nz) + y*nz + z]
+    // Given a voxel index volume (see BedpostXData), voxels are written
+    // to aTarget[t*aVoxelsPerSample + aVoxelIndex[x*(ny*nz) + y*nz + z]]
+    // instead, and voxels marked kVoxelOutsideMask are dropped. With
+    // aBricked, the bricked GridVoxelOffset()/GridVoxelCount() of
+    // voxelindex.h replace the linear offset and nx*ny*nz. Given aBox,
+    // only the voxels inside it are read and x, y, z and nx, ny, nz are
+    // those of the box.
+    void CopyToBedpostLayout(float* aTarget,
+      const unsigned int* aVoxelIndex = NULL,
+      size_t aVoxelsPerSample = 0, bool aBricked = false,
+      const GridBox* aBox = NULL) const;
+
+    // Header/voxel helpers, shared with loaders that do not map files.
+    static bool ParseHeader(const char* aBuffer, size_t aLength,
+      NiftiInfo* aInfo);
+    static void ReorderToBedpostLayout(const char* aVoxels,
+      const NiftiInfo& aInfo, float* aTarget,
+      const unsigned int* aVoxelIndex = NULL,
+      size_t aVoxelsPerSample = 0, bool aBricked = false,
+      const GridBox* aBox = NULL);
+
+  private:
+    bool CheckImage();
+
+    MappedFile _file;
+    std::vector<char> _inflated;
+    size_t _inflatedBlocks;
+    const char* _image;     // the whole .nii, mapped or inflated
+    size_t _imageSize;
+    NiftiInfo _info;
+    int _selectCount;
+    bool _selectRandom;
+    unsigned int _selectSeed;
+    std::vector<unsigned int> _volumes;   // selected volumes, empty = all
+    bool _volumesPacked;    // _image holds only the selected volumes,
+                            // back to back after the header
+};
+
+#endif
+
+//EOF
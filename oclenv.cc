@@ -78,6 +78,21 @@ OclEnv::OclEnv(
   this->CreateProgram();
 }
 
+OclEnv::OclEnv(
+  std::string ocl_routine,
+  std::string build_options
+)
+{
+  this->ocl_routine_name = ocl_routine;
+  this->ocl_build_options = build_options;
+  this->ocl_profiling = false;
+
+  this->OclInit();
+  this->OclDeviceInfo();
+  this->NewCLCommandQueues();
+  this->CreateProgram();
+}
+
 //
 // Destructor
 //
@@ -103,6 +118,11 @@ cl::CommandQueue * OclEnv::GetCq(unsigned int device_num)
   return &(this->ocl_device_queues.at(device_num));
 }
 
+cl::CommandQueue * OclEnv::GetTransferCq(unsigned int device_num)
+{
+  return &(this->ocl_transfer_queues.at(device_num));
+}
+
 cl::Kernel * OclEnv::GetKernel(unsigned int kernel_num)
 {
   return &(this->ocl_kernel_set.at(kernel_num));
@@ -114,6 +134,59 @@ void OclEnv::SetOclRoutine(std::string new_routine)
   this->CreateProgram();
 }
 
+void OclEnv::SetBuildOptions(std::string new_options)
+{
+  this->ocl_build_options = new_options;
+  this->CreateProgram();
+}
+
+bool OclEnv::SupportsHalfStorage(unsigned int device_num)
+{
+  std::string extensions;
+  this->ocl_devices.at(device_num).getInfo(CL_DEVICE_EXTENSIONS,
+    &extensions);
+
+  return extensions.find("cl_khr_fp16") != std::string::npos;
+}
+
+cl_ulong OclEnv::GetGlobalMemSize(unsigned int device_num)
+{
+  cl_ulong mem_size = 0;
+  this->ocl_devices.at(device_num).getInfo(CL_DEVICE_GLOBAL_MEM_SIZE,
+    &mem_size);
+
+  return mem_size;
+}
+
+cl_ulong OclEnv::GetMaxAllocSize(unsigned int device_num)
+{
+  cl_ulong alloc_size = 0;
+  this->ocl_devices.at(device_num).getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+    &alloc_size);
+
+  return alloc_size;
+}
+
+size_t OclEnv::GetMaxWorkGroupSize(unsigned int device_num)
+{
+  size_t group_size = 0;
+  this->ocl_devices.at(device_num).getInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE,
+    &group_size);
+
+  return group_size;
+}
+
+size_t OclEnv::GetKernelWorkGroupSize(unsigned int kernel_num,
+                                      unsigned int device_num)
+{
+  size_t group_size = 0;
+  this->ocl_kernel_set.at(kernel_num).getWorkGroupInfo(
+    this->ocl_devices.at(device_num), CL_KERNEL_WORK_GROUP_SIZE,
+    &group_size);
+
+  return group_size;
+}
+
 
 //*********************************************************************
 //
@@ -192,6 +265,7 @@ unsigned int OclEnv::HowManyDevices()
 void OclEnv::NewCLCommandQueues()
 {
   this->ocl_device_queues.clear();
+  this->ocl_transfer_queues.clear();
   //this->ocl_device_queue_mutexs.clear();
 
   for (unsigned int k = 0; k < this->ocl_devices.size(); k++ )
@@ -215,6 +289,11 @@ void OclEnv::NewCLCommandQueues()
                                           )
                                         );
     }
+    this->ocl_transfer_queues.push_back(  cl::CommandQueue(
+                                            this->ocl_context,
+                                            this->ocl_devices[k]
+                                          )
+                                        );
     //this->ocl_device_queue_mutexs.push_back(MutexWrapper());
   }
 }
@@ -255,6 +334,8 @@ cl::Program OclEnv::CreateProgram()
   }
   else if (this->ocl_routine_name == "basic")
   {
+    // voxel offsets, shared with the host
+    source_list.push_back("voxelindex.h");
     source_list.push_back(fold + slash + "basic.cl");
   }  
   
@@ -293,7 +374,8 @@ cl::Program OclEnv::CreateProgram()
 
   try
   {
-    ocl_program.build(this->ocl_devices);
+    ocl_program.build(this->ocl_devices,
+      this->ocl_build_options.c_str());
   }
   catch(cl::Error err){
 
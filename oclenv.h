@@ -57,6 +57,10 @@ class OclEnv{
 
     OclEnv(std::string ocl_routine);
 
+    // build_options are handed to the OpenCL compiler, e.g.
+    // "-D OCLPTX_COMPACT" to select kernel variants.
+    OclEnv(std::string ocl_routine, std::string build_options);
+
     ~OclEnv();
 
     //
@@ -69,6 +73,9 @@ class OclEnv{
     unsigned int HowManyDevices();
     
     cl::CommandQueue * GetCq(unsigned int device_num);
+    // Second queue on the same device, for uploads that overlap the
+    // kernels running on GetCq() (slab streaming).
+    cl::CommandQueue * GetTransferCq(unsigned int device_num);
     cl::Kernel * GetKernel(unsigned int kernel_num);
     // TODO:
     // not sure if better to generate new cl::kernel  object for
@@ -76,6 +83,22 @@ class OclEnv{
 
     void SetOclRoutine(std::string new_routine);
 
+    // Rebuilds the current routine with new compiler options.
+    void SetBuildOptions(std::string new_options);
+
+    // True if the device advertises cl_khr_fp16.
+    bool SupportsHalfStorage(unsigned int device_num);
+
+    // CL_DEVICE_GLOBAL_MEM_SIZE and CL_DEVICE_MAX_MEM_ALLOC_SIZE.
+    cl_ulong GetGlobalMemSize(unsigned int device_num);
+    cl_ulong GetMaxAllocSize(unsigned int device_num);
+
+    // CL_DEVICE_MAX_WORK_GROUP_SIZE, and CL_KERNEL_WORK_GROUP_SIZE of a
+    // built kernel on a device (registers and local memory included).
+    size_t GetMaxWorkGroupSize(unsigned int device_num);
+    size_t GetKernelWorkGroupSize(unsigned int kernel_num,
+                                  unsigned int device_num);
+
     //
     // OpenCL API Interface/Helper Functions
     //
@@ -101,6 +124,7 @@ class OclEnv{
     std::vector<cl::Device> ocl_devices;
     
     std::vector<cl::CommandQueue> ocl_device_queues;
+    std::vector<cl::CommandQueue> ocl_transfer_queues;
     //std::vector<MutexWrapper> ocl_device_queue_mutexs;
 
     std::vector<cl::Kernel> ocl_kernel_set;
@@ -108,6 +132,8 @@ class OclEnv{
 
     std::string ocl_routine_name;
 
+    std::string ocl_build_options;
+
     bool ocl_profiling;
 };
 
@@ -35,11 +35,202 @@
  * Append parsed files in this order in one container
  * before compiling kernel for runtime:
  *
- *      prngmethods.cl
+ *      voxelindex.h (from the source root, shared with the host)
  *      basic.cl
  *
+ * Build options (see OclPtxHandler::Interpolate for the matching
+ * trailing kernel arguments):
+ *
+ *      -D OCLPTX_COMPACT   samples are stored only for brain mask
+ *                          voxels, looked up through voxel_index
+ *      -D OCLPTX_PACKED    theta, phi and f come interleaved as
+ *                          (theta, phi, f, 0) records in packed_samples
+ *      -D OCLPTX_UNITVEC   (with OCLPTX_PACKED) records are precomputed
+ *                          unit vectors (x, y, z, f), no per-step trig
+ *      -D OCLPTX_CODEBOOK  samples are 32 bit codes: a 16 bit index into
+ *                          the codebook unit vectors and an 8 bit f
+ *      -D OCLPTX_HALF      (not with OCLPTX_CODEBOOK) sample buffers hold
+ *                          IEEE half floats, read with vload_half
+ *      -D OCLPTX_BRICKED   sample, mask and voxel index volumes use the
+ *                          bricked Morton order of voxelindex.h
+ *      -D OCLPTX_MASK8, -D OCLPTX_MASK16
+ *                          mask_volume words are uchar (up to 5 waypoint
+ *                          masks) or ushort (up to 13), not unsigned int
+ *      -D OCLPTX_SLABS     sample buffers hold only the slabs listed in
+ *                          slab_slots; particles needing another slab
+ *                          park (see OclPtxHandler::InterpolateSlabs)
+ *      -D OCLPTX_INDEX64   path and sample buffer indices are 64 bit, for
+ *                          jobs MemoryPlanner finds past 2^32 entries
+ *      -D OCLPTX_DENSITY   each streamline counts every voxel it visits
+ *                          once into density_volume, the fdt_paths map,
+ *                          when it ends and only if it was accepted (not
+ *                          rejected, every waypoint bit in all_waypoints
+ *                          hit); particle_visited holds the voxels seen,
+ *                          particle_visited_overflow flags a full set;
+ *                          launches may be padded to whole work-groups,
+ *                          work-items from launch_particles on are idle
+ *      -D OCLPTX_DENSITY_LOCAL (with OCLPTX_DENSITY) counts go to a
+ *                          work-group hash table in local memory first
+ *                          and reach density_volume once per group
+ *      -D OCLPTX_VOXELPATHS (not with OCLPTX_DENSITY) paths are recorded
+ *                          as the voxels entered, in particle_voxels:
+ *                          linear grid indices x*ny*nz + y*nz + z, one
+ *                          per crossing into a new voxel (at most one
+ *                          per step). particle_paths keeps only the
+ *                          current position
+ *
  */
 
+#ifdef OCLPTX_BRICKED
+#define GRID_BRICKED 1
+#else
+#define GRID_BRICKED 0
+#endif
+
+// index into particle_paths and the sample buffers
+#ifdef OCLPTX_INDEX64
+typedef ulong buffer_index;
+#else
+typedef unsigned int buffer_index;
+#endif
+
+#if defined(OCLPTX_MASK8)
+typedef uchar mask_word;
+#elif defined(OCLPTX_MASK16)
+typedef ushort mask_word;
+#else
+typedef unsigned int mask_word;
+#endif
+
+// Combined mask volume bits, as in customtypes.h (kMaskBrain etc.).
+// One load per step answers every mask test.
+#define MASK_BRAIN 0x1
+#define MASK_EXCLUSION 0x2
+#define MASK_TERMINATION 0x4
+#define MASK_WAYPOINT_SHIFT 3
+
+// particle_done values
+#define PARTICLE_DONE 1
+#define PARTICLE_REJECTED 2 // entered the exclusion mask
+#define PARTICLE_PARKED 3 // waits in particle_slab for a slab (OCLPTX_SLABS)
+
+// half storage is read through vload_half*, which is core OpenCL and
+// does not need cl_khr_fp16; arithmetic stays in float.
+#ifdef OCLPTX_HALF
+#define SAMPLE_BUFFER __global half*
+#define PACKED_BUFFER __global half*
+#define LOAD_SAMPLE(buf, i) vload_half((i), (buf))
+#define LOAD_PACKED(buf, i) vload_half4((i), (buf))
+#else
+#define SAMPLE_BUFFER __global float*
+#define PACKED_BUFFER __global float4*
+#define LOAD_SAMPLE(buf, i) (buf)[(i)]
+#define LOAD_PACKED(buf, i) (buf)[(i)]
+#endif
+
+// Random sample for a particle's step (probtrackx draws a new sample
+// at every step). Hashing (particle, step) keeps runs, and the sample
+// layouts, reproducible without per-particle generator state.
+unsigned int SampleHash(unsigned int particle, unsigned int step)
+{
+  unsigned int h = particle*0x9E3779B1u ^ (step + 0x7F4A7C15u)*0x85EBCA77u;
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return h;
+}
+
+#ifdef OCLPTX_DENSITY
+// Adds voxel to a particle's visited set, an open addressed table of
+// visited_slots (a power of two) voxels, counted when the streamline
+// ends. Returns false if the set was too full to take it within
+// VISITED_PROBES probes: the voxel is dropped, and the caller flags the
+// particle for the host to report.
+#define VISITED_PROBES 16
+
+bool VisitVoxel(__global unsigned int* visited, unsigned int visited_slots,
+  unsigned int voxel)
+{
+  unsigned int slot = voxel*0x9E3779B1u;
+  unsigned int key;
+
+  slot = (slot ^ (slot >> 16)) & (visited_slots - 1);
+  for (unsigned int probe = 0; probe < VISITED_PROBES; probe++)
+  {
+    key = visited[slot];
+    if (key == voxel)
+      return true;
+    if (key == 0xFFFFFFFF)
+    {
+      visited[slot] = voxel;
+      return true;
+    }
+    slot = (slot + 1) & (visited_slots - 1);
+  }
+  return false;
+}
+#endif
+
+#ifdef OCLPTX_DENSITY_LOCAL
+// Work-group table of (voxel, count) pairs: particles from one seed
+// keep hitting the same few voxels, which would serialise on global
+// atomics. Voxels that find no slot in DENSITY_PROBES probes are
+// counted globally.
+#define DENSITY_TABLE_BITS 9
+#define DENSITY_TABLE_SIZE (1 << DENSITY_TABLE_BITS)
+#define DENSITY_PROBES 8
+#define DENSITY_EMPTY 0xFFFFFFFF
+
+void DensityTableClear(__local unsigned int* keys,
+  __local unsigned int* counts)
+{
+  for (unsigned int i = get_local_id(0); i < DENSITY_TABLE_SIZE;
+    i += get_local_size(0))
+  {
+    keys[i] = DENSITY_EMPTY;
+    counts[i] = 0;
+  }
+}
+
+void DensityTableCount(__local unsigned int* keys,
+  __local unsigned int* counts, __global unsigned int* density_volume,
+  unsigned int voxel)
+{
+  unsigned int slot = (voxel*0x9E3779B1u) >> (32 - DENSITY_TABLE_BITS);
+  unsigned int key;
+
+  for (unsigned int probe = 0; probe < DENSITY_PROBES; probe++)
+  {
+    key = atomic_cmpxchg(&keys[slot], DENSITY_EMPTY, voxel);
+    if (key == DENSITY_EMPTY || key == voxel)
+    {
+      atomic_inc(&counts[slot]);
+      return;
+    }
+    slot = (slot + 1) & (DENSITY_TABLE_SIZE - 1);
+  }
+  atomic_inc(&density_volume[voxel]);
+}
+
+void DensityTableFlush(__local unsigned int* keys,
+  __local unsigned int* counts, __global unsigned int* density_volume)
+{
+  for (unsigned int i = get_local_id(0); i < DENSITY_TABLE_SIZE;
+    i += get_local_size(0))
+  {
+    if (counts[i] > 0)
+      atomic_add(&density_volume[keys[i]], counts[i]);
+  }
+}
+
+#define DENSITY_COUNT(voxel) \
+  DensityTableCount(density_keys, density_counts, density_volume, (voxel))
+#else
+#define DENSITY_COUNT(voxel) atomic_inc(&density_volume[(voxel)])
+#endif
+
 // sample data
 // Access x, y, z vertex:
 //    index = x*(ny*nz*ns*ndir) + y*(nz*ns*ndir) + z*(ns*ndir) + s*ndir
@@ -50,35 +241,85 @@ __kernel void BasicInterpolate(
   __global float4* particle_paths, //R
   __global unsigned int* particle_steps_taken, //RW
   __global unsigned int* particle_done, //RW
-  __global float* f_samples, //R
-  __global float* phi_samples, //R
-  __global float* theta_samples, //R
-  __global unsigned short int* brain_mask, //R
+  __global unsigned int* particle_waypoints, //RW
+#if defined(OCLPTX_CODEBOOK)
+  __global unsigned int* codebook_samples, //R
+  __global float4* codebook, //R
+#elif defined(OCLPTX_PACKED)
+  PACKED_BUFFER packed_samples, //R
+#else
+  SAMPLE_BUFFER f_samples, //R
+  SAMPLE_BUFFER phi_samples, //R
+  SAMPLE_BUFFER theta_samples, //R
+#endif
+  __global mask_word* mask_volume, //R
   unsigned int section_size, // dont think we need this...remove later
   unsigned int max_steps,
+  unsigned int path_slots, // positions kept per particle, a ring if
+                           // fewer than max_steps + 1 (--pathchunk)
   unsigned int sample_nx,
   unsigned int sample_ny,
   unsigned int sample_nz,
   unsigned int sample_ns,
-  unsigned int interval_steps
+  unsigned int interval_steps,
+  unsigned int sample_nvoxels // grid size, or in-mask voxels if compact
+#ifdef OCLPTX_COMPACT
+  , __global unsigned int* voxel_index //R
+#endif
+#ifdef OCLPTX_SLABS
+  , __global int* slab_slots, //R slot of each slab, -1 if not resident
+  __global unsigned int* slab_first_voxel, //R
+  __global unsigned int* particle_slab, //W
+  unsigned int slab_width, // x planes per slab
+  unsigned int slab_capacity // sample voxels per slot and sample
+#endif
+#ifdef OCLPTX_DENSITY
+  , __global unsigned int* density_volume, //RW
+  __global unsigned int* particle_last_voxel, //RW last voxel counted
+  __global unsigned int* particle_visited, //RW visited_slots per particle
+  __global unsigned int* particle_visited_overflow, //W 1 once one is full
+  unsigned int visited_slots,
+  unsigned int all_waypoints, // waypoint bits an accepted particle has
+  unsigned int launch_particles // work-items past this are padding
+#endif
+#ifdef OCLPTX_VOXELPATHS
+  , __global unsigned int* particle_voxels, //RW voxel_slots per particle
+  __global unsigned int* particle_voxel_count, //RW
+  unsigned int voxel_slots // max_steps + 1, enough for every step
+#endif
 )
 {
   unsigned int glid = get_global_id(0);
-  
+
+#ifdef OCLPTX_DENSITY_LOCAL
+  __local unsigned int density_keys[DENSITY_TABLE_SIZE];
+  __local unsigned int density_counts[DENSITY_TABLE_SIZE];
+
+  DensityTableClear(density_keys, density_counts);
+  barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+
+#ifdef OCLPTX_DENSITY
+  // padding work-items track nothing (with DENSITY_LOCAL they still
+  // help clear and flush the table)
+  if (glid < launch_particles)
+  {
+#endif
   unsigned int particle_index = particle_indeces[glid];
   unsigned int steps_taken = particle_steps_taken[particle_index];
-  unsigned int current_path_index =
-    particle_index*(max_steps + 1) + steps_taken;
+  buffer_index path_start = (buffer_index) particle_index*path_slots;
+  unsigned int path_slot = steps_taken % path_slots;
     
   unsigned int interval_steps_taken;
   
   int3 current_root_vertex;
   
-  unsigned int diffusion_index;
+  buffer_index diffusion_index;
+  unsigned int voxel;
   unsigned int sample;
   
   // last location of particle
-  float4 particle_pos = particle_paths[current_path_index];
+  float4 particle_pos = particle_paths[path_start + path_slot];
   particle_pos.s3 = 0.0;
 
   float4 temp_pos = (float4) (0.0f); //dx, dy, dz
@@ -90,12 +331,75 @@ __kernel void BasicInterpolate(
   xmax = sample_nx*1.0; ymax = sample_ny*1.0; zmax = sample_nz*1.0;
   
   float f, phi, theta;
+#if defined(OCLPTX_PACKED) || defined(OCLPTX_CODEBOOK)
+  float4 sample_record;
+#endif
+#ifdef OCLPTX_CODEBOOK
+  unsigned int sample_code;
+#endif
   float jump_dot;
   
-  unsigned int brain_mask_index;
-  //unsigned int termination_mask_index;
-  unsigned short int bounds_test;
-  
+  unsigned int mask_index;
+  unsigned int mask_bits;
+  unsigned int waypoints = particle_waypoints[particle_index];
+#ifdef OCLPTX_SLABS
+  unsigned int slab;
+  int slot;
+
+  // a parked particle resumes where it stopped
+  particle_done[particle_index] = 0;
+#endif
+#ifdef OCLPTX_DENSITY
+  // consecutive steps in one voxel skip the visited set
+  unsigned int last_voxel = particle_last_voxel[particle_index];
+  __global unsigned int* visited =
+    particle_visited + (buffer_index) particle_index*visited_slots;
+#endif
+#ifdef OCLPTX_VOXELPATHS
+  unsigned int voxel_count = particle_voxel_count[particle_index];
+  __global unsigned int* voxels =
+    particle_voxels + (buffer_index) particle_index*voxel_slots;
+  unsigned int entered_voxel;
+  unsigned int recorded_voxel =
+    voxel_count > 0 ? voxels[voxel_count - 1] : 0xFFFFFFFF;
+#endif
+
+  // a seed outside the grid (e.g. outside the --crop box) has no
+  // samples to read
+  if ( particle_pos.s0 >= xmax || xmin > particle_pos.s0 ||
+    particle_pos.s1 >= ymax || ymin > particle_pos.s1 ||
+      particle_pos.s2 >= zmax || zmin > particle_pos.s2)
+  {
+    particle_done[particle_index] = PARTICLE_DONE;
+    interval_steps = 0;
+  }
+#ifdef OCLPTX_DENSITY
+  // the seed voxel counts too
+  else if (steps_taken == 0 && last_voxel == 0xFFFFFFFF)
+  {
+    last_voxel = GridVoxelOffset(
+      min((unsigned int) round(particle_pos.s0), sample_nx - 1),
+      min((unsigned int) round(particle_pos.s1), sample_ny - 1),
+      min((unsigned int) round(particle_pos.s2), sample_nz - 1),
+      sample_nx, sample_ny, sample_nz, GRID_BRICKED);
+    if (!VisitVoxel(visited, visited_slots, last_voxel))
+      particle_visited_overflow[particle_index] = 1;
+  }
+#endif
+#ifdef OCLPTX_VOXELPATHS
+  // the seed voxel starts the list
+  else if (voxel_count == 0)
+  {
+    recorded_voxel = LinearVoxelOffset(
+      min((unsigned int) round(particle_pos.s0), sample_nx - 1),
+      min((unsigned int) round(particle_pos.s1), sample_ny - 1),
+      min((unsigned int) round(particle_pos.s2), sample_nz - 1),
+      sample_nx, sample_ny, sample_nz);
+    voxels[0] = recorded_voxel;
+    voxel_count = 1;
+  }
+#endif
+
   for (interval_steps_taken = 0; interval_steps_taken < interval_steps;
     interval_steps_taken++)
   {
@@ -104,24 +408,73 @@ __kernel void BasicInterpolate(
     current_root_vertex.s1 = floor(particle_pos.s1);
     current_root_vertex.s2 = floor(particle_pos.s2);
     
-    // pick sample
-    sample = 0; // fixed, for now 
+    // pick one of the sample_ns samples loaded (all of them, or the
+    // --subset)
+    sample = SampleHash(particle_index, steps_taken) % sample_ns;
     
     // pick flow vertex
-    diffusion_index = 
-      sample*(sample_nz*sample_ny*sample_nx)+
-      current_root_vertex.s0*(sample_nz*sample_ny) +
-      current_root_vertex.s1*(sample_nz) +
-      current_root_vertex.s2;
+    voxel = GridVoxelOffset(current_root_vertex.s0,
+      current_root_vertex.s1, current_root_vertex.s2,
+      sample_nx, sample_ny, sample_nz, GRID_BRICKED);
+#ifdef OCLPTX_COMPACT
+    voxel = voxel_index[voxel];
+    // no samples stored outside the brain mask
+    if (voxel == 0xFFFFFFFF)
+    {
+      particle_done[particle_index] = PARTICLE_DONE;
+      break;
+    }
+#endif
+#ifdef OCLPTX_SLABS
+    slab = min((unsigned int) current_root_vertex.s0, sample_nx - 1) /
+      slab_width;
+    slot = slab_slots[slab];
+    if (slot < 0)
+    {
+      // not on the device this launch, the host swaps it in
+      particle_slab[particle_index] = slab;
+      particle_done[particle_index] = PARTICLE_PARKED;
+      break;
+    }
+    diffusion_index =
+      ((buffer_index) slot*sample_ns + sample)*slab_capacity +
+        voxel - slab_first_voxel[slab];
+#else
+    diffusion_index = (buffer_index) sample*sample_nvoxels + voxel;
+#endif
     
     // find next step location
-    f = f_samples[diffusion_index];
-    theta = theta_samples[diffusion_index];
-    phi = phi_samples[diffusion_index];
+#if defined(OCLPTX_CODEBOOK)
+    sample_code = codebook_samples[diffusion_index];
+    sample_record = codebook[sample_code & 0xFFFF];
+    f = ((sample_code >> 16) & 0xFF) / 255.0f;
+
+    xyz.s0 = 0.25 * sample_record.s0;
+    xyz.s1 = 0.25 * sample_record.s1;
+    xyz.s2 = 0.25 * sample_record.s2;
+#elif defined(OCLPTX_PACKED) && defined(OCLPTX_UNITVEC)
+    sample_record = LOAD_PACKED(packed_samples, diffusion_index);
+    f = sample_record.s3;
+
+    xyz.s0 = 0.25 * sample_record.s0;
+    xyz.s1 = 0.25 * sample_record.s1;
+    xyz.s2 = 0.25 * sample_record.s2;
+#else
+#ifdef OCLPTX_PACKED
+    sample_record = LOAD_PACKED(packed_samples, diffusion_index);
+    theta = sample_record.s0;
+    phi = sample_record.s1;
+    f = sample_record.s2;
+#else
+    f = LOAD_SAMPLE(f_samples, diffusion_index);
+    theta = LOAD_SAMPLE(theta_samples, diffusion_index);
+    phi = LOAD_SAMPLE(phi_samples, diffusion_index);
+#endif
     
     xyz.s0 = 0.25 * cos( phi ) * sin( theta );
     xyz.s1 = 0.25 * sin( phi ) * sin( theta );
     xyz.s2 = 0.25 * cos( theta );
+#endif
     
     //
     // jump (aligns direction to prevent zig-zagging)
@@ -142,42 +495,104 @@ __kernel void BasicInterpolate(
       temp_pos.s1 > ymax || ymin > temp_pos.s1 ||
         temp_pos.s2 > zmax || zmin > temp_pos.s2)
     {
-      particle_done[particle_index] = 1;
+      particle_done[particle_index] = PARTICLE_DONE;
       break;
     }
     //
-    // Brain Mask Test - Checks NEAREST vertex.
+    // Mask Tests - Check NEAREST vertex.
     //
-    brain_mask_index = 
-      round(temp_pos.s0)*(sample_nz*sample_ny) +
-        round(temp_pos.s1)*(sample_nz) + round(temp_pos.s2);
+    // the bounds test lets positions reach n, whose nearest vertex
+    // would be past the grid
+    mask_index = GridVoxelOffset(
+      min((unsigned int) round(temp_pos.s0), sample_nx - 1),
+      min((unsigned int) round(temp_pos.s1), sample_ny - 1),
+      min((unsigned int) round(temp_pos.s2), sample_nz - 1),
+      sample_nx, sample_ny, sample_nz, GRID_BRICKED);
 
-    bounds_test = brain_mask[brain_mask_index];
+    mask_bits = mask_volume[mask_index];
 
-    if (bounds_test == 0)
+    if ((mask_bits & MASK_BRAIN) == 0)
+    {
+      particle_done[particle_index] = PARTICLE_DONE;
+      break;
+    }
+    if (mask_bits & MASK_EXCLUSION)
     {
-      particle_done[particle_index] = 1;
+      particle_done[particle_index] = PARTICLE_REJECTED;
       break;
     }
+    waypoints |= mask_bits >> MASK_WAYPOINT_SHIFT;
 
     // update current location
     particle_pos = temp_pos;
+#ifdef OCLPTX_DENSITY
+    // mask_index is the voxel of the new position
+    if (mask_index != last_voxel)
+    {
+      if (!VisitVoxel(visited, visited_slots, mask_index))
+        particle_visited_overflow[particle_index] = 1;
+      last_voxel = mask_index;
+    }
+#endif
+#ifdef OCLPTX_VOXELPATHS
+    entered_voxel = LinearVoxelOffset(
+      min((unsigned int) round(particle_pos.s0), sample_nx - 1),
+      min((unsigned int) round(particle_pos.s1), sample_ny - 1),
+      min((unsigned int) round(particle_pos.s2), sample_nz - 1),
+      sample_nx, sample_ny, sample_nz);
+    if (entered_voxel != recorded_voxel && voxel_count < voxel_slots)
+    {
+      voxels[voxel_count++] = entered_voxel;
+      recorded_voxel = entered_voxel;
+    }
+#endif
     // update last flow vector
     last_xyz = xyz;
     // add to particle paths
-    current_path_index = current_path_index + 1;
-    particle_paths[current_path_index] = particle_pos;
+    path_slot = (path_slot + 1 == path_slots) ? 0 : path_slot + 1;
+    particle_paths[path_start + path_slot] = particle_pos;
     
     // update steps taken
     steps_taken = steps_taken + 1;
     // update step location
     particle_steps_taken[particle_index] = steps_taken;
     
-    if (steps_taken == max_steps){
-      particle_done[particle_index] = 1;
+    if (steps_taken == max_steps || (mask_bits & MASK_TERMINATION)){
+      particle_done[particle_index] = PARTICLE_DONE;
       break;  
     }
   }
+
+  particle_waypoints[particle_index] = waypoints;
+#ifdef OCLPTX_DENSITY
+  particle_last_voxel[particle_index] = last_voxel;
+  // an ended streamline counts its voxels if it is kept, as probtrackx
+  // drops --avoid and --waypoints rejects before adding to fdt_paths
+  if (particle_done[particle_index] == PARTICLE_DONE &&
+      (waypoints & all_waypoints) == all_waypoints)
+  {
+    for (unsigned int v = 0; v < visited_slots; v++)
+      if (visited[v] != 0xFFFFFFFF)
+        DENSITY_COUNT(visited[v]);
+  }
+#endif
+#ifdef OCLPTX_VOXELPATHS
+  particle_voxel_count[particle_index] = voxel_count;
+#endif
+#ifdef OCLPTX_SLABS
+  // out of interval steps: continues from this slab next launch
+  if (interval_steps > 0 && interval_steps_taken == interval_steps)
+    particle_slab[particle_index] =
+      min((unsigned int) particle_pos.s0, sample_nx - 1) / slab_width;
+#endif
+#ifdef OCLPTX_DENSITY
+  }
+#endif
+
+#ifdef OCLPTX_DENSITY_LOCAL
+  barrier(CLK_LOCAL_MEM_FENCE);
+  DensityTableFlush(density_keys, density_counts, density_volume);
+#endif
 }
 
 
@@ -32,6 +32,9 @@
 
 #include <iostream>
 #include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <functional>
 
 #define __CL_ENABLE_EXCEPTIONS
 // adds exception support from CL libraries
@@ -58,6 +61,49 @@ void SimpleInterpolationTest( cl::Context * ocl_context,
 
 std::string DetermineKernel(); //args undetermined yet
 
+std::string DetermineBuildOptions(SampleManager& s_manager,
+                                  SampleLayout layout,
+                                  bool half_samples = false);
+
+MemoryPlanner PlanJob(SampleManager& s_manager, SampleLayout layout);
+
+unsigned int DensityVisitedSlots(SampleManager& s_manager);
+
+PathFormat DeterminePathFormat(SampleManager& s_manager);
+
+void CheckDensityGroupSize( OclEnv* environment,
+                            unsigned int group_size
+                          );
+
+bool EnableHalfSamples( OclEnv* environment,
+                        SampleManager& s_manager,
+                        SampleLayout layout
+                      );
+
+double TrackParticles(  OclEnv* environment,
+                        OclPtxHandler* handler,
+                        SampleManager& s_manager,
+                        SampleLayout layout,
+                        const unsigned int* mask_volume,
+                        const std::function<void()>& batch_done
+                      );
+
+void SampleLayoutBenchmark( SampleManager& s_manager,
+                            const unsigned int* mask_volume
+                          );
+
+void DensityStagingBenchmark( SampleManager& s_manager,
+                              const unsigned int* mask_volume
+                            );
+
+void VoxelLayoutTraceReplay(  const std::vector<float4>& paths,
+                              const std::vector<unsigned int>& steps,
+                              unsigned int path_size,
+                              unsigned int nx,
+                              unsigned int ny,
+                              unsigned int nz
+                            );
+
 //*********************************************************************
 //
 // Main
@@ -92,129 +138,54 @@ int main(int argc, char *argv[] )
 
     s_manager.ParseCommandLine(argc, argv);
 
-    const BedpostXData* f_data = s_manager.GetFDataPtr();
-    const BedpostXData* theta_data = s_manager.GetThetaDataPtr();
-    const BedpostXData* phi_data = s_manager.GetPhiDataPtr();
-
-    unsigned int n_particles = s_manager.GetNumParticles();
-    unsigned int max_steps = s_manager.GetNumMaxSteps();
-    const oclptxOptions& options = s_manager.GetOclptxOptions();
-
-    const float4* initial_positions =
-      s_manager.GetSeedParticles()->data();
-      
-    vector<unsigned short int*> way_masks =
-      s_manager.GetWayMasksToVector();
-      
-    std::cout<<"Data, WayMask Tests: \n";  
-    for (unsigned int i = 0; i < way_masks.size(); i++)
+    const unsigned int* mask_volume =
+      s_manager.GetMaskVolumeToArray();
+
+    if (s_manager.GetOclptxOptions().benchmark.value() &&
+        s_manager.GetOclptxOptions().density.value())
     {
-      for (unsigned int x = 45; x<55; x++)
-      {
-        for (unsigned int y=45; y<55; y++)
-        {
-          for (unsigned int z=25; z<35; z++)
-          {
-            unsigned short int wmask = 
-              way_masks.at(i)[ x*(100*100) + y*100 + z];
-            
-            std::cout<<"("<<x<<","<<y<<","<<z<<"): "<< wmask<<"\n";          
-          }
-        }
-      }
+      DensityStagingBenchmark(s_manager, mask_volume);
     }
-    
-    //std::cout<<"BMaskTest: "<< s_manager.GetBrainMask( 51,51,30) <<"\n";
-    
-    //float4 test_point; 
-    //test_point.s0 = 51.0;
-    //test_point.s1 = 34.0;
-    //test_point.s2 = 24.0;
-      
-    //for(unsigned int t = 1; t < theta_data->ns; t++)
-    //{
-    //unsigned int nx, ny, nz;
-    
-    //nx = theta_data->nx;
-    //ny = theta_data->ny;
-    //nz = theta_data->nz;  
-    
-    //std::cout<<"Data, Mask Tests: \n";  
-    //for (unsigned int x = 45; x<55; x++)
-    //{
-      //for (unsigned int y=45; y<55; y++)
-      //{
-        //for (unsigned int z=25; z<35; z++)
-        //{
-          //unsigned short int bmask = 
-            //brain_mask[ x*(ny*nz) + y*nz + z];
-          
-          //std::cout<<"("<<x<<","<<y<<","<<z<<"): "<< bmask<<"\n";          
-        //}
-      //}
-    //}
-    
-    //std::cout<<"BMaskTest: "<< s_manager.GetBrainMask( 51,51,30) <<"\n";
-    //std::cout<<"FTest: "<< s_manager.GetfData(0, 0, 51,51,30) <<"\n";
-    //std::cout<<"ThetaTest: "<< s_manager.GetThetaData(0, 0, 51,51,30) <<"\n";
-    //std::cout<<"Phi: "<< s_manager.GetPhiData(0, 0, 51,51,30) <<"\n";
-    //}
-
-    //std::cin.get();
-
-    // Access this array like so for a given x,y,z:
-    // seedMask[z*seedMaskVol.xsize()*seedMaskVol.ysize() +
-    //   y*seedMaskVol.zsize() + x]
-
-
-    //cout<<"Count of All Data = "<<countAll<<endl;
-    //cout<<"Count of Non Zero Data = "<<countNonZero<<endl;
-
-    // somwhere in here, this should initialize, based on s_manager
-    // actions:
-    //
-    //OclEnv environment("basic");
-    //unsigned int n_devices = environment.HowManyDevices();
-    ////
-    //// and then (this is a naive, "serial" implementation;
-    ////
-
-    //OclPtxHandler handler(environment.GetContext(),
-                          //environment.GetCq(0),
-                          //environment.GetKernel(0));
+    else if (s_manager.GetOclptxOptions().benchmark.value())
+    {
+      SampleLayoutBenchmark(s_manager, mask_volume);
+    }
+    else
+    {
+      SampleLayout layout = s_manager.GetSampleLayout();
 
-    //std::cout<<"init done\n";
-    //handler.WriteSamplesToDevice( f_data,
-                                  //phi_data,
-                                  //theta_data,
-                                  //static_cast<unsigned int>(1),
-                                  //brain_mask);
-    //std::cout<<"samples done\n";
-    //handler.WriteInitialPosToDevice(  initial_positions,
-                                      //n_particles,
-                                      //max_steps,
-                                      //n_devices,
-                                      //static_cast<unsigned int>(0));
-    //std::cout<<"pos done\n";
-    //handler.SingleBufferInit(n_particles, max_steps);
-    ////handler.DoubleBufferInit( n_particles/2, max_steps);
-    //std::cout<<"dbuff done\n";
-
-    //std::cout<<"Total GPU Memory Allocated (MB): "<<
-      //handler.GpuMemUsed()/1e6 << "\n";
-    //std::cout<<"Press Any Button To Continue...\n";
-    //std::cin.get();
-
-    //handler.Interpolate();
-    //std::cout<<"interp done\n";
-    ////handler.Reduce();
-    ////std::cout<<"reduce done\n";
-    ////handler.Interpolate();
-    ////std::cout<<"interp done\n";
+      OclEnv environment("basic", DetermineBuildOptions(s_manager, layout));
+
+      if (s_manager.GetOclptxOptions().fp16.value())
+        EnableHalfSamples(&environment, s_manager, layout);
+
+      // with --density the counts add up on the device over every batch
+      bool density = s_manager.GetOclptxOptions().density.value();
+      unsigned int group_size =
+        std::max(s_manager.GetOclptxOptions().densitygroup.value(), 0);
+      if (density && group_size > 0)
+        CheckDensityGroupSize(&environment, group_size);
 
-    //handler.ParticlePathsToFile();
+      OclPtxHandler handler(environment.GetContext(),
+                            environment.GetCq(0),
+                            environment.GetKernel(0));
 
-    //delete[] brain_mask;
+      handler.SetDensityGroupSize(group_size);
+      TrackParticles(&environment, &handler, s_manager, layout,
+        mask_volume,
+        [&handler, density]()
+        {
+          if (!density)
+            handler.ParticlePathsToFile();
+        });
+
+      if (density)
+        s_manager.SaveDensityVolume(handler.DensityToHost().data());
+      else
+        handler.ClosePathFile();
+    }
+
+    s_manager.GetHostArena().PrintUsage(std::cout);
   }
 
   std::cout<<"\n\nExiting...\n\n";
@@ -231,6 +202,635 @@ std::string DetermineKernel()
   return std::string("interptest");
 }
 
+//
+// Kernel variant defines matching the sample storage s_manager loaded.
+//
+std::string DetermineBuildOptions(SampleManager& s_manager,
+                                  SampleLayout layout,
+                                  bool half_samples)
+{
+  std::string build_options;
+
+  if (s_manager.GetVoxelIndexToArray() != NULL)
+    build_options += " -D OCLPTX_COMPACT";
+  if (s_manager.GetThetaDataPtr() != NULL &&
+      s_manager.GetThetaDataPtr()->bricked)
+    build_options += " -D OCLPTX_BRICKED";
+  if (s_manager.GetMaskWordBytes() == 1)
+    build_options += " -D OCLPTX_MASK8";
+  if (s_manager.GetMaskWordBytes() == 2)
+    build_options += " -D OCLPTX_MASK16";
+  if (layout == kPackedSamples)
+    build_options += " -D OCLPTX_PACKED";
+  if (layout == kUnitVectorSamples)
+    build_options += " -D OCLPTX_PACKED -D OCLPTX_UNITVEC";
+  if (layout == kCodebookSamples)
+    build_options += " -D OCLPTX_CODEBOOK";
+  if (half_samples)
+    build_options += " -D OCLPTX_HALF";
+  if (s_manager.GetOclptxOptions().slabwidth.value() > 0)
+    build_options += " -D OCLPTX_SLABS";
+  if (s_manager.GetOclptxOptions().density.value())
+    build_options += " -D OCLPTX_DENSITY";
+  if (s_manager.GetOclptxOptions().density.value() &&
+      s_manager.GetOclptxOptions().densitygroup.value() > 0)
+    build_options += " -D OCLPTX_DENSITY_LOCAL";
+  if (s_manager.GetOclptxOptions().voxelpaths.value())
+    build_options += " -D OCLPTX_VOXELPATHS";
+  if (PlanJob(s_manager, layout).NeedsIndex64())
+    build_options += " -D OCLPTX_INDEX64";
+
+  return build_options;
+}
+
+//
+// Device memory and kernel index ranges the job needs, from what
+// s_manager loaded, before anything is allocated.
+//
+MemoryPlanner PlanJob(SampleManager& s_manager, SampleLayout layout)
+{
+  MemoryPlanner planner;
+  planner.SetParticles(s_manager.GetSeedParticles()->size(),
+    s_manager.GetNumMaxSteps());
+
+  const BedpostXData* theta_data = s_manager.GetThetaDataPtr();
+  if (theta_data == NULL)
+    return planner;
+
+  // --fp16 converts every layout but the codebook
+  bool half_samples = (layout != kCodebookSamples &&
+    theta_data->half_data.size() > 0);
+
+  if (layout == kCodebookSamples)
+    planner.SetSamples(theta_data->nvoxels, theta_data->ns, 1,
+      sizeof(unsigned int));
+  else if (layout == kSeparateSamples)
+    planner.SetSamples(theta_data->nvoxels, theta_data->ns, 3,
+      half_samples ? sizeof(unsigned short) : sizeof(float));
+  else
+    planner.SetSamples(theta_data->nvoxels, theta_data->ns, 1,
+      half_samples ? 4*sizeof(unsigned short) : sizeof(float4));
+
+  planner.SetGrid(GridVoxelCount(theta_data->nx, theta_data->ny,
+    theta_data->nz, theta_data->bricked), s_manager.GetMaskWordBytes(),
+    s_manager.GetVoxelIndexToArray() != NULL);
+
+  unsigned int slab_width = std::max(
+    s_manager.GetOclptxOptions().slabwidth.value(), 0);
+  if (slab_width > 0)
+  {
+    std::vector<unsigned int> slab_first_voxel;
+    unsigned int slab_voxels = OclPtxHandler::CutSlabs(&slab_width,
+      theta_data->nx, theta_data->ny, theta_data->nz, theta_data->bricked,
+      s_manager.GetVoxelIndexToArray(), &slab_first_voxel);
+    unsigned int slabs = slab_first_voxel.size() - 1;
+    unsigned int resident = std::max(
+      s_manager.GetOclptxOptions().residentslabs.value(), 1);
+    planner.SetSlabStreaming(slabs, std::min(resident, slabs), slab_voxels);
+  }
+
+  planner.SetPathChunk(
+    std::max(s_manager.GetOclptxOptions().pathchunk.value(), 0));
+  planner.SetDensityMap(s_manager.GetOclptxOptions().density.value(),
+    DensityVisitedSlots(s_manager));
+  planner.SetVoxelPaths(s_manager.GetOclptxOptions().voxelpaths.value());
+
+  return planner;
+}
+
+//
+// --pathformat
+//
+PathFormat DeterminePathFormat(SampleManager& s_manager)
+{
+  const std::string format = s_manager.GetOclptxOptions().pathformat.value();
+  if (format == "tck")
+    return kTckPaths;
+  if (format == "csv")
+    return kCsvPaths;
+  if (format == "packed")
+    return kPackedPaths;
+
+  std::cout<<"Error: unknown --pathformat " << format <<
+    " (expected tck, csv or packed)\n";
+  exit(1);
+}
+
+//
+// --visitedslots as the kernel's visited sets take it: a power of two,
+// and no fewer than the probes basic.cl makes (VISITED_PROBES). Unset,
+// twice the voxels a streamline typically enters: steps are a quarter
+// voxel, so about nsteps/4 + 1, and a half full set keeps probe runs
+// short. Streamlines that still fill theirs are reported.
+//
+unsigned int DensityVisitedSlots(SampleManager& s_manager)
+{
+  unsigned int wanted = std::max(
+    s_manager.GetOclptxOptions().visitedslots.value(), 0);
+  if (wanted == 0)
+    wanted = 2*(s_manager.GetNumMaxSteps()/4 + 1);
+
+  unsigned int slots = 16;
+  while (slots < wanted && slots < (1u << 31))
+    slots *= 2;
+
+  return slots;
+}
+
+//
+// --densitygroup against the first device: work-groups no larger than
+// the device takes, nor than the built kernel can run with its local
+// density table. Checked before anything is uploaded or launched.
+//
+void CheckDensityGroupSize( OclEnv* environment,
+                            unsigned int group_size
+                          )
+{
+  size_t device_max = environment->GetMaxWorkGroupSize(0);
+  size_t kernel_max = environment->GetKernelWorkGroupSize(0, 0);
+  if (group_size > device_max || group_size > kernel_max)
+  {
+    std::cout<<"--densitygroup " << group_size << " is larger than the "
+      "work-groups the device runs (" << device_max << ", " <<
+        kernel_max << " for this kernel)\n";
+    exit(1);
+  }
+}
+
+//
+// --fp16: converts s_manager's samples to half and rebuilds the kernel
+// to read them, if the first device can take it. Otherwise leaves
+// everything in float. Returns true if half storage is in use.
+//
+bool EnableHalfSamples( OclEnv* environment,
+                        SampleManager& s_manager,
+                        SampleLayout layout
+                      )
+{
+  if (layout == kCodebookSamples)
+  {
+    std::cout<<"--fp16 has no effect on codebook samples, ignoring\n";
+    return false;
+  }
+  if (!environment->SupportsHalfStorage(0))
+  {
+    std::cout<<"Device does not report cl_khr_fp16, "
+      "keeping samples in float\n";
+    return false;
+  }
+
+  s_manager.ConvertSamplesToHalf();
+  environment->SetBuildOptions(
+    DetermineBuildOptions(s_manager, layout, true));
+
+  return true;
+}
+
+//
+// Uploads s_manager's samples (in the given layout) and seed particles
+// through handler, then tracks every particle to completion on the
+// first device, in as many batches as the device memory needs.
+// batch_done runs after each batch, while its results are on the
+// device. Returns the time spent in the kernel, in seconds.
+//
+double TrackParticles(  OclEnv* environment,
+                        OclPtxHandler* handler,
+                        SampleManager& s_manager,
+                        SampleLayout layout,
+                        const unsigned int* mask_volume,
+                        const std::function<void()>& batch_done
+                      )
+{
+  unsigned int n_particles = s_manager.GetSeedParticles()->size();
+  unsigned int max_steps = s_manager.GetNumMaxSteps();
+  unsigned int n_devices = environment->HowManyDevices();
+
+  const float4* initial_positions =
+    s_manager.GetSeedParticles()->data();
+
+  // the first device tracks its share of the seeds
+  unsigned int section_size = n_particles/n_devices;
+
+  MemoryPlanner plan = PlanJob(s_manager, layout);
+  plan.SetParticles(section_size, max_steps);
+  plan.SetDeviceLimits(environment->GetGlobalMemSize(0),
+    environment->GetMaxAllocSize(0));
+  plan.Report(std::cout);
+  if (!plan.Fits())
+  {
+    std::cout<<"Job does not fit, see the memory plan above\n";
+    exit(1);
+  }
+
+  // --slabwidth: upload slabs of the samples as the particles need them
+  int slab_width = s_manager.GetOclptxOptions().slabwidth.value();
+  if (slab_width > 0)
+    handler->SetSlabStreaming(slab_width,
+      std::max(s_manager.GetOclptxOptions().residentslabs.value(), 1),
+      environment->GetTransferCq(0));
+
+  // --pathchunk: path rings drained to the host between launches
+  handler->SetPathChunk(
+    std::max(s_manager.GetOclptxOptions().pathchunk.value(), 0));
+
+  // --density: visit counts instead of paths, added as each particle
+  // ends if --avoid and --waypoints keep it
+  handler->SetDensityMap(s_manager.GetOclptxOptions().density.value(),
+    DensityVisitedSlots(s_manager), s_manager.GetWayMaskCount());
+
+  // --voxelpaths: the voxels entered instead of every step's position
+  if (s_manager.GetOclptxOptions().voxelpaths.value() &&
+      s_manager.GetOclptxOptions().density.value())
+  {
+    std::cout<<"--voxelpaths writes paths, it can't be used with --density\n";
+    exit(1);
+  }
+  handler->SetVoxelPaths(s_manager.GetOclptxOptions().voxelpaths.value());
+
+  // --pathformat etc., for batch_done callers that write paths
+  float voxel_to_world[12];
+  s_manager.GetVoxelToWorld(voxel_to_world);
+  handler->SetPathOutput(DeterminePathFormat(s_manager), voxel_to_world,
+    s_manager.GetOclptxOptions().pathgzip.value(),
+    std::max(s_manager.GetOclptxOptions().writequeue.value(), 1),
+    section_size);
+
+  handler->SetMaskWordBytes(s_manager.GetMaskWordBytes());
+
+  std::cout<<"init done\n";
+  if (layout == kPackedSamples || layout == kUnitVectorSamples)
+  {
+    const PackedSampleData* packed_data =
+      (layout == kPackedSamples) ? s_manager.GetPackedDataPtr() :
+                                   s_manager.GetUnitVectorDataPtr();
+    handler->WritePackedSamplesToDevice(packed_data,
+                                        static_cast<unsigned int>(1),
+                                        mask_volume,
+                                        s_manager.GetVoxelIndexToArray());
+  }
+  else if (layout == kCodebookSamples)
+  {
+    handler->WriteCodebookSamplesToDevice(
+      s_manager.GetCodebookDataPtr(),
+      s_manager.GetDirectionCodebook().GetEntries(),
+      DirectionCodebook::kNumEntries,
+      static_cast<unsigned int>(1),
+      mask_volume,
+      s_manager.GetVoxelIndexToArray());
+  }
+  else
+  {
+    handler->WriteSamplesToDevice(s_manager.GetFDataPtr(),
+                                  s_manager.GetPhiDataPtr(),
+                                  s_manager.GetThetaDataPtr(),
+                                  static_cast<unsigned int>(1),
+                                  mask_volume,
+                                  s_manager.GetVoxelIndexToArray());
+  }
+  std::cout<<"samples done\n";
+
+  unsigned int batch_size = plan.GetBatchParticles();
+  double seconds = 0.0;
+  unsigned int visited_overflows = 0;
+  for (unsigned int first = 0; first < section_size; first += batch_size)
+  {
+    unsigned int batch = std::min(batch_size, section_size - first);
+
+    handler->WriteInitialPosToDevice( initial_positions + first,
+                                      batch,
+                                      max_steps,
+                                      static_cast<unsigned int>(1),
+                                      static_cast<unsigned int>(0));
+    std::cout<<"pos done\n";
+    handler->SingleBufferInit(batch, max_steps);
+    //handler->DoubleBufferInit( n_particles/2, max_steps);
+    std::cout<<"dbuff done\n";
+
+    std::cout<<"Total GPU Memory Allocated (MB): "<<
+      handler->GpuMemUsed()/1e6 << ", headroom (MB): " <<
+        (environment->GetGlobalMemSize(0) - handler->GpuMemUsed())/1e6 <<
+          "\n";
+
+    auto t_start = std::chrono::high_resolution_clock::now();
+    handler->Interpolate();
+    auto t_end = std::chrono::high_resolution_clock::now();
+    std::cout<<"interp done, particles " << first << " to " <<
+      first + batch << "\n";
+    //handler->Reduce();
+    //std::cout<<"reduce done\n";
+    //handler->Interpolate();
+    //std::cout<<"interp done\n";
+
+    seconds += std::chrono::duration_cast<std::chrono::microseconds>(
+      t_end-t_start).count()/1e6;
+
+    visited_overflows += handler->VisitedOverflowsToHost();
+    batch_done();
+  }
+
+  if (visited_overflows > 0)
+    std::cout<<"Warning: " << visited_overflows << " streamlines filled "
+      "their " << DensityVisitedSlots(s_manager) << " visited slots, some "
+        "voxels they entered were not counted (raise --visitedslots)\n";
+
+  return seconds;
+}
+
+//
+// Runs the same seeds through every sample layout and reports kernel
+// throughput, so layouts can be compared on real data.
+//
+void SampleLayoutBenchmark( SampleManager& s_manager,
+                            const unsigned int* mask_volume
+                          )
+{
+  std::vector<SampleLayout> layouts =
+    {kSeparateSamples, kPackedSamples, kUnitVectorSamples,
+      kCodebookSamples};
+  std::vector<std::string> layout_names =
+    {"three-buffer", "packed", "unit vector", "codebook"};
+  std::vector<bool> half_runs(layouts.size(), false);
+
+  // with --fp16, the float layouts are run again from half storage
+  // (after all float runs, since the handler uploads half_data when
+  // present)
+  if (s_manager.GetOclptxOptions().fp16.value())
+  {
+    for (unsigned int l = 0; l < 3; l++)
+    {
+      layouts.push_back(layouts.at(l));
+      layout_names.push_back(layout_names.at(l) + " fp16");
+      half_runs.push_back(true);
+    }
+  }
+  unsigned int n_layouts = layouts.size();
+
+  s_manager.BuildPackedSamples();
+  s_manager.BuildUnitVectorSamples();
+  s_manager.BuildCodebookSamples();
+
+  std::vector<double> steps_per_second;
+  std::vector<float> max_deviation;
+  std::vector<float4> reference_endpoints;
+  std::vector<float4> reference_paths;
+  std::vector<unsigned int> reference_steps;
+  for (unsigned int l = 0; l < n_layouts; l++)
+  {
+    OclEnv environment("basic",
+      DetermineBuildOptions(s_manager, layouts.at(l)));
+
+    if (half_runs.at(l) &&
+        !EnableHalfSamples(&environment, s_manager, layouts.at(l)))
+    {
+      n_layouts = l;
+      break;
+    }
+
+    OclPtxHandler handler(environment.GetContext(),
+                          environment.GetCq(0),
+                          environment.GetKernel(0));
+
+    // results are gathered batch by batch
+    unsigned long steps = 0;
+    std::vector<float4> endpoints;
+    double seconds = TrackParticles(&environment, &handler, s_manager,
+      layouts.at(l), mask_volume,
+      [&]()
+      {
+        steps += handler.TotalStepsTaken();
+
+        std::vector<float4> batch_endpoints = handler.ParticleEndpoints();
+        endpoints.insert(endpoints.end(), batch_endpoints.begin(),
+          batch_endpoints.end());
+
+        if (l == 0)
+        {
+          std::vector<float4> batch_paths;
+          std::vector<unsigned int> batch_steps;
+          handler.ParticlePathsToHost(&batch_paths, &batch_steps);
+          reference_paths.insert(reference_paths.end(),
+            batch_paths.begin(), batch_paths.end());
+          reference_steps.insert(reference_steps.end(),
+            batch_steps.begin(), batch_steps.end());
+        }
+      });
+
+    steps_per_second.push_back(seconds > 0.0 ? steps/seconds : 0.0);
+    std::cout<<"Benchmark " << layout_names.at(l) << ": " << steps <<
+      " steps in " << seconds << " s\n";
+
+    // every layout must track the same paths as the three-buffer
+    // (angle based) kernel, up to float rounding
+    if (l == 0)
+      reference_endpoints = endpoints;
+
+    float deviation = 0.0;
+    for (unsigned int n = 0; n < endpoints.size(); n++)
+    {
+      float dx = endpoints.at(n).x - reference_endpoints.at(n).x;
+      float dy = endpoints.at(n).y - reference_endpoints.at(n).y;
+      float dz = endpoints.at(n).z - reference_endpoints.at(n).z;
+      deviation = std::max(deviation, std::sqrt(dx*dx + dy*dy + dz*dz));
+    }
+    max_deviation.push_back(deviation);
+  }
+
+  std::cout<<"\nSample Layout Benchmark (steps/second, max endpoint "
+    "deviation from three-buffer in voxels)\n";
+  for (unsigned int l = 0; l < n_layouts; l++)
+  {
+    std::cout<<"\t" << layout_names.at(l) << ": " <<
+      steps_per_second.at(l);
+    if (l > 0 && steps_per_second.at(0) > 0.0)
+      std::cout<<" (x" << steps_per_second.at(l)/steps_per_second.at(0)
+        << ")";
+    std::cout<<", " << max_deviation.at(l) << "\n";
+  }
+
+  const BedpostXData* samples = s_manager.GetThetaDataPtr();
+  VoxelLayoutTraceReplay(reference_paths, reference_steps,
+    s_manager.GetNumMaxSteps() + 1, samples->nx, samples->ny, samples->nz);
+}
+
+//
+// --benchmark --density: tracks the same seeds counting straight into
+// the density volume with global atomics, then staging the counts per
+// work-group (--densitygroup particles, 64 if unset). Both runs launch
+// the same work-groups, only -D OCLPTX_DENSITY_LOCAL differs. Many
+// particles from one seed voxel are the case staging is for: they all
+// start by hitting the same few voxels. Both runs must give the same
+// counts.
+//
+void DensityStagingBenchmark( SampleManager& s_manager,
+                              const unsigned int* mask_volume
+                            )
+{
+  SampleLayout layout = s_manager.GetSampleLayout();
+
+  unsigned int group_size = 64;
+  if (s_manager.GetOclptxOptions().densitygroup.value() > 0)
+    group_size = s_manager.GetOclptxOptions().densitygroup.value();
+
+  // DetermineBuildOptions follows --densitygroup, the runs choose here
+  std::string direct_options = DetermineBuildOptions(s_manager, layout);
+  const std::string local_define = " -D OCLPTX_DENSITY_LOCAL";
+  size_t local_at = direct_options.find(local_define);
+  if (local_at != std::string::npos)
+    direct_options.erase(local_at, local_define.size());
+
+  const std::vector<bool> staged = {false, true};
+  const std::vector<std::string> run_names =
+    {"global atomics", "local staging"};
+  std::vector<double> steps_per_second;
+  std::vector<unsigned int> reference_counts;
+  unsigned int mismatched_voxels = 0;
+  for (unsigned int r = 0; r < staged.size(); r++)
+  {
+    OclEnv environment("basic", direct_options +
+      (staged.at(r) ? local_define : std::string()));
+    CheckDensityGroupSize(&environment, group_size);
+
+    OclPtxHandler handler(environment.GetContext(),
+                          environment.GetCq(0),
+                          environment.GetKernel(0));
+    handler.SetDensityGroupSize(group_size);
+
+    unsigned long steps = 0;
+    double seconds = TrackParticles(&environment, &handler, s_manager,
+      layout, mask_volume,
+      [&]() { steps += handler.TotalStepsTaken(); });
+
+    steps_per_second.push_back(seconds > 0.0 ? steps/seconds : 0.0);
+    std::cout<<"Benchmark " << run_names.at(r) << ": " << steps <<
+      " steps in " << seconds << " s\n";
+
+    std::vector<unsigned int> counts = handler.DensityToHost();
+    if (r == 0)
+      reference_counts = counts;
+    else
+      for (unsigned int v = 0; v < counts.size(); v++)
+        if (counts.at(v) != reference_counts.at(v))
+          mismatched_voxels++;
+  }
+
+  std::cout<<"\nDensity Staging Benchmark (" <<
+    s_manager.GetSeedParticles()->size() << " particles, " << group_size <<
+    " per work-group, steps/second)\n";
+  std::cout<<"\t" << run_names.at(0) << ": " << steps_per_second.at(0) <<
+    "\n";
+  std::cout<<"\t" << run_names.at(1) << ": " << steps_per_second.at(1);
+  if (steps_per_second.at(0) > 0.0)
+    std::cout<<" (x" << steps_per_second.at(1)/steps_per_second.at(0) <<
+      ")";
+  std::cout<<"\n\tvoxels with different counts: " << mismatched_voxels <<
+    "\n";
+}
+
+//
+// Replays the voxel accesses of recorded particle paths (one packed
+// float4 sample fetch at the root vertex and one mask word at the
+// nearest vertex per step, particles advancing in lockstep as on the
+// device) against the linear and bricked grid layouts. Reports cache
+// misses from a simulated 32 KB L1 / 2 MB L2, DRAM page (4 KB)
+// switches, and the time of real host gathers in each layout. Both
+// layouts are replayed from the same traces, whichever one was loaded.
+//
+void VoxelLayoutTraceReplay(  const std::vector<float4>& paths,
+                              const std::vector<unsigned int>& steps,
+                              unsigned int path_size,
+                              unsigned int nx,
+                              unsigned int ny,
+                              unsigned int nz
+                            )
+{
+  const std::string layout_names[] = {"linear", "bricked"};
+  const std::string order_names[] = {"lockstep", "per path"};
+
+  // (particle, step) visit orders: all particles advancing together as
+  // on the device, and each path on its own
+  std::vector< std::vector<unsigned int> > orders(2);
+  unsigned int longest = 0;
+  for (unsigned int n = 0; n < steps.size(); n++)
+    longest = std::max(longest, steps.at(n));
+  for (unsigned int s = 0; s < longest; s++)
+    for (unsigned int n = 0; n < steps.size(); n++)
+      if (s < steps.at(n))
+        orders.at(0).push_back(n*path_size + s);
+  for (unsigned int n = 0; n < steps.size(); n++)
+    for (unsigned int s = 0; s < steps.at(n); s++)
+      orders.at(1).push_back(n*path_size + s);
+
+  std::cout<<"\nVoxel Layout Trace Replay (" << steps.size() <<
+    " paths, misses per 1000 steps)\n";
+  for (int bricked = 0; bricked < 2; bricked++)
+  {
+    const unsigned int grid_size = GridVoxelCount(nx, ny, nz, bricked);
+    // sample records and mask words live in separate arrays
+    std::vector<float4> sample_grid(grid_size, float4());
+    std::vector<unsigned int> mask_grid(grid_size, 1);
+
+    for (unsigned int o = 0; o < orders.size(); o++)
+    {
+      CacheSimulator l1(32 << 10, 8);
+      CacheSimulator l2(2 << 20, 16);
+      uint64_t page_switches = 0;
+      uint64_t last_page[] = {~static_cast<uint64_t>(0),
+        ~static_cast<uint64_t>(0)};
+      unsigned long total_steps = 0;
+      float checksum = 0.0;
+
+      auto t_start = std::chrono::high_resolution_clock::now();
+      for (unsigned int v = 0; v < orders.at(o).size(); v++)
+      {
+        const float4& pos = paths.at(orders.at(o).at(v));
+        const float4& next = paths.at(orders.at(o).at(v) + 1);
+        // the kernel lets a particle sit exactly on the upper bound
+        if (round(next.x) >= nx || round(next.y) >= ny ||
+            round(next.z) >= nz)
+          continue;
+
+        const uint64_t sample_offset = GridVoxelOffset(
+          static_cast<unsigned int>(floor(pos.x)),
+          static_cast<unsigned int>(floor(pos.y)),
+          static_cast<unsigned int>(floor(pos.z)), nx, ny, nz, bricked);
+        const uint64_t mask_offset = GridVoxelOffset(
+          static_cast<unsigned int>(round(next.x)),
+          static_cast<unsigned int>(round(next.y)),
+          static_cast<unsigned int>(round(next.z)), nx, ny, nz, bricked);
+
+        checksum += sample_grid[sample_offset].x +
+          mask_grid[mask_offset];
+
+        // the two arrays are placed 1 TB apart in the simulated space
+        const uint64_t addresses[] = {sample_offset*sizeof(float4),
+          (static_cast<uint64_t>(1) << 40) +
+            mask_offset*sizeof(unsigned int)};
+        for (unsigned int a = 0; a < 2; a++)
+        {
+          if (!l1.Access(addresses[a]))
+            l2.Access(addresses[a]);
+          if (addresses[a]/4096 != last_page[a])
+            page_switches++;
+          last_page[a] = addresses[a]/4096;
+        }
+        total_steps++;
+      }
+      auto t_end = std::chrono::high_resolution_clock::now();
+      double seconds =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          t_end-t_start).count()/1e6;
+
+      const double per_1000 = total_steps > 0 ? 1000.0/total_steps : 0.0;
+      std::cout<<"\t" << layout_names[bricked] << ", " <<
+        order_names[o] << ": L1 " << l1.GetMisses()*per_1000 <<
+        ", L2 " << l2.GetMisses()*per_1000 << ", page switches " <<
+        page_switches*per_1000 << ", host replay " <<
+        (seconds > 0.0 ? total_steps/seconds : 0.0) << " steps/s" <<
+        " (checksum " << checksum << ")\n";
+    }
+  }
+}
+
 void SimpleInterpolationTest( cl::Context* ocl_context,
                               cl::CommandQueue* cq,
                               cl::Kernel* test_kernel)
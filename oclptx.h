@@ -36,6 +36,9 @@
 #include "oclptxhandler.h"
 #include "samplemanager.h"
 #include "customtypes.h"
+#include "cachesimulator.h"
+#include "memoryplanner.h"
+#include "voxelindex.h"
 #include "interptest.cc"
 
 #endif
@@ -146,6 +146,33 @@ class oclptxOptions {
   Option<int>              fibst;
   Option<int>              rseed;
 
+  // sample loading
+  Option<bool>             nommap;
+  Option<int>              loadthreads;
+  Option<int>              inflatethreads;
+  Option<std::string>      samplecache;
+  Option<bool>             mlockHost;
+  Option<bool>             compact;
+  Option<bool>             bricked;
+  Option<bool>             crop;
+  Option<int>              subset;
+  Option<bool>             randsubset;
+  Option<int>              slabwidth;
+  Option<int>              residentslabs;
+  Option<int>              pathchunk;
+  Option<bool>             density;
+  Option<int>              densitygroup;
+  Option<int>              visitedslots;
+  Option<std::string>      pathformat;
+  Option<bool>             pathgzip;
+  Option<int>              writequeue;
+  Option<bool>             voxelpaths;
+  Option<bool>             packed;
+  Option<bool>             unitvec;
+  Option<bool>             codebook;
+  Option<bool>             fp16;
+  Option<bool>             benchmark;
+
   // hidden options
   FmribOption<std::string>      prefdirfile;      // inside this mask, pick orientation closest to whatever is in here
   FmribOption<std::string>      skipmask;         // inside this mask, ignore data (inertia)
@@ -342,6 +369,82 @@ inline oclptxOptions::oclptxOptions():
    std::string("\tRandom seed"),
    false, requires_argument),
 
+   nommap(std::string("--nommap"), false,
+   std::string("\tRead samples through NEWIMAGE instead of memory mapping (.nii) or inflating (.nii.gz) them directly"),
+   false, no_argument),
+   loadthreads(std::string("--loadthreads"), 0,
+   std::string("Threads used to load sample files - default=0 (one per core)"),
+   false, requires_argument),
+   inflatethreads(std::string("--inflatethreads"), 0,
+   std::string("Threads used to inflate each .nii.gz sample file, at most the cores shared out over --loadthreads - default=0 (that share). Only BGZF files (bgzip) inflate in parallel; plain gzip, as FSL writes it, is inflated on one thread"),
+   false, requires_argument),
+   samplecache(std::string("--cache"), std::string(""),
+   std::string("Preprocessed sample cache file, written on the first run and mapped on later runs with the same inputs"),
+   false, requires_argument),
+   mlockHost(std::string("--mlock"), false,
+   std::string("\tLock the loaded samples and masks into RAM (mlock) so they are never swapped out; this is not OpenCL pinned memory and does not speed up device uploads"),
+   false, no_argument),
+   compact(std::string("--compact"), false,
+   std::string("\tStore samples only for voxels inside the brain mask (-m)"),
+   false, no_argument),
+   bricked(std::string("--bricked"), false,
+   std::string("\tStore sample and mask volumes in 8x8x8 bricks, Morton ordered within each brick"),
+   false, no_argument),
+   crop(std::string("--crop"), false,
+   std::string("\tCrop sample and mask volumes to the brain mask bounding box (outputs keep the full image frame)"),
+   false, no_argument),
+   subset(std::string("--subset"), 0,
+   std::string("\tLoad only this many of the bedpostX samples per fibre, evenly strided (0 = all)"),
+   false, requires_argument),
+   randsubset(std::string("--randsubset"), false,
+   std::string("\tDraw the --subset samples at random (from --rseed) instead of evenly strided"),
+   false, no_argument),
+   slabwidth(std::string("--slabwidth"), 0,
+   std::string("\tStream the samples to the device in slabs of this many x planes, for volumes larger than device memory (0 = whole volume resident)"),
+   false, requires_argument),
+   residentslabs(std::string("--residentslabs"), 4,
+   std::string("\tSlabs kept on the device at once with --slabwidth (plus one being prefetched)"),
+   false, requires_argument),
+   pathchunk(std::string("--pathchunk"), 0,
+   std::string("\tKeep only this many path positions per particle on the device, drained to the host between launches (0 = all max steps)"),
+   false, requires_argument),
+   density(std::string("--density"), false,
+   std::string("\tCount visits per voxel on the device and write them (--dir/--out) instead of the paths; streamlines --avoid or --waypoints reject are not counted"),
+   false, no_argument),
+   densitygroup(std::string("--densitygroup"), 0,
+   std::string("\tWith --density, stage counts in local memory per work-group of this many particles (0 = global atomics)"),
+   false, requires_argument),
+   visitedslots(std::string("--visitedslots"), 0,
+   std::string("\tWith --density, voxels each streamline remembers so it counts every voxel once (rounded up to a power of two, at least 16; 0 = twice the nsteps/4 + 1 voxels of a quarter voxel step path)"),
+   false, requires_argument),
+   pathformat(std::string("--pathformat"), std::string("tck"),
+   std::string("\tPath output: tck (binary MRtrix tracks, world mm), csv (text, image voxels) or packed (fixed-point deltas, oclptxdecode reads them; about 3 bytes per point, the 8-10x saving over float4 paths needs --pathgzip)"),
+   false, requires_argument),
+   pathgzip(std::string("--pathgzip"), false,
+   std::string("\tGzip the path output (.gz)"),
+   false, no_argument),
+   writequeue(std::string("--writequeue"), 2,
+   std::string("\tBatches of paths that may wait for the writer thread before tracking blocks"),
+   false, requires_argument),
+   voxelpaths(std::string("--voxelpaths"), false,
+   std::string("\tRecord paths as the voxels entered (4 bytes per crossing on the device) and write voxel centres; consecutive centres are a whole voxel apart, so --pathformat packed takes more than one byte per coordinate"),
+   false, no_argument),
+   packed(std::string("--packed"), false,
+   std::string("\tInterleave theta/phi/f into one float4 record per sample on the device"),
+   false, no_argument),
+   unitvec(std::string("--unitvec"), false,
+   std::string("\tPrecompute fibre unit vectors at load time (packed (x,y,z,f) records)"),
+   false, no_argument),
+   codebook(std::string("--codebook"), false,
+   std::string("\tStore samples as 16 bit direction codebook indices plus 8 bit f"),
+   false, no_argument),
+   fp16(std::string("--fp16"), false,
+   std::string("\tStore device samples as IEEE half (falls back to float without cl_khr_fp16)"),
+   false, no_argument),
+   benchmark(std::string("--benchmark"), false,
+   std::string("\tTime the tracking kernel with each sample layout and report steps/second (with --density: global atomics against local staging, best with one seed voxel and a large -P)\n\n"),
+   false, no_argument),
+
 
    prefdirfile(std::string("--prefdir"), std::string(""),
          std::string("Prefered orientation preset in a 4D mask"),
@@ -439,6 +542,32 @@ inline oclptxOptions::oclptxOptions():
        options.add(fibst);
        options.add(rseed);
 
+       options.add(nommap);
+       options.add(loadthreads);
+       options.add(inflatethreads);
+       options.add(samplecache);
+       options.add(mlockHost);
+       options.add(compact);
+       options.add(bricked);
+       options.add(crop);
+       options.add(subset);
+       options.add(randsubset);
+       options.add(slabwidth);
+       options.add(residentslabs);
+       options.add(pathchunk);
+       options.add(density);
+       options.add(densitygroup);
+       options.add(visitedslots);
+       options.add(pathformat);
+       options.add(pathgzip);
+       options.add(writequeue);
+       options.add(voxelpaths);
+       options.add(packed);
+       options.add(unitvec);
+       options.add(codebook);
+       options.add(fp16);
+       options.add(benchmark);
+
        options.add(skipmask);
        options.add(prefdirfile);
        options.add(forcefirststep);
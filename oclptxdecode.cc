@@ -0,0 +1,100 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* oclptxdecode.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+// Converts --pathformat packed output (plain or gzipped) back to
+// streamlines other tools read: a .tck file in world mm, or the csv
+// rows of --pathformat csv in image voxels.
+//
+//    oclptxdecode <paths.oclp[.gz]> <out.tck | out.dat>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "customtypes.h"
+#include "streamlinecodec.h"
+#include "streamlinewriter.h"
+
+int main(int argc, char *argv[])
+{
+  if (argc != 3)
+  {
+    std::cout<<"Usage: oclptxdecode <paths.oclp[.gz]> <out.tck | out.dat>\n"
+      "\t.tck output is in world mm, anything else is csv in image voxels"
+        <<std::endl;
+    return 1;
+  }
+
+  const std::string in_name = argv[1];
+  const std::string out_name = argv[2];
+
+  // gzread passes plain files through as they are
+  gzFile in_file = gzopen(in_name.c_str(), "rb");
+  if (in_file == NULL)
+  {
+    std::cout<<"Error: could not open "<<in_name<<std::endl;
+    return 1;
+  }
+  gzbuffer(in_file, 1 << 20);
+
+  float voxel_to_world[12];
+  uint64_t count;
+  StreamlineCodec codec =
+    StreamlineCodec::ReadHeader(in_file, voxel_to_world, &count);
+
+  bool tck = out_name.size() > 4 &&
+    out_name.compare(out_name.size() - 4, 4, ".tck") == 0;
+
+  StreamlineWriter writer;
+  writer.SetVoxelToWorld(voxel_to_world);
+  writer.Open(out_name, tck ? kTckPaths : kCsvPaths, false, count);
+
+  std::vector<float4> path;
+  while (codec.Decode(in_file, &path))
+    writer.WriteStreamline(path.data(), path.size());
+  gzclose(in_file);
+
+  if (writer.GetCount() != count)
+    std::cout<<"Warning: header says "<<count<<" streamlines, found "<<
+      writer.GetCount()<<"\n";
+  std::cout<<writer.GetCount()<<" streamlines ("<<writer.GetPoints()<<
+    " points, within "<<codec.GetQuantum()/2<<
+      " voxels of the tracked positions) written to "<<out_name<<"\n";
+  writer.Close();
+
+  return 0;
+}
+
+//EOF
@@ -35,6 +35,7 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <algorithm>
 #include <mutex>
 //#include <mutex>
 //#include <thread>
@@ -51,6 +52,7 @@
 #endif
 
 #include "oclptxhandler.h"
+#include "voxelindex.h"
 
 //
 // Assorted Functions Declerations
@@ -80,6 +82,37 @@ OclPtxHandler::OclPtxHandler(
   this->ptx_kernel = ck;
 
   this->total_gpu_mem_size = 0;
+  this->particle_gpu_mem_size = 0;
+  this->compact_samples = false;
+  this->mask_word_bytes = sizeof(unsigned int);
+  this->half_samples = false;
+  this->bricked_grid = false;
+  this->grid_origin = float4();
+  this->path_format = kCsvPaths;
+  this->path_compress = false;
+  this->path_queue_batches = 1;
+  this->path_streamlines = 0;
+  for (int i = 0; i < 12; i++)
+    this->path_voxel_to_world[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+  this->sample_layout = kSeparateSamples;
+
+  this->transfer_cq = NULL;
+  this->slab_width = 0;
+  this->resident_slabs = 0;
+  this->n_slabs = 0;
+  this->slab_capacity = 0;
+
+  this->path_chunk = 0;
+  this->chunked_paths = false;
+  this->device_path_size = 0;
+
+  this->density_map = false;
+  this->density_mem_size = 0;
+  this->density_group_size = 0;
+  this->visited_slots = 0;
+  this->all_waypoints = 0;
+  this->voxel_paths = false;
+  this->voxel_slots = 0;
 }
 
 
@@ -98,114 +131,232 @@ OclPtxHandler::~OclPtxHandler()
 //
 //*********************************************************************
 
-void OclPtxHandler::ParticlePathsToFile()
+void OclPtxHandler::SetPathOutput(PathFormat format,
+                                  const float* voxel_to_world,
+                                  bool compress,
+                                  unsigned int queue_batches,
+                                  uint64_t streamlines)
 {
-  float4 * particle_paths;
-  particle_paths =
-    new float4[this->n_particles*this->particle_path_size];
-  unsigned int * particle_steps;
-  particle_steps = new unsigned int[this->n_particles];
+  this->path_format = format;
+  std::copy(voxel_to_world, voxel_to_world + 12, this->path_voxel_to_world);
+  this->path_compress = compress;
+  this->path_queue_batches = queue_batches;
+  this->path_streamlines = streamlines;
+}
 
-  this->ocl_cq->enqueueReadBuffer(
-    this->particle_paths_buffer,
-    CL_FALSE,
-    0,
-    this->particles_mem_size,
-    particle_paths
-  );
-  this->ocl_cq->enqueueReadBuffer(
-    this->particle_steps_taken_buffer,
-    CL_FALSE,
-    0,
-    this->particle_uint_mem_size,
-    particle_steps
-  );
+void OclPtxHandler::ClosePathFile()
+{
+  if (this->path_writer.IsRunning())
+  {
+    this->path_writer.Finish();
+    this->path_writer.Report(std::cout);
+  }
+}
 
-  // blocking
-  this->ocl_cq->finish();
+//
+// Hands this batch's paths to the writer thread, which writes them
+// while the next batch runs. Blocks only when path_queue_batches
+// batches are already waiting.
+//
+void OclPtxHandler::ParticlePathsToFile()
+{
+  // chunked paths are already on the host
+  std::vector<float4> particle_paths;
+  std::vector<unsigned int> particle_steps;
+  if (!this->chunked_paths)
+    this->ParticlePathsToHost(&particle_paths, &particle_steps);
+
+  // later batches append to the first batch's file
+  if (!this->path_writer.IsRunning())
+  {
+    std::ostringstream convert(std::ostringstream::ate);
+    time_t t = time(0);
+    struct tm * now = localtime(&t);
+
+    convert << "OclPtx Results/"<< now->tm_yday << "-" <<
+      static_cast<int>(now->tm_year) + 1900 << "_"<< now->tm_hour <<
+        ":" << now->tm_min << ":" << now->tm_sec;
+
+    const char* extension = "_PATHS.tck";
+    if (this->path_format == kCsvPaths)
+      extension = "_PATHS.dat";
+    else if (this->path_format == kPackedPaths)
+      extension = "_PATHS.oclp";
+    this->path_filename = convert.str() + extension +
+      (this->path_compress ? ".gz" : "");
+    std::cout << "Writing to " << this->path_filename << "\n";
+
+    // paths go out in grid voxels, the writer adds the crop origin
+    this->path_writer.Start(this->path_filename, this->path_format,
+      this->path_compress, this->path_streamlines,
+      this->path_voxel_to_world, this->grid_origin,
+      this->path_queue_batches);
+  }
 
-  // now dump to file
+  // only the points taken, back to back
+  PathBatch batch;
+  batch.lengths.resize(this->section_size);
+  size_t total_points = 0;
+  for (unsigned int n = 0; n < this->section_size; n++)
+  {
+    batch.lengths.at(n) = this->chunked_paths ?
+      this->drained_paths.at(n).size() : particle_steps.at(n) + 1;
+    total_points += batch.lengths.at(n);
+  }
+  batch.points.reserve(total_points);
+  for (unsigned int n = 0; n < this->section_size; n++)
+  {
+    const float4* path = this->chunked_paths ?
+      this->drained_paths.at(n).data() :
+      particle_paths.data() + static_cast<size_t>(n)*this->particle_path_size;
+    batch.points.insert(batch.points.end(), path,
+      path + batch.lengths.at(n));
+  }
 
-  std::ostringstream convert(std::ostringstream::ate);
+  this->path_writer.Push(batch);
+}
 
-  std::string path_filename;
+size_t OclPtxHandler::GpuMemUsed()
+{
+  return this->total_gpu_mem_size;
+}
 
-  std::vector<float> temp_x;
-  std::vector<float> temp_y;
-  std::vector<float> temp_z;
+unsigned long OclPtxHandler::TotalStepsTaken()
+{
+  std::vector<unsigned int> particle_steps(this->section_size);
 
-  time_t t = time(0);
-  struct tm * now = localtime(&t);
+  this->ocl_cq->enqueueReadBuffer(
+    this->particle_steps_taken_buffer,
+    CL_TRUE,
+    0,
+    this->particle_uint_mem_size,
+    particle_steps.data()
+  );
 
-  convert << "OclPtx Results/"<< now->tm_yday << "-" <<
-    static_cast<int>(now->tm_year) + 1900 << "_"<< now->tm_hour <<
-      ":" << now->tm_min << ":" << now->tm_sec;
+  unsigned long total_steps = 0;
+  for (unsigned int n = 0; n < particle_steps.size(); n++)
+    total_steps += particle_steps.at(n);
 
-  path_filename = convert.str() + "_PATHS.dat";
-  std::cout << "Writing to " << path_filename << "\n";
+  return total_steps;
+}
 
-  std::fstream path_file;
-  path_file.open(path_filename.c_str(), std::ios::app|std::ios::out);
+void OclPtxHandler::ParticlePathsToHost(
+  std::vector<float4>* paths,
+  std::vector<unsigned int>* steps
+)
+{
+  paths->resize(
+    static_cast<size_t>(this->section_size)*this->particle_path_size);
+  steps->resize(this->section_size);
 
-  for (unsigned int n = 0; n < this->n_particles; n++)
+  if (this->chunked_paths)
   {
-    unsigned int p_steps = particle_steps[n];
-
-    //if (p_steps > 0)
-    std::cout<<"Particle " << n << " Steps Taken: " << p_steps <<"\n";
-    
-    p_steps += 1;
-
-    for (unsigned int s = 0; s < p_steps; s++)
+    for (unsigned int n = 0; n < this->section_size; n++)
     {
-      temp_x.push_back(particle_paths[n*this->particle_path_size+ s].x);
-      temp_y.push_back(particle_paths[n*this->particle_path_size+ s].y);
-      temp_z.push_back(particle_paths[n*this->particle_path_size+ s].z);
+      const std::vector<float4>& path = this->drained_paths.at(n);
+      std::copy(path.begin(), path.end(), paths->begin() +
+        static_cast<size_t>(n)*this->particle_path_size);
+      steps->at(n) = path.size() - 1;
     }
+    return;
+  }
 
-    for (unsigned int i = 0; i < (unsigned int) p_steps; i++)
+  if (this->voxel_paths)
+  {
+    // voxel centres, in grid voxels like the positions
+    std::vector<unsigned int> voxels;
+    std::vector<unsigned int> counts;
+    unsigned int stride = this->ParticleVoxelsToHost(&voxels, &counts);
+    unsigned int nyz = this->sample_ny*this->sample_nz;
+    // a seed outside the grid enters no voxel: like a path, it is
+    // written as the seed alone
+    std::vector<float4> positions;
+    if (std::find(counts.begin(), counts.end(), 0u) != counts.end())
     {
-      path_file << temp_x.at(i);
-
-      if (i < (unsigned int) p_steps - 1)
-        path_file << ",";
-      else
-        path_file << "\n";
+      positions.resize(this->section_size);
+      this->ocl_cq->enqueueReadBuffer(
+        this->particle_paths_buffer,
+        CL_TRUE,
+        0,
+        this->particles_mem_size,
+        positions.data()
+      );
     }
-
-    for (unsigned int i = 0; i < (unsigned int) p_steps; i++)
+    for (unsigned int n = 0; n < this->section_size; n++)
     {
-      path_file << temp_y.at(i);
-
-      if (i < (unsigned int) p_steps - 1)
-        path_file << ",";
-      else
-        path_file << "\n";
+      if (counts.at(n) == 0)
+        paths->at(static_cast<size_t>(n)*this->particle_path_size) =
+          positions.at(n);
+      for (unsigned int v = 0; v < counts.at(n); v++)
+      {
+        unsigned int voxel = voxels.at(static_cast<size_t>(n)*stride + v);
+        float4& centre =
+          paths->at(static_cast<size_t>(n)*this->particle_path_size + v);
+        centre.x = voxel/nyz;
+        centre.y = (voxel % nyz)/this->sample_nz;
+        centre.z = voxel % this->sample_nz;
+      }
+      steps->at(n) = counts.at(n) > 0 ? counts.at(n) - 1 : 0;
     }
+    return;
+  }
 
-    for (unsigned int i = 0; i < (unsigned int) p_steps; i++)
+  if (this->density_map)
+  {
+    std::vector<float4> positions(this->section_size);
+    this->ocl_cq->enqueueReadBuffer(
+      this->particle_paths_buffer,
+      CL_TRUE,
+      0,
+      this->particles_mem_size,
+      positions.data()
+    );
+    for (unsigned int n = 0; n < this->section_size; n++)
     {
-      path_file << temp_z.at(i);
-
-      if (i < (unsigned int) p_steps - 1)
-        path_file << ",";
-      else
-        path_file << "\n";
+      paths->at(static_cast<size_t>(n)*this->particle_path_size) =
+        positions.at(n);
+      steps->at(n) = 0;
     }
-
-    temp_x.clear();
-    temp_y.clear();
-    temp_z.clear();
+    return;
   }
 
-  path_file.close();
-  delete[] particle_paths;
-  delete[] particle_steps;
+  this->ocl_cq->enqueueReadBuffer(
+    this->particle_paths_buffer,
+    CL_FALSE,
+    0,
+    this->particles_mem_size,
+    paths->data()
+  );
+  this->ocl_cq->enqueueReadBuffer(
+    this->particle_steps_taken_buffer,
+    CL_FALSE,
+    0,
+    this->particle_uint_mem_size,
+    steps->data()
+  );
+  this->ocl_cq->finish();
 }
 
-unsigned int OclPtxHandler::GpuMemUsed()
+std::vector<float4> OclPtxHandler::ParticleEndpoints()
 {
-  return this->total_gpu_mem_size;
+  std::vector<float4> endpoints;
+  if (this->chunked_paths)
+  {
+    for (unsigned int n = 0; n < this->section_size; n++)
+      endpoints.push_back(this->drained_paths.at(n).back());
+    return endpoints;
+  }
+
+  std::vector<float4> particle_paths;
+  std::vector<unsigned int> particle_steps;
+  this->ParticlePathsToHost(&particle_paths, &particle_steps);
+
+  for (unsigned int n = 0; n < this->section_size; n++)
+    endpoints.push_back(
+      particle_paths.at(static_cast<size_t>(n)*this->particle_path_size +
+        particle_steps.at(n)));
+
+  return endpoints;
 }
 
 //*********************************************************************
@@ -225,37 +376,71 @@ void OclPtxHandler::WriteSamplesToDevice(
   const BedpostXData* phi_data,
   const BedpostXData* theta_data,
   unsigned int num_directions,
-  const unsigned short int* brain_mask
+  const unsigned int* mask_volume,
+  const unsigned int* voxel_index
 )
 {
-  unsigned int single_direction_size =
-    f_data->nx * f_data->ny * f_data->nz;
+  unsigned int single_direction_size = f_data->nvoxels;
 
-  unsigned int brain_mem_size =
-    single_direction_size * sizeof(unsigned short int);
+  // --fp16 runs upload the half copies (kernel built with OCLPTX_HALF)
+  this->half_samples = (f_data->half_data.size() > 0);
+  size_t element_size =
+    this->half_samples ? sizeof(unsigned short) : sizeof(float);
 
-  unsigned int single_direction_mem_size =
-    single_direction_size*f_data->ns*sizeof(float);
+  size_t single_direction_mem_size =
+    static_cast<size_t>(single_direction_size)*f_data->ns*element_size;
 
-  unsigned int total_mem_size =
+  size_t total_mem_size =
     single_direction_mem_size*num_directions;
 
   this->samples_buffer_size = total_mem_size;
+  this->sample_layout = kSeparateSamples;
 
   this->sample_nx = f_data->nx;
   this->sample_ny = f_data->ny;
   this->sample_nz = f_data->nz;
   this->sample_ns = f_data->ns;
+  this->sample_nvoxels = f_data->nvoxels;
+  this->bricked_grid = f_data->bricked;
+  this->grid_origin.x = f_data->x0;
+  this->grid_origin.y = f_data->y0;
+  this->grid_origin.z = f_data->z0;
 
   // diagnostics
-  std::cout<<"Brain Mem Size: "<< brain_mem_size <<"\n";
   std::cout<<"Samples Size: "<< single_direction_mem_size << "\n";
   std::cout<<"Nx : " << this->sample_nx <<"\n";
   std::cout<<"Ny : " << this->sample_ny <<"\n";
   std::cout<<"Nz : " << this->sample_nz <<"\n";
   std::cout<<"Ns : " << this->sample_ns <<"\n";
+  std::cout<<"Voxels Per Sample : " << this->sample_nvoxels <<"\n";
   // diagnostics
 
+  if (this->slab_width > 0)
+  {
+    this->PlanSlabs(num_directions, voxel_index);
+    this->samples_buffer_size = 0;
+
+    this->AddSlabStream(&this->f_samples_buffer,
+      this->half_samples ?
+        static_cast<const void*>(f_data->half_data.at(0)) :
+        static_cast<const void*>(f_data->data.at(0)),
+      element_size);
+    this->AddSlabStream(&this->theta_samples_buffer,
+      this->half_samples ?
+        static_cast<const void*>(theta_data->half_data.at(0)) :
+        static_cast<const void*>(theta_data->data.at(0)),
+      element_size);
+    this->AddSlabStream(&this->phi_samples_buffer,
+      this->half_samples ?
+        static_cast<const void*>(phi_data->half_data.at(0)) :
+        static_cast<const void*>(phi_data->data.at(0)),
+      element_size);
+
+    this->WriteMasksToDevice(mask_volume, voxel_index);
+    this->ocl_cq->finish();
+    return;
+  }
+
   this->f_samples_buffer =
     cl::Buffer(
       *(this->ocl_context),
@@ -283,15 +468,6 @@ void OclPtxHandler::WriteSamplesToDevice(
       NULL
     );
 
-  this->brain_mask_buffer =
-    cl::Buffer(
-      *(this->ocl_context),
-      CL_MEM_READ_ONLY,
-      brain_mem_size,
-      NULL,
-      NULL
-    );
-
   // enqueue writes
 
   for (unsigned int d=0; d<num_directions; d++)
@@ -302,7 +478,9 @@ void OclPtxHandler::WriteSamplesToDevice(
         CL_FALSE,
         d * single_direction_mem_size,
         single_direction_mem_size,
-        f_data->data.at(d),
+        this->half_samples ?
+          static_cast<const void*>(f_data->half_data.at(d)) :
+          static_cast<const void*>(f_data->data.at(d)),
         NULL,
         NULL
     );
@@ -312,7 +490,9 @@ void OclPtxHandler::WriteSamplesToDevice(
       CL_FALSE,
       d * single_direction_mem_size,
       single_direction_mem_size,
-      theta_data->data.at(d),
+      this->half_samples ?
+        static_cast<const void*>(theta_data->half_data.at(d)) :
+        static_cast<const void*>(theta_data->data.at(d)),
       NULL,
       NULL
     );
@@ -322,29 +502,290 @@ void OclPtxHandler::WriteSamplesToDevice(
       CL_FALSE,
       d * single_direction_mem_size,
       single_direction_mem_size,
-      phi_data->data.at(d),
+      this->half_samples ?
+        static_cast<const void*>(phi_data->half_data.at(d)) :
+        static_cast<const void*>(phi_data->data.at(d)),
+      NULL,
+      NULL
+    );
+  }
+
+  this->total_gpu_mem_size += 3*total_mem_size;
+
+  this->WriteMasksToDevice(mask_volume, voxel_index);
+
+  // may not need to do this here, may want to wait to block until
+  // all "initialization" operations are finished.
+  this->ocl_cq->finish();
+}
+
+void OclPtxHandler::WritePackedSamplesToDevice(
+  const PackedSampleData* packed_data,
+  unsigned int num_directions,
+  const unsigned int* mask_volume,
+  const unsigned int* voxel_index
+)
+{
+  this->half_samples = (packed_data->half_data.size() > 0);
+  size_t record_size =
+    this->half_samples ? 4*sizeof(unsigned short) : sizeof(float4);
+
+  size_t single_direction_mem_size =
+    static_cast<size_t>(packed_data->nvoxels)*packed_data->ns*record_size;
+
+  size_t total_mem_size =
+    single_direction_mem_size*num_directions;
+
+  this->samples_buffer_size = total_mem_size;
+  this->sample_layout =
+    packed_data->unit_vectors ? kUnitVectorSamples : kPackedSamples;
+
+  this->sample_nx = packed_data->nx;
+  this->sample_ny = packed_data->ny;
+  this->sample_nz = packed_data->nz;
+  this->sample_ns = packed_data->ns;
+  this->sample_nvoxels = packed_data->nvoxels;
+  this->bricked_grid = packed_data->bricked;
+  this->grid_origin.x = packed_data->x0;
+  this->grid_origin.y = packed_data->y0;
+  this->grid_origin.z = packed_data->z0;
+
+  std::cout<<"Packed Samples Size: "<< single_direction_mem_size << "\n";
+
+  if (this->slab_width > 0)
+  {
+    this->PlanSlabs(num_directions, voxel_index);
+    this->samples_buffer_size = 0;
+
+    this->AddSlabStream(&this->packed_samples_buffer,
+      this->half_samples ?
+        static_cast<const void*>(packed_data->half_data.at(0)) :
+        static_cast<const void*>(packed_data->data.at(0)),
+      record_size);
+
+    this->WriteMasksToDevice(mask_volume, voxel_index);
+    this->ocl_cq->finish();
+    return;
+  }
+
+  this->packed_samples_buffer =
+    cl::Buffer(
+      *(this->ocl_context),
+      CL_MEM_READ_ONLY,
+      total_mem_size,
+      NULL,
+      NULL
+    );
+
+  for (unsigned int d=0; d<num_directions; d++)
+  {
+    this->ocl_cq->enqueueWriteBuffer(
+      this->packed_samples_buffer,
+      CL_FALSE,
+      d * single_direction_mem_size,
+      single_direction_mem_size,
+      this->half_samples ?
+        static_cast<const void*>(packed_data->half_data.at(d)) :
+        static_cast<const void*>(packed_data->data.at(d)),
       NULL,
       NULL
     );
   }
 
+  this->total_gpu_mem_size += total_mem_size;
+
+  this->WriteMasksToDevice(mask_volume, voxel_index);
+
+  this->ocl_cq->finish();
+}
+
+void OclPtxHandler::WriteCodebookSamplesToDevice(
+  const CodebookSampleData* codebook_data,
+  const float4* codebook_entries,
+  unsigned int num_entries,
+  unsigned int num_directions,
+  const unsigned int* mask_volume,
+  const unsigned int* voxel_index
+)
+{
+  size_t single_direction_mem_size =
+    static_cast<size_t>(codebook_data->nvoxels)*codebook_data->ns*
+      sizeof(unsigned int);
+
+  size_t total_mem_size =
+    single_direction_mem_size*num_directions;
+
+  size_t codebook_mem_size = num_entries*sizeof(float4);
+
+  this->samples_buffer_size = total_mem_size;
+  this->sample_layout = kCodebookSamples;
+  this->half_samples = false;
+
+  this->sample_nx = codebook_data->nx;
+  this->sample_ny = codebook_data->ny;
+  this->sample_nz = codebook_data->nz;
+  this->sample_ns = codebook_data->ns;
+  this->sample_nvoxels = codebook_data->nvoxels;
+  this->bricked_grid = codebook_data->bricked;
+  this->grid_origin.x = codebook_data->x0;
+  this->grid_origin.y = codebook_data->y0;
+  this->grid_origin.z = codebook_data->z0;
+
+  std::cout<<"Codebook Samples Size: "<< single_direction_mem_size <<
+    "\n";
+  std::cout<<"Codebook Size: "<< codebook_mem_size << "\n";
+
+  this->codebook_buffer =
+    cl::Buffer(
+      *(this->ocl_context),
+      CL_MEM_READ_ONLY,
+      codebook_mem_size,
+      NULL,
+      NULL
+    );
+
   this->ocl_cq->enqueueWriteBuffer(
-    this->brain_mask_buffer,
+    this->codebook_buffer,
     CL_FALSE,
     static_cast<unsigned int>(0),
-    brain_mem_size,
-    brain_mask,
+    codebook_mem_size,
+    codebook_entries,
     NULL,
     NULL
   );
 
-  this->total_gpu_mem_size += 3*total_mem_size + brain_mem_size;
+  this->total_gpu_mem_size += codebook_mem_size;
+
+  if (this->slab_width > 0)
+  {
+    this->PlanSlabs(num_directions, voxel_index);
+    this->samples_buffer_size = 0;
+
+    this->AddSlabStream(&this->codebook_samples_buffer,
+      codebook_data->data.at(0), sizeof(unsigned int));
+
+    this->WriteMasksToDevice(mask_volume, voxel_index);
+    this->ocl_cq->finish();
+    return;
+  }
+
+  this->codebook_samples_buffer =
+    cl::Buffer(
+      *(this->ocl_context),
+      CL_MEM_READ_ONLY,
+      total_mem_size,
+      NULL,
+      NULL
+    );
+
+  for (unsigned int d=0; d<num_directions; d++)
+  {
+    this->ocl_cq->enqueueWriteBuffer(
+      this->codebook_samples_buffer,
+      CL_FALSE,
+      d * single_direction_mem_size,
+      single_direction_mem_size,
+      codebook_data->data.at(d),
+      NULL,
+      NULL
+    );
+  }
+
+  this->total_gpu_mem_size += total_mem_size;
+
+  this->WriteMasksToDevice(mask_volume, voxel_index);
 
-  // may not need to do this here, may want to wait to block until
-  // all "initialization" operations are finished.
   this->ocl_cq->finish();
 }
 
+void OclPtxHandler::SetMaskWordBytes(unsigned int mask_word_bytes)
+{
+  this->mask_word_bytes = mask_word_bytes;
+}
+
+//
+// Combined mask volume (see kMaskBrain), narrowed to mask_word_bytes
+// per voxel, and, if compacted, voxel index, both on the full
+// sample_nx*sample_ny*sample_nz grid.
+//
+void OclPtxHandler::WriteMasksToDevice(
+  const unsigned int* mask_volume,
+  const unsigned int* voxel_index
+)
+{
+  unsigned int grid_size = GridVoxelCount(
+    this->sample_nx, this->sample_ny, this->sample_nz, this->bricked_grid);
+
+  size_t mask_mem_size = static_cast<size_t>(grid_size)*this->mask_word_bytes;
+
+  // narrowed words are written blocking, the copy is gone on return
+  std::vector<unsigned char> narrowed;
+  const void* mask_words = mask_volume;
+  if (this->mask_word_bytes == sizeof(unsigned char))
+  {
+    narrowed.assign(mask_volume, mask_volume + grid_size);
+    mask_words = narrowed.data();
+  }
+  else if (this->mask_word_bytes == sizeof(unsigned short))
+  {
+    narrowed.resize(mask_mem_size);
+    std::copy(mask_volume, mask_volume + grid_size,
+      reinterpret_cast<unsigned short*>(narrowed.data()));
+    mask_words = narrowed.data();
+  }
+
+  std::cout<<"Mask Volume Mem Size: "<< mask_mem_size <<"\n";
+
+  this->mask_volume_buffer =
+    cl::Buffer(
+      *(this->ocl_context),
+      CL_MEM_READ_ONLY,
+      mask_mem_size,
+      NULL,
+      NULL
+    );
+
+  this->ocl_cq->enqueueWriteBuffer(
+    this->mask_volume_buffer,
+    narrowed.empty() ? CL_FALSE : CL_TRUE,
+    static_cast<unsigned int>(0),
+    mask_mem_size,
+    mask_words,
+    NULL,
+    NULL
+  );
+
+  this->total_gpu_mem_size += mask_mem_size;
+
+  this->compact_samples = (voxel_index != NULL);
+
+  if (this->compact_samples)
+  {
+    size_t index_mem_size = grid_size * sizeof(unsigned int);
+
+    this->voxel_index_buffer =
+      cl::Buffer(
+        *(this->ocl_context),
+        CL_MEM_READ_ONLY,
+        index_mem_size,
+        NULL,
+        NULL
+      );
+
+    this->ocl_cq->enqueueWriteBuffer(
+      this->voxel_index_buffer,
+      CL_FALSE,
+      static_cast<unsigned int>(0),
+      index_mem_size,
+      voxel_index,
+      NULL,
+      NULL
+    );
+
+    this->total_gpu_mem_size += index_mem_size;
+  }
+}
+
 void OclPtxHandler::WriteInitialPosToDevice(
   const float4* initial_positions,
   unsigned int nparticles,
@@ -355,14 +796,32 @@ void OclPtxHandler::WriteInitialPosToDevice(
 {
   unsigned int sec_size = nparticles/ndevices;
 
+  // a new batch replaces the last one's particle buffers
+  this->total_gpu_mem_size -= this->particle_gpu_mem_size;
+  this->particle_gpu_mem_size = 0;
+  this->particle_indeces_left.clear();
+  this->particle_complete.clear();
+
   this->section_size = sec_size;
   this->n_particles = nparticles;
   this->max_steps = maximum_steps;
   this->particle_path_size = maximum_steps + 1;
 
-  unsigned int path_mem_size =
-    sec_size*particle_path_size*sizeof(float4);
-  unsigned int path_steps_mem_size = sec_size*sizeof(unsigned int);
+  // --pathchunk: a ring of path_chunk positions per particle, drained
+  // to drained_paths after every launch. A density map or voxel paths
+  // need only the current position.
+  this->chunked_paths = (!this->density_map && !this->voxel_paths &&
+    this->path_chunk > 0 && this->path_chunk < this->particle_path_size);
+  if (this->density_map || this->voxel_paths)
+    this->device_path_size = 1;
+  else if (this->chunked_paths)
+    this->device_path_size = this->path_chunk;
+  else
+    this->device_path_size = this->particle_path_size;
+
+  size_t path_mem_size =
+    static_cast<size_t>(sec_size)*this->device_path_size*sizeof(float4);
+  size_t path_steps_mem_size = sec_size*sizeof(unsigned int);
   this->particle_uint_mem_size = path_steps_mem_size;
   this->particles_mem_size = path_mem_size;
 
@@ -376,13 +835,15 @@ void OclPtxHandler::WriteInitialPosToDevice(
 
   // delete this at end of function always
   float4* pos_container;
-  pos_container = new float4[sec_size * particle_path_size];
+  pos_container =
+    new float4[static_cast<size_t>(sec_size)*this->device_path_size];
 
   // the first entry in row i will be the particle start location
   // the rest is garbage data (that's fine)
   for (unsigned int i = 0; i < sec_size; i++)
   {
-    pos_container[particle_path_size*i] = *start_pos_data;
+    pos_container[static_cast<size_t>(this->device_path_size)*i] =
+      *start_pos_data;
     start_pos_data++;
     this->particle_indeces_left.push_back(i);
     this->particle_complete.push_back(static_cast<unsigned int>(0));
@@ -424,8 +885,17 @@ void OclPtxHandler::WriteInitialPosToDevice(
       NULL
     );
 
+  this->particle_waypoints_buffer =
+    cl::Buffer(
+      *(this->ocl_context),
+      CL_MEM_READ_WRITE,
+      path_steps_mem_size,
+      NULL,
+      NULL
+    );
+
   // enqueue writes
-  // both "steps taken" and "done" write the same array (all zeros)
+  // "steps taken", "done" and "waypoints" write the same array (all zeros)
 
   this->ocl_cq->enqueueWriteBuffer(
     this->particle_paths_buffer,
@@ -457,25 +927,210 @@ void OclPtxHandler::WriteInitialPosToDevice(
     NULL
   );
 
-  this->total_gpu_mem_size += path_mem_size + 2*path_steps_mem_size;
-  // may not need to do this here, may want to wait to block until
-  // all "initialization" operations are finished.
-  this->ocl_cq->finish();
+  this->ocl_cq->enqueueWriteBuffer(
+    this->particle_waypoints_buffer,
+    CL_FALSE,
+    static_cast<unsigned int>(0),
+    path_steps_mem_size,
+    initial_steps.data(),
+    NULL,
+    NULL
+  );
 
-  delete[] pos_container;
-}
+  this->particle_gpu_mem_size += path_mem_size + 3*path_steps_mem_size;
 
+  if (this->slab_width > 0)
+  {
+    // each particle first waits for the slab its seed is in (a seed
+    // outside the grid finishes on its first launch, whatever slab)
+    this->particle_slab.resize(sec_size);
+    for (unsigned int i = 0; i < sec_size; i++)
+    {
+      float x =
+        pos_container[static_cast<size_t>(this->device_path_size)*i].x;
+      unsigned int slab =
+        x > 0 ? static_cast<unsigned int>(x)/this->slab_width : 0;
+      this->particle_slab.at(i) = std::min(slab, this->n_slabs - 1);
+    }
 
-void OclPtxHandler::SingleBufferInit(
-  unsigned int particle_interval_size,
-  unsigned int step_interval_size
-)
-{
-  this->num_steps = step_interval_size;
+    this->particle_slab_buffer =
+      cl::Buffer(
+        *(this->ocl_context),
+        CL_MEM_READ_WRITE,
+        path_steps_mem_size,
+        NULL,
+        NULL
+      );
 
-  this->particles_size = particle_interval_size;
-  unsigned int interval_mem_size =
-    particle_interval_size*sizeof(unsigned int);
+    this->ocl_cq->enqueueWriteBuffer(
+      this->particle_slab_buffer,
+      CL_FALSE,
+      static_cast<unsigned int>(0),
+      path_steps_mem_size,
+      this->particle_slab.data(),
+      NULL,
+      NULL
+    );
+
+    this->particle_gpu_mem_size += path_steps_mem_size;
+  }
+
+  if (this->density_map)
+  {
+    // nothing counted yet
+    std::vector<unsigned int> last_voxels(sec_size, 0xFFFFFFFF);
+
+    this->particle_last_voxel_buffer =
+      cl::Buffer(
+        *(this->ocl_context),
+        CL_MEM_READ_WRITE,
+        path_steps_mem_size,
+        NULL,
+        NULL
+      );
+
+    this->ocl_cq->enqueueWriteBuffer(
+      this->particle_last_voxel_buffer,
+      CL_TRUE,
+      static_cast<unsigned int>(0),
+      path_steps_mem_size,
+      last_voxels.data(),
+      NULL,
+      NULL
+    );
+
+    this->particle_gpu_mem_size += path_steps_mem_size;
+
+    // empty visited sets
+    size_t visited_mem_size =
+      static_cast<size_t>(sec_size)*this->visited_slots*sizeof(unsigned int);
+    std::vector<unsigned int> visited(
+      static_cast<size_t>(sec_size)*this->visited_slots, 0xFFFFFFFF);
+
+    this->particle_visited_buffer =
+      cl::Buffer(
+        *(this->ocl_context),
+        CL_MEM_READ_WRITE,
+        visited_mem_size,
+        NULL,
+        NULL
+      );
+
+    this->ocl_cq->enqueueWriteBuffer(
+      this->particle_visited_buffer,
+      CL_TRUE,
+      static_cast<unsigned int>(0),
+      visited_mem_size,
+      visited.data(),
+      NULL,
+      NULL
+    );
+
+    this->particle_gpu_mem_size += visited_mem_size;
+
+    // no set full yet
+    std::vector<unsigned int> no_overflows(sec_size, 0);
+
+    this->particle_visited_overflow_buffer =
+      cl::Buffer(
+        *(this->ocl_context),
+        CL_MEM_READ_WRITE,
+        path_steps_mem_size,
+        NULL,
+        NULL
+      );
+
+    this->ocl_cq->enqueueWriteBuffer(
+      this->particle_visited_overflow_buffer,
+      CL_TRUE,
+      static_cast<unsigned int>(0),
+      path_steps_mem_size,
+      no_overflows.data(),
+      NULL,
+      NULL
+    );
+
+    this->particle_gpu_mem_size += path_steps_mem_size;
+
+    // counts add up over every batch
+    if (this->density_mem_size == 0)
+      this->DensityInit();
+  }
+
+  if (this->voxel_paths)
+  {
+    // at most one new voxel per step, after the seed's
+    this->voxel_slots = this->particle_path_size;
+    size_t voxels_mem_size = static_cast<size_t>(sec_size)*
+      this->voxel_slots*sizeof(unsigned int);
+    std::vector<unsigned int> no_voxels(sec_size, 0);
+
+    this->particle_voxels_buffer =
+      cl::Buffer(
+        *(this->ocl_context),
+        CL_MEM_READ_WRITE,
+        voxels_mem_size,
+        NULL,
+        NULL
+      );
+
+    this->particle_voxel_count_buffer =
+      cl::Buffer(
+        *(this->ocl_context),
+        CL_MEM_READ_WRITE,
+        path_steps_mem_size,
+        NULL,
+        NULL
+      );
+
+    this->ocl_cq->enqueueWriteBuffer(
+      this->particle_voxel_count_buffer,
+      CL_TRUE,
+      static_cast<unsigned int>(0),
+      path_steps_mem_size,
+      no_voxels.data(),
+      NULL,
+      NULL
+    );
+
+    this->particle_gpu_mem_size += voxels_mem_size + path_steps_mem_size;
+  }
+
+  this->total_gpu_mem_size += this->particle_gpu_mem_size;
+  // may not need to do this here, may want to wait to block until
+  // all "initialization" operations are finished.
+  this->ocl_cq->finish();
+
+  if (this->chunked_paths)
+  {
+    this->drained_paths.assign(sec_size, std::vector<float4>());
+    for (unsigned int i = 0; i < sec_size; i++)
+      this->drained_paths.at(i).push_back(
+        pos_container[static_cast<size_t>(this->device_path_size)*i]);
+  }
+
+  delete[] pos_container;
+}
+
+
+void OclPtxHandler::SingleBufferInit(
+  unsigned int particle_interval_size,
+  unsigned int step_interval_size
+)
+{
+  // a launch takes no more steps than the path ring holds
+  this->num_steps = this->chunked_paths ?
+    std::min(step_interval_size, this->device_path_size - 1) :
+    step_interval_size;
+
+  this->particles_size = particle_interval_size;
+  size_t interval_mem_size =
+    particle_interval_size*sizeof(unsigned int);
+
+  // the last batch's lists and buffer, if any
+  this->todo_range.clear();
+  this->particle_todo.clear();
+  this->compute_index_buffers.clear();
 
   // first iteration is same size
   this->todo_range.push_back( particle_interval_size );
@@ -512,6 +1167,7 @@ void OclPtxHandler::SingleBufferInit(
     NULL
   );
 
+  this->particle_gpu_mem_size += interval_mem_size;
   this->total_gpu_mem_size += interval_mem_size;
 
   // may not need to do this here, may want to wait to block until
@@ -532,7 +1188,7 @@ void OclPtxHandler::DoubleBufferInit(
   this->num_steps = step_interval_size;
 
   this->particles_size = particle_interval_size;
-  unsigned int interval_mem_size =
+  size_t interval_mem_size =
     particle_interval_size*sizeof(unsigned int);
 
   // first iteration is same size
@@ -593,6 +1249,7 @@ void OclPtxHandler::DoubleBufferInit(
     NULL
   );
 
+  this->particle_gpu_mem_size += 2*interval_mem_size;
   this->total_gpu_mem_size += 2*interval_mem_size;
 
   // may not need to do this here, may want to wait to block until
@@ -689,6 +1346,719 @@ void OclPtxHandler::Reduce()
   rdlock.unlock();
 }
 
+//*********************************************************************
+//
+// OclPtxHandler Slab Streaming
+//
+//*********************************************************************
+
+//
+// The samples are split into slabs of slab_width x planes. x is the
+// slowest grid axis (also in whole bricks, see voxelindex.h), so each
+// slab is one contiguous run of sample voxels per sample, compacted or
+// not. The device holds resident_slabs slots of
+// sample_ns*slab_capacity records per sample array; the kernel sees
+// the slots of the slabs chosen for a launch through slab_slots. One
+// more slot, in a staging buffer of its own, takes the next slab from
+// the host while the kernel runs and is copied into a slot on the
+// device once that slab is chosen.
+//
+void OclPtxHandler::SetSlabStreaming(
+  unsigned int slab_width,
+  unsigned int resident_slabs,
+  cl::CommandQueue* transfer_cq
+)
+{
+  this->slab_width = slab_width;
+  this->resident_slabs = std::max(resident_slabs, 1u);
+  this->transfer_cq = (transfer_cq != NULL) ? transfer_cq : this->ocl_cq;
+}
+
+void OclPtxHandler::PlanSlabs(
+  unsigned int num_directions,
+  const unsigned int* voxel_index
+)
+{
+  if (num_directions != 1)
+  {
+    std::cout<<"Slab streaming takes one direction per sample only\n";
+    exit(1);
+  }
+
+  this->slab_capacity = CutSlabs(&this->slab_width, this->sample_nx,
+    this->sample_ny, this->sample_nz, this->bricked_grid, voxel_index,
+    &this->slab_first_voxel);
+  this->n_slabs = this->slab_first_voxel.size() - 1;
+  this->resident_slabs = std::min(this->resident_slabs, this->n_slabs);
+
+  std::cout<<"Slabs: " << this->n_slabs << " of " << this->slab_width <<
+    " x planes, " << this->resident_slabs << " resident (+1 prefetch), " <<
+      this->slab_capacity << " voxels max\n";
+
+  size_t slots_mem_size = this->n_slabs*sizeof(int);
+  size_t first_mem_size = (this->n_slabs + 1)*sizeof(unsigned int);
+
+  this->slab_slots_buffer =
+    cl::Buffer(
+      *(this->ocl_context),
+      CL_MEM_READ_ONLY,
+      slots_mem_size,
+      NULL,
+      NULL
+    );
+
+  this->slab_first_voxel_buffer =
+    cl::Buffer(
+      *(this->ocl_context),
+      CL_MEM_READ_ONLY,
+      first_mem_size,
+      NULL,
+      NULL
+    );
+
+  this->ocl_cq->enqueueWriteBuffer(
+    this->slab_first_voxel_buffer,
+    CL_FALSE,
+    static_cast<unsigned int>(0),
+    first_mem_size,
+    this->slab_first_voxel.data(),
+    NULL,
+    NULL
+  );
+
+  this->total_gpu_mem_size += slots_mem_size + first_mem_size;
+}
+
+//
+// Allocates the slots for one sample array (host_data in the
+// BedpostXData layout, record_size bytes per sample voxel), and its
+// staging slot if not every slab is resident.
+//
+unsigned int OclPtxHandler::CutSlabs(
+  unsigned int* slab_width,
+  unsigned int nx,
+  unsigned int ny,
+  unsigned int nz,
+  bool bricked,
+  const unsigned int* voxel_index,
+  std::vector<unsigned int>* slab_first_voxel
+)
+{
+  // whole bricks only
+  if (bricked)
+    *slab_width = (*slab_width + OCLPTX_BRICK_SIZE - 1) &
+      ~(OCLPTX_BRICK_SIZE - 1);
+
+  unsigned int n_slabs = (nx + *slab_width - 1)/(*slab_width);
+  unsigned int grid_size = GridVoxelCount(nx, ny, nz, bricked);
+
+  // first grid voxel of each slab
+  std::vector<unsigned int> grid_first(n_slabs + 1, grid_size);
+  for (unsigned int k = 0; k < n_slabs; k++)
+    grid_first.at(k) =
+      GridVoxelOffset(k*(*slab_width), 0, 0, nx, ny, nz, bricked);
+
+  // compacted samples are numbered in grid order, so a slab starts at
+  // the count of in-mask voxels before its first grid voxel
+  *slab_first_voxel = grid_first;
+  if (voxel_index != NULL)
+  {
+    unsigned int k = 0;
+    unsigned int in_mask = 0;
+    for (unsigned int v = 0; v < grid_size; v++)
+    {
+      while (k <= n_slabs && grid_first.at(k) == v)
+        slab_first_voxel->at(k++) = in_mask;
+      if (voxel_index[v] != 0xFFFFFFFF)
+        in_mask++;
+    }
+    while (k <= n_slabs)
+      slab_first_voxel->at(k++) = in_mask;
+  }
+
+  unsigned int slab_capacity = 1;
+  for (unsigned int k = 0; k < n_slabs; k++)
+    slab_capacity = std::max(slab_capacity,
+      slab_first_voxel->at(k + 1) - slab_first_voxel->at(k));
+  return slab_capacity;
+}
+
+void OclPtxHandler::AddSlabStream(
+  cl::Buffer* buffer,
+  const void* host_data,
+  size_t record_size
+)
+{
+  size_t slot_mem_size =
+    static_cast<size_t>(this->sample_ns)*this->slab_capacity*record_size;
+  size_t slots_mem_size = this->resident_slabs*slot_mem_size;
+
+  *buffer =
+    cl::Buffer(
+      *(this->ocl_context),
+      CL_MEM_READ_ONLY,
+      slots_mem_size,
+      NULL,
+      NULL
+    );
+
+  SlabStream stream = {
+    static_cast<const char*>(host_data), record_size, buffer, cl::Buffer()};
+  if (this->resident_slabs < this->n_slabs)
+  {
+    stream.staging =
+      cl::Buffer(
+        *(this->ocl_context),
+        CL_MEM_READ_WRITE,
+        slot_mem_size,
+        NULL,
+        NULL
+      );
+    slots_mem_size += slot_mem_size;
+  }
+  this->slab_streams.push_back(stream);
+
+  this->samples_buffer_size += slots_mem_size;
+  this->total_gpu_mem_size += slots_mem_size;
+}
+
+//
+// Enqueues (non-blocking, on cq, after wait_events if not NULL) the
+// copies of every sample of slab into slot, or into the staging slot.
+// events, if not NULL, gets one event per copy.
+//
+void OclPtxHandler::UploadSlab(
+  unsigned int slab,
+  unsigned int slot,
+  bool staging,
+  cl::CommandQueue* cq,
+  const std::vector<cl::Event>* wait_events,
+  std::vector<cl::Event>* events
+)
+{
+  size_t first = this->slab_first_voxel.at(slab);
+  size_t count = this->slab_first_voxel.at(slab + 1) - first;
+  if (count == 0)
+    return;
+
+  for (unsigned int i = 0; i < this->slab_streams.size(); i++)
+  {
+    const SlabStream& stream = this->slab_streams.at(i);
+    for (unsigned int s = 0; s < this->sample_ns; s++)
+    {
+      size_t host_offset =
+        (static_cast<size_t>(s)*this->sample_nvoxels + first)*
+          stream.record_size;
+      size_t slot_offset =
+        (static_cast<size_t>(slot)*this->sample_ns + s)*
+          this->slab_capacity*stream.record_size;
+
+      cl::Event event;
+      cq->enqueueWriteBuffer(
+        staging ? stream.staging : *(stream.buffer),
+        CL_FALSE,
+        slot_offset,
+        count*stream.record_size,
+        stream.host_data + host_offset,
+        wait_events,
+        (events != NULL) ? &event : NULL
+      );
+      if (events != NULL)
+        events->push_back(event);
+    }
+  }
+}
+
+//
+// Enqueues on ocl_cq, after wait_events (the prefetch), the device
+// copies of the staged slab into slot. events gets one event per copy.
+//
+void OclPtxHandler::CopyStagedSlab(
+  unsigned int slot,
+  const std::vector<cl::Event>* wait_events,
+  std::vector<cl::Event>* events
+)
+{
+  events->clear();
+  for (unsigned int i = 0; i < this->slab_streams.size(); i++)
+  {
+    const SlabStream& stream = this->slab_streams.at(i);
+    size_t slot_mem_size = static_cast<size_t>(this->sample_ns)*
+      this->slab_capacity*stream.record_size;
+
+    cl::Event event;
+    this->ocl_cq->enqueueCopyBuffer(
+      stream.staging,
+      *(stream.buffer),
+      0,
+      slot*slot_mem_size,
+      slot_mem_size,
+      wait_events,
+      &event
+    );
+    events->push_back(event);
+  }
+}
+
+//
+// Runs the kernel over the resident_slabs slabs most particles wait
+// for, until every particle is done. A particle stepping into a slab
+// that is not resident parks (PARTICLE_PARKED) and records the slab in
+// particle_slab; it resumes, unchanged, in a later launch with that
+// slab resident.
+//
+void OclPtxHandler::InterpolateSlabs()
+{
+  const unsigned int kParticleParked = 3;  // PARTICLE_PARKED, basic.cl
+
+  unsigned int n_slots = this->resident_slabs;
+  std::vector<int> slot_slab(n_slots, -1);
+  std::vector<int> slab_slots(this->n_slabs, -1);
+  std::vector<unsigned int> particle_done(this->section_size, 0);
+  std::vector<unsigned int> todo;
+
+  // the slab in the staging slots, the uploads that fill them and the
+  // device copies that read them
+  int staged_slab = -1;
+  std::vector<cl::Event> prefetch_events;
+  std::vector<cl::Event> staging_reads;
+
+  unsigned int launches = 0;
+  unsigned int uploads = 0;
+  unsigned int prefetches = 0;
+  unsigned int prefetches_used = 0;
+  unsigned int prefetches_ready = 0;
+  unsigned long parked = 0;
+
+  while (true)
+  {
+    // waiting particles per slab
+    std::vector<unsigned int> demand(this->n_slabs, 0);
+    for (unsigned int i = 0; i < this->section_size; i++)
+      if (particle_done.at(i) == 0 || particle_done.at(i) == kParticleParked)
+        demand.at(this->particle_slab.at(i))++;
+
+    std::vector<unsigned int> wanted;
+    for (unsigned int k = 0; k < this->n_slabs; k++)
+      if (demand.at(k) > 0)
+        wanted.push_back(k);
+    if (wanted.empty())
+      break;
+
+    std::stable_sort(wanted.begin(), wanted.end(),
+      [&demand](unsigned int a, unsigned int b)
+        { return demand.at(a) > demand.at(b); });
+
+    unsigned int n_chosen =
+      std::min(static_cast<unsigned int>(wanted.size()),
+        this->resident_slabs);
+    std::vector<bool> chosen(this->n_slabs, false);
+    for (unsigned int c = 0; c < n_chosen; c++)
+      chosen.at(wanted.at(c)) = true;
+
+    // chosen slabs not on the device evict slabs that are not chosen;
+    // the staged slab comes from the staging slots, after its upload
+    for (unsigned int c = 0; c < n_chosen; c++)
+    {
+      unsigned int slab = wanted.at(c);
+      if (std::find(slot_slab.begin(), slot_slab.end(),
+            static_cast<int>(slab)) != slot_slab.end())
+        continue;
+
+      unsigned int slot = 0;
+      while (slot_slab.at(slot) >= 0 && chosen.at(slot_slab.at(slot)))
+        slot++;
+
+      if (static_cast<int>(slab) == staged_slab)
+      {
+        // done before this round asked for it: the upload overlapped
+        bool ready = true;
+        for (unsigned int e = 0; e < prefetch_events.size(); e++)
+          if (prefetch_events.at(e).getInfo<
+                CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE)
+            ready = false;
+        if (ready)
+          prefetches_ready++;
+        prefetches_used++;
+
+        this->CopyStagedSlab(slot,
+          prefetch_events.empty() ? NULL : &prefetch_events,
+          &staging_reads);
+        // used once; an evicted slab is uploaded again, not re-copied
+        staged_slab = -1;
+        prefetch_events.clear();
+      }
+      else
+      {
+        this->UploadSlab(slab, slot, false, this->ocl_cq, NULL, NULL);
+        uploads++;
+      }
+      slot_slab.at(slot) = slab;
+    }
+
+    // the kernel only sees the chosen slabs
+    std::fill(slab_slots.begin(), slab_slots.end(), -1);
+    for (unsigned int slot = 0; slot < n_slots; slot++)
+      if (slot_slab.at(slot) >= 0 && chosen.at(slot_slab.at(slot)))
+        slab_slots.at(slot_slab.at(slot)) = slot;
+
+    this->ocl_cq->enqueueWriteBuffer(
+      this->slab_slots_buffer,
+      CL_FALSE,
+      static_cast<unsigned int>(0),
+      this->n_slabs*sizeof(int),
+      slab_slots.data(),
+      NULL,
+      NULL
+    );
+
+    todo.clear();
+    for (unsigned int i = 0; i < this->section_size; i++)
+      if ((particle_done.at(i) == 0 || particle_done.at(i) == kParticleParked)
+          && chosen.at(this->particle_slab.at(i)))
+        todo.push_back(i);
+
+    this->ocl_cq->enqueueWriteBuffer(
+      this->compute_index_buffers.at(0),
+      CL_FALSE,
+      static_cast<unsigned int>(0),
+      todo.size()*sizeof(unsigned int),
+      todo.data(),
+      NULL,
+      NULL
+    );
+
+    this->EnqueueKernel(this->compute_index_buffers.at(0), todo.size());
+    this->ocl_cq->flush();
+    launches++;
+
+    // meanwhile, the most wanted slab left out goes to the staging
+    // slots, once earlier copies out of them are done
+    if (wanted.size() > n_chosen &&
+        static_cast<int>(wanted.at(n_chosen)) != staged_slab &&
+        std::find(slot_slab.begin(), slot_slab.end(),
+          static_cast<int>(wanted.at(n_chosen))) == slot_slab.end())
+    {
+      staged_slab = wanted.at(n_chosen);
+      prefetch_events.clear();
+      this->UploadSlab(staged_slab, 0, true, this->transfer_cq,
+        staging_reads.empty() ? NULL : &staging_reads, &prefetch_events);
+      this->transfer_cq->flush();
+      prefetches++;
+      uploads++;
+    }
+
+    this->ocl_cq->enqueueReadBuffer(
+      this->particle_done_buffer,
+      CL_FALSE,
+      0,
+      this->particle_uint_mem_size,
+      particle_done.data()
+    );
+    this->ocl_cq->enqueueReadBuffer(
+      this->particle_slab_buffer,
+      CL_FALSE,
+      0,
+      this->particle_uint_mem_size,
+      this->particle_slab.data()
+    );
+    if (this->chunked_paths)
+      this->EnqueuePathDrain(0);
+    this->ocl_cq->finish();
+
+    if (this->chunked_paths)
+      this->DrainPaths(0, todo);
+
+    for (unsigned int t = 0; t < todo.size(); t++)
+      if (particle_done.at(todo.at(t)) == kParticleParked)
+        parked++;
+  }
+
+  if (prefetches > 0)
+    this->transfer_cq->finish();
+
+  std::cout<<"Slab streaming: " << launches << " launches, " << uploads <<
+    " slab uploads (" << prefetches << " prefetched, " << prefetches_used <<
+      " used, " << prefetches_ready << " of them ready when needed), " <<
+        parked << " particles parked\n";
+}
+
+//*********************************************************************
+//
+// OclPtxHandler Path Chunks
+//
+//*********************************************************************
+
+void OclPtxHandler::SetPathChunk(unsigned int path_chunk)
+{
+  // the ring holds the current position plus at least one step
+  this->path_chunk = (path_chunk > 0) ? std::max(path_chunk, 2u) : 0;
+}
+
+//
+// Enqueues (non-blocking) reads of the path rings and step counts into
+// host staging buffer (0 or 1).
+//
+void OclPtxHandler::EnqueuePathDrain(unsigned int buffer)
+{
+  this->drain_paths_host[buffer].resize(
+    static_cast<size_t>(this->section_size)*this->device_path_size);
+  this->drain_steps_host[buffer].resize(this->section_size);
+
+  this->ocl_cq->enqueueReadBuffer(
+    this->particle_paths_buffer,
+    CL_FALSE,
+    0,
+    this->particles_mem_size,
+    this->drain_paths_host[buffer].data()
+  );
+  this->ocl_cq->enqueueReadBuffer(
+    this->particle_steps_taken_buffer,
+    CL_FALSE,
+    0,
+    this->particle_uint_mem_size,
+    this->drain_steps_host[buffer].data()
+  );
+}
+
+//
+// Appends the positions particles took since their last drain, from
+// staging buffer (read once their launch finished), to drained_paths.
+// A launch takes at most device_path_size - 1 steps, so none of them
+// has been overwritten in the ring.
+//
+void OclPtxHandler::DrainPaths(
+  unsigned int buffer,
+  const std::vector<unsigned int>& particles
+)
+{
+  const std::vector<float4>& rings = this->drain_paths_host[buffer];
+
+  for (unsigned int p = 0; p < particles.size(); p++)
+  {
+    unsigned int n = particles.at(p);
+    std::vector<float4>& path = this->drained_paths.at(n);
+    const float4* ring =
+      rings.data() + static_cast<size_t>(n)*this->device_path_size;
+
+    unsigned int steps = this->drain_steps_host[buffer].at(n);
+    for (unsigned int s = path.size(); s <= steps; s++)
+      path.push_back(ring[s % this->device_path_size]);
+  }
+}
+
+//
+// --pathchunk: runs the unfinished particles num_steps at a time.
+// Each launch's rings are read back behind it and drained while the
+// next launch runs.
+//
+void OclPtxHandler::InterpolateChunks()
+{
+  std::vector<unsigned int> particle_done(this->section_size, 0);
+  std::vector<unsigned int> todo = this->particle_todo.at(0);
+  std::vector<unsigned int> drain_todo;
+  int pending = -1;
+  unsigned int buffer = 0;
+  unsigned int launches = 0;
+
+  while (!todo.empty())
+  {
+    this->ocl_cq->enqueueWriteBuffer(
+      this->compute_index_buffers.at(0),
+      CL_FALSE,
+      static_cast<unsigned int>(0),
+      todo.size()*sizeof(unsigned int),
+      todo.data(),
+      NULL,
+      NULL
+    );
+
+    this->EnqueueKernel(this->compute_index_buffers.at(0), todo.size());
+
+    this->EnqueuePathDrain(buffer);
+    this->ocl_cq->enqueueReadBuffer(
+      this->particle_done_buffer,
+      CL_FALSE,
+      0,
+      this->particle_uint_mem_size,
+      particle_done.data()
+    );
+    this->ocl_cq->flush();
+    launches++;
+
+    // the previous launch's positions, while this one runs
+    if (pending >= 0)
+      this->DrainPaths(pending, drain_todo);
+
+    this->ocl_cq->finish();
+
+    pending = buffer;
+    buffer = 1 - buffer;
+    drain_todo.swap(todo);
+
+    todo.clear();
+    for (unsigned int p = 0; p < drain_todo.size(); p++)
+      if (particle_done.at(drain_todo.at(p)) == 0)
+        todo.push_back(drain_todo.at(p));
+  }
+
+  if (pending >= 0)
+    this->DrainPaths(pending, drain_todo);
+
+  std::cout<<"Path chunks: " << launches << " launches of up to " <<
+    this->num_steps << " steps\n";
+}
+
+//*********************************************************************
+//
+// OclPtxHandler Density Map
+//
+//*********************************************************************
+
+void OclPtxHandler::SetDensityMap(
+  bool density_map,
+  unsigned int visited_slots,
+  unsigned int waypoint_count
+)
+{
+  this->density_map = density_map;
+  this->visited_slots = visited_slots;
+  this->all_waypoints = (waypoint_count >= 32) ? 0xFFFFFFFF :
+    (1u << waypoint_count) - 1;
+}
+
+void OclPtxHandler::SetDensityGroupSize(unsigned int group_size)
+{
+  this->density_group_size = group_size;
+}
+
+void OclPtxHandler::SetVoxelPaths(bool voxel_paths)
+{
+  this->voxel_paths = voxel_paths;
+}
+
+unsigned int OclPtxHandler::ParticleVoxelsToHost(
+  std::vector<unsigned int>* voxels,
+  std::vector<unsigned int>* counts
+)
+{
+  counts->resize(this->section_size);
+  this->ocl_cq->enqueueReadBuffer(
+    this->particle_voxel_count_buffer,
+    CL_TRUE,
+    0,
+    this->particle_uint_mem_size,
+    counts->data()
+  );
+
+  unsigned int stride = 0;
+  for (unsigned int n = 0; n < this->section_size; n++)
+    stride = std::max(stride, counts->at(n));
+
+  voxels->resize(static_cast<size_t>(this->section_size)*stride);
+  if (stride == 0)
+    return 0;
+
+  // the used head of every particle's slots, one row per particle
+  cl::size_t<3> origin;
+  origin[0] = 0;
+  origin[1] = 0;
+  origin[2] = 0;
+  cl::size_t<3> region;
+  region[0] = stride*sizeof(unsigned int);
+  region[1] = this->section_size;
+  region[2] = 1;
+
+  this->ocl_cq->enqueueReadBufferRect(
+    this->particle_voxels_buffer,
+    CL_TRUE,
+    origin,
+    origin,
+    region,
+    this->voxel_slots*sizeof(unsigned int),
+    0,
+    stride*sizeof(unsigned int),
+    0,
+    voxels->data()
+  );
+
+  return stride;
+}
+
+//
+// Zeroed visitation counts on the sample grid.
+//
+void OclPtxHandler::DensityInit()
+{
+  unsigned int grid_size = GridVoxelCount(
+    this->sample_nx, this->sample_ny, this->sample_nz, this->bricked_grid);
+  std::vector<unsigned int> counts(grid_size, 0);
+
+  this->density_mem_size = grid_size*sizeof(unsigned int);
+
+  std::cout<<"Density Volume Mem Size: "<< this->density_mem_size <<"\n";
+
+  this->density_volume_buffer =
+    cl::Buffer(
+      *(this->ocl_context),
+      CL_MEM_READ_WRITE,
+      this->density_mem_size,
+      NULL,
+      NULL
+    );
+
+  this->ocl_cq->enqueueWriteBuffer(
+    this->density_volume_buffer,
+    CL_TRUE,
+    static_cast<unsigned int>(0),
+    this->density_mem_size,
+    counts.data(),
+    NULL,
+    NULL
+  );
+
+  this->total_gpu_mem_size += this->density_mem_size;
+}
+
+std::vector<unsigned int> OclPtxHandler::DensityToHost()
+{
+  std::vector<unsigned int> counts(
+    this->density_mem_size/sizeof(unsigned int));
+
+  if (this->density_mem_size > 0)
+    this->ocl_cq->enqueueReadBuffer(
+      this->density_volume_buffer,
+      CL_TRUE,
+      0,
+      this->density_mem_size,
+      counts.data()
+    );
+
+  return counts;
+}
+
+unsigned int OclPtxHandler::VisitedOverflowsToHost()
+{
+  if (!this->density_map)
+    return 0;
+
+  std::vector<unsigned int> overflows(this->section_size, 0);
+  this->ocl_cq->enqueueReadBuffer(
+    this->particle_visited_overflow_buffer,
+    CL_TRUE,
+    0,
+    this->section_size*sizeof(unsigned int),
+    overflows.data()
+  );
+
+  unsigned int particles = 0;
+  for (unsigned int i = 0; i < this->section_size; i++)
+    if (overflows.at(i) != 0)
+      particles++;
+
+  return particles;
+}
+
 //*********************************************************************
 //
 // OclPtxHandler Tractography
@@ -699,50 +2069,135 @@ void OclPtxHandler::Interpolate()
 {
   //std::lock_guard<std::mutex> klock(this->kernel_mutex);
 
+  if (this->slab_width > 0)
+  {
+    this->InterpolateSlabs();
+    return;
+  }
+  if (this->chunked_paths)
+  {
+    this->InterpolateChunks();
+    return;
+  }
+
   unsigned int t_sec = this->target_section;
 
   //
   // Currently Handles single voxel/mask + No other options ONLY
   //
 
-  cl::NDRange global_range(this->todo_range.at(t_sec));
-  cl::NDRange local_range(1);
+  this->EnqueueKernel(this->compute_index_buffers.at(t_sec),
+    this->todo_range.at(t_sec));
+
+  // BLOCK
+  this->ocl_cq->finish();
+}
+
+//
+// Arguments in the order basic.cl declares them; the layout, compaction
+// and slab arguments depend on the kernel build options.
+//
+void OclPtxHandler::SetKernelArgs(const cl::Buffer& compute_index_buffer,
+                                  unsigned int particles)
+{
+  cl_uint arg = 0;
 
   // the indeces to compute, always first
-  this->ptx_kernel->setArg(0, this->compute_index_buffers.at(t_sec));
+  this->ptx_kernel->setArg(arg++, compute_index_buffer);
 
   // particle status buffers
-  this->ptx_kernel->setArg(1, this->particle_paths_buffer);
-  this->ptx_kernel->setArg(2, this->particle_steps_taken_buffer);
-  this->ptx_kernel->setArg(3, this->particle_done_buffer);
+  this->ptx_kernel->setArg(arg++, this->particle_paths_buffer);
+  this->ptx_kernel->setArg(arg++, this->particle_steps_taken_buffer);
+  this->ptx_kernel->setArg(arg++, this->particle_done_buffer);
+  this->ptx_kernel->setArg(arg++, this->particle_waypoints_buffer);
 
   // sample data buffers
-  this->ptx_kernel->setArg(4, this->f_samples_buffer);
-  this->ptx_kernel->setArg(5, this->phi_samples_buffer);
-  this->ptx_kernel->setArg(6, this->theta_samples_buffer);
-  this->ptx_kernel->setArg(7, this->brain_mask_buffer);
+  if (this->sample_layout == kCodebookSamples)
+  {
+    this->ptx_kernel->setArg(arg++, this->codebook_samples_buffer);
+    this->ptx_kernel->setArg(arg++, this->codebook_buffer);
+  }
+  else if (this->sample_layout != kSeparateSamples)
+  {
+    this->ptx_kernel->setArg(arg++, this->packed_samples_buffer);
+  }
+  else
+  {
+    this->ptx_kernel->setArg(arg++, this->f_samples_buffer);
+    this->ptx_kernel->setArg(arg++, this->phi_samples_buffer);
+    this->ptx_kernel->setArg(arg++, this->theta_samples_buffer);
+  }
+  this->ptx_kernel->setArg(arg++, this->mask_volume_buffer);
+
+  this->ptx_kernel->setArg(arg++, this->section_size);
+  this->ptx_kernel->setArg(arg++, this->max_steps);
+  this->ptx_kernel->setArg(arg++, this->device_path_size);
+  this->ptx_kernel->setArg(arg++, this->sample_nx);
+  this->ptx_kernel->setArg(arg++, this->sample_ny);
+  this->ptx_kernel->setArg(arg++, this->sample_nz);
+  this->ptx_kernel->setArg(arg++, this->sample_ns);
+
+  this->ptx_kernel->setArg(arg++, this->num_steps);
+  this->ptx_kernel->setArg(arg++, this->sample_nvoxels);
+
+  if (this->compact_samples)
+    this->ptx_kernel->setArg(arg++, this->voxel_index_buffer);
+
+  if (this->slab_width > 0)
+  {
+    this->ptx_kernel->setArg(arg++, this->slab_slots_buffer);
+    this->ptx_kernel->setArg(arg++, this->slab_first_voxel_buffer);
+    this->ptx_kernel->setArg(arg++, this->particle_slab_buffer);
+    this->ptx_kernel->setArg(arg++, this->slab_width);
+    this->ptx_kernel->setArg(arg++, this->slab_capacity);
+  }
+
+  if (this->density_map)
+  {
+    this->ptx_kernel->setArg(arg++, this->density_volume_buffer);
+    this->ptx_kernel->setArg(arg++, this->particle_last_voxel_buffer);
+    this->ptx_kernel->setArg(arg++, this->particle_visited_buffer);
+    this->ptx_kernel->setArg(arg++, this->particle_visited_overflow_buffer);
+    this->ptx_kernel->setArg(arg++, this->visited_slots);
+    this->ptx_kernel->setArg(arg++, this->all_waypoints);
+    this->ptx_kernel->setArg(arg++, particles);
+  }
+
+  if (this->voxel_paths)
+  {
+    this->ptx_kernel->setArg(arg++, this->particle_voxels_buffer);
+    this->ptx_kernel->setArg(arg++, this->particle_voxel_count_buffer);
+    this->ptx_kernel->setArg(arg++, this->voxel_slots);
+  }
+}
 
-  this->ptx_kernel->setArg(8, this->section_size);
-  this->ptx_kernel->setArg(9, this->max_steps);
-  this->ptx_kernel->setArg(10, this->sample_nx);
-  this->ptx_kernel->setArg(11, this->sample_ny);
-  this->ptx_kernel->setArg(12, this->sample_nz);
-  this->ptx_kernel->setArg(13, this->sample_ns);
+//
+// One kernel launch over the first particles entries of
+// compute_index_buffer. Work-items go one per group, except with a
+// density map and density_group_size, where the launch is padded to
+// whole groups of that size whether or not counts are staged.
+//
+void OclPtxHandler::EnqueueKernel(const cl::Buffer& compute_index_buffer,
+                                  unsigned int particles)
+{
+  size_t group_size = 1;
+  size_t global_size = particles;
+  if (this->density_map && this->density_group_size > 0)
+  {
+    group_size = this->density_group_size;
+    global_size = (global_size + group_size - 1)/group_size*group_size;
+  }
 
-  this->ptx_kernel->setArg(14, this->num_steps);
-  // Now I have to write a kernel!!! Yaaaay : )
+  this->SetKernelArgs(compute_index_buffer, particles);
 
   this->ocl_cq->enqueueNDRangeKernel(
     *(this->ptx_kernel),
     cl::NullRange,
-    global_range,
-    local_range,
+    cl::NDRange(global_size),
+    cl::NDRange(group_size),
     NULL,
     NULL
   );
-
-  // BLOCK
-  this->ocl_cq->finish();
 }
 
 
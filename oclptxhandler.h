@@ -49,6 +49,7 @@
 #endif
 
 #include "customtypes.h"
+#include "asyncpathwriter.h"
 
 class OclPtxHandler{
 
@@ -65,11 +66,50 @@ class OclPtxHandler{
     // Set/Get
     //
 
-    void ParticlePathsToFile();   // do at end
+    void ParticlePathsToFile();   // after each batch, written async
+
+    // --pathformat, --pathgzip and --writequeue. voxel_to_world (top
+    // three rows of the image's 4x4 voxel to mm matrix, row major)
+    // places .tck points in world space; csv and packed output stay in
+    // image voxels. Up to queue_batches written batches wait for the writer
+    // thread before ParticlePathsToFile blocks. streamlines, the total
+    // over every batch, goes in a compressed .tck header.
+    void SetPathOutput( PathFormat format,
+                        const float* voxel_to_world,
+                        bool compress,
+                        unsigned int queue_batches,
+                        uint64_t streamlines
+                      );
+
+    // Waits for the writer thread to finish the path file after the
+    // last batch, and reports its throughput.
+    void ClosePathFile();
 
     bool IsFinished(){ return this->interpolation_complete; };
     
-    unsigned int GpuMemUsed();
+    size_t GpuMemUsed();
+
+    // Sum of steps taken by this handler's particles so far (blocking).
+    unsigned long TotalStepsTaken();
+
+    // Last position of each of this handler's particles (blocking).
+    std::vector<float4> ParticleEndpoints();
+
+    // Copies every particle's path (particle_path_size positions each,
+    // the first steps+1 valid) and step count to the host (blocking).
+    // Positions here and in ParticleEndpoints() are grid voxels, offset
+    // from image voxels by the crop box origin with --crop. With a
+    // density map only the current positions exist: each path is that
+    // one position, with steps 0.
+    void ParticlePathsToHost( std::vector<float4>* paths,
+                              std::vector<unsigned int>* steps);
+
+    // With voxel paths: each particle's voxels (linear grid indices
+    // x*ny*nz + y*nz + z) and how many there are (blocking). Only the
+    // first as many slots as the longest list are read back; that
+    // length, the stride of voxels, is returned.
+    unsigned int ParticleVoxelsToHost(std::vector<unsigned int>* voxels,
+                                      std::vector<unsigned int>* counts);
 
     //
     // OCL Initialization
@@ -84,11 +124,107 @@ class OclPtxHandler{
                                 const BedpostXData* phi_data,
                                 const BedpostXData* theta_data,
                                 unsigned int num_directions,
-                                const unsigned short int* brain_mask
+                                const unsigned int* mask_volume,
+                                const unsigned int* voxel_index = NULL
+                              );
+    // mask_volume: combined mask bits per voxel, see
+    // SampleManager::GetMaskVolumeToArray().
+    // voxel_index: voxel -> compacted sample index (see BedpostXData),
+    // or NULL when the samples cover the full grid. A non-NULL index
+    // needs the kernel built with -D OCLPTX_COMPACT.
+    // If the BedpostXData carry half_data, those are uploaded instead of
+    // the floats and the kernel needs -D OCLPTX_HALF (same for the
+    // packed records below).
+
+    // Same, for samples interleaved into (theta, phi, f, 0) records, or
+    // (x, y, z, f) unit vector records. Needs the kernel built with
+    // -D OCLPTX_PACKED (and -D OCLPTX_UNITVEC for unit vectors).
+    void WritePackedSamplesToDevice( const PackedSampleData* packed_data,
+                                      unsigned int num_directions,
+                                      const unsigned int* mask_volume,
+                                      const unsigned int* voxel_index = NULL
+                                    );
+
+    // Same, for quantised sample codes plus the codebook entries they
+    // index. Needs the kernel built with -D OCLPTX_CODEBOOK.
+    void WriteCodebookSamplesToDevice(
+                                const CodebookSampleData* codebook_data,
+                                const float4* codebook_entries,
+                                unsigned int num_entries,
+                                unsigned int num_directions,
+                                const unsigned int* mask_volume,
+                                const unsigned int* voxel_index = NULL
                               );
     // may want to compute offset beforehand in samplemanager,
     // can decide later.
 
+    // Bytes per mask word on the device (SampleManager::GetMaskWordBytes,
+    // the kernel needs -D OCLPTX_MASK8 for 1, OCLPTX_MASK16 for 2). Call
+    // before Write*SamplesToDevice; 4 if never called.
+    void SetMaskWordBytes(unsigned int mask_word_bytes);
+
+    // --slabwidth: instead of the whole volume, keep resident_slabs
+    // slabs of slab_width x planes of samples on the device (plus one
+    // being prefetched through transfer_cq, may be NULL). Call before
+    // Write*SamplesToDevice; the kernel needs -D OCLPTX_SLABS.
+    void SetSlabStreaming(  unsigned int slab_width,
+                            unsigned int resident_slabs,
+                            cl::CommandQueue* transfer_cq
+                          );
+    // The slabs SetSlabStreaming cuts an nx x ny x nz grid into: rounds
+    // slab_width up to whole bricks if bricked and fills
+    // slab_first_voxel with the first sample voxel of each slab plus the
+    // end of the last (voxel_index NULL unless compacted). Returns the
+    // sample voxels in the largest slab.
+    static unsigned int CutSlabs( unsigned int* slab_width,
+                                  unsigned int nx,
+                                  unsigned int ny,
+                                  unsigned int nz,
+                                  bool bricked,
+                                  const unsigned int* voxel_index,
+                                  std::vector<unsigned int>* slab_first_voxel
+                                );
+
+    // --pathchunk: keep only path_chunk positions per particle on the
+    // device, as a ring drained to the host between launches, instead
+    // of max_steps + 1. Call before WriteInitialPosToDevice.
+    void SetPathChunk(unsigned int path_chunk);
+
+    // --density: count the voxels particles visit into a grid volume on
+    // the device instead of keeping their paths, each voxel once per
+    // particle. visited_slots (a power of two) bounds the voxels a
+    // particle remembers. Only particles that end neither rejected nor
+    // short of any of the waypoint_count waymasks are counted. Call
+    // before WriteInitialPosToDevice; the kernel needs -D OCLPTX_DENSITY.
+    void SetDensityMap( bool density_map,
+                        unsigned int visited_slots,
+                        unsigned int waypoint_count
+                      );
+
+    // --densitygroup: with the density map, launch work-groups of
+    // group_size particles (0: one each), padded to whole groups.
+    // Whether counts are staged per group in local memory or go
+    // straight into the volume with global atomics is the kernel's
+    // -D OCLPTX_DENSITY_LOCAL, the launch is the same either way.
+    void SetDensityGroupSize(unsigned int group_size);
+
+    // --voxelpaths: record paths as the voxels particles enter, 4 bytes
+    // per crossing instead of 16 per step (the kernel needs
+    // -D OCLPTX_VOXELPATHS). ParticlePathsToHost() and the path file
+    // then give voxel centres. Call before WriteInitialPosToDevice; not
+    // with a density map.
+    void SetVoxelPaths(bool voxel_paths);
+
+    // Visits per grid voxel (GridVoxelOffset order), summed over every
+    // batch so far (blocking).
+    std::vector<unsigned int> DensityToHost();
+
+    // Particles of the current batch whose visited set filled up, so
+    // that some voxels they entered were not counted (blocking).
+    unsigned int VisitedOverflowsToHost();
+
+    // Starts a batch: may be called again, after Interpolate(), for
+    // the next batch of particles (the samples stay on the device).
     void WriteInitialPosToDevice( const float4* initial_positions,
                                   unsigned int nparticles,
                                   unsigned int max_steps,
@@ -118,6 +254,51 @@ class OclPtxHandler{
 
 
   private:
+    void WriteMasksToDevice(  const unsigned int* mask_volume,
+                              const unsigned int* voxel_index
+                            );
+
+    void SetKernelArgs( const cl::Buffer& compute_index_buffer,
+                        unsigned int particles
+                      );
+    void EnqueueKernel( const cl::Buffer& compute_index_buffer,
+                        unsigned int particles
+                      );
+
+    //
+    // Slab streaming
+    //
+    void PlanSlabs( unsigned int num_directions,
+                    const unsigned int* voxel_index
+                  );
+    void AddSlabStream( cl::Buffer* buffer,
+                        const void* host_data,
+                        size_t record_size
+                      );
+    void UploadSlab(  unsigned int slab,
+                      unsigned int slot,
+                      bool staging,
+                      cl::CommandQueue* cq,
+                      const std::vector<cl::Event>* wait_events,
+                      std::vector<cl::Event>* events
+                    );
+    void CopyStagedSlab( unsigned int slot,
+                         const std::vector<cl::Event>* wait_events,
+                         std::vector<cl::Event>* events
+                       );
+    void InterpolateSlabs();
+
+    //
+    // Path chunks
+    //
+    void EnqueuePathDrain(unsigned int buffer);
+    void DrainPaths(  unsigned int buffer,
+                      const std::vector<unsigned int>& particles
+                    );
+    void InterpolateChunks();
+
+    void DensityInit();
+
     //
     // OpenCL Interface
     //
@@ -127,7 +308,9 @@ class OclPtxHandler{
 
     cl::Kernel* ptx_kernel;
     
-    unsigned int total_gpu_mem_size;
+    size_t total_gpu_mem_size;
+    // the part of it a new batch of particles reallocates
+    size_t particle_gpu_mem_size;
     //
     // BedpostX Data
     //
@@ -135,10 +318,51 @@ class OclPtxHandler{
     cl::Buffer f_samples_buffer;
     cl::Buffer phi_samples_buffer;
     cl::Buffer theta_samples_buffer;
-    cl::Buffer brain_mask_buffer;
-
-    unsigned int samples_buffer_size;
+    cl::Buffer mask_volume_buffer;
+    unsigned int mask_word_bytes;
+    cl::Buffer voxel_index_buffer;
+    cl::Buffer packed_samples_buffer;
+    cl::Buffer codebook_samples_buffer;
+    cl::Buffer codebook_buffer;
+
+    size_t samples_buffer_size;
     unsigned int sample_nx, sample_ny, sample_nz, sample_ns;
+    unsigned int sample_nvoxels;
+    bool compact_samples;
+    bool half_samples;
+    bool bricked_grid;
+    float4 grid_origin;   // grid voxel (0, 0, 0) in the image (--crop)
+    SampleLayout sample_layout;
+
+    //
+    // Slab streaming (--slabwidth), off while slab_width is 0
+    //
+
+    // one sample array whose slabs are copied into slots of buffer.
+    // Prefetches land in staging, a one slot buffer the kernel never
+    // reads, so transfer_cq never writes a buffer a launch is using.
+    struct SlabStream
+    {
+      const char* host_data;
+      size_t record_size;
+      cl::Buffer* buffer;
+      cl::Buffer staging;
+    };
+
+    cl::CommandQueue* transfer_cq;
+    unsigned int slab_width;
+    unsigned int resident_slabs;
+    unsigned int n_slabs;
+    unsigned int slab_capacity;   // sample voxels in the largest slab
+    // first sample voxel of each slab, plus the end of the last
+    std::vector<unsigned int> slab_first_voxel;
+    std::vector<SlabStream> slab_streams;
+    // slab each particle needs next (host copy of particle_slab_buffer)
+    std::vector<unsigned int> particle_slab;
+
+    cl::Buffer slab_slots_buffer;
+    cl::Buffer slab_first_voxel_buffer;
+    cl::Buffer particle_slab_buffer;
 
     //
     // Output Data
@@ -147,6 +371,40 @@ class OclPtxHandler{
     unsigned int n_particles;
     unsigned int max_steps;
     unsigned int particle_path_size;
+    std::string path_filename;    // ParticlePathsToFile output
+    PathFormat path_format;
+    float path_voxel_to_world[12];
+    bool path_compress;
+    unsigned int path_queue_batches;
+    uint64_t path_streamlines;
+    AsyncPathWriter path_writer;
+
+    // --pathchunk
+    unsigned int path_chunk;
+    bool chunked_paths;           // path_chunk < particle_path_size
+    unsigned int device_path_size; // positions per particle on device
+    // each particle's path so far, with chunked_paths
+    std::vector< std::vector<float4> > drained_paths;
+    // double buffered host copies of the rings and step counts
+    std::vector<float4> drain_paths_host[2];
+    std::vector<unsigned int> drain_steps_host[2];
+
+    // --density
+    bool density_map;
+    size_t density_mem_size;
+    cl::Buffer density_volume_buffer;
+    cl::Buffer particle_last_voxel_buffer;
+    unsigned int visited_slots;
+    unsigned int all_waypoints;
+    cl::Buffer particle_visited_buffer;
+    cl::Buffer particle_visited_overflow_buffer;
+    unsigned int density_group_size; // launch local size, 0: 1
+
+    // --voxelpaths
+    bool voxel_paths;
+    unsigned int voxel_slots;     // per particle, particle_path_size
+    cl::Buffer particle_voxels_buffer;
+    cl::Buffer particle_voxel_count_buffer;
 
     // TODO @STEVE:  Some of this stuff will be GPU memory limited
     // figure out which and how
@@ -163,10 +421,11 @@ class OclPtxHandler{
     cl::Buffer particle_steps_taken_buffer;
 
     cl::Buffer particle_done_buffer;
-    //cl:Buffer particle_waypoint_buffer;
+    // waymask bits (kMaskWaypointShift dropped) each particle has hit
+    cl::Buffer particle_waypoints_buffer;
     
-    unsigned int particles_mem_size;
-    unsigned int particle_uint_mem_size;
+    size_t particles_mem_size;
+    size_t particle_uint_mem_size;
     // size (Total Particles)/numDevices * (sizeof(float4))
 
     //
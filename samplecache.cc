@@ -0,0 +1,340 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* samplecache.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sys/stat.h>
+
+#include "samplecache.h"
+#include "voxelindex.h"
+
+namespace
+{
+
+const char kMagic[8] = {'O','C','L','P','T','X','S','C'};
+const uint32_t kFlagCompact = 0x1;
+const uint32_t kFlagBricked = 0x2;
+const uint32_t kFlagCropped = 0x4;
+
+struct SampleCacheHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t nFibers;
+  uint32_t nx, ny, nz, ns;
+  uint32_t nvoxels;
+  uint32_t nKeys;
+  uint32_t x0, y0, z0;    // grid origin in the image (cropped caches)
+  uint64_t voxelIndexOffset;
+  uint64_t maskOffset;
+  uint64_t samplesOffset;
+  uint64_t fiberStride;   // bytes from one fibre array to the next
+  uint64_t fileSize;
+};
+
+uint32_t CacheFlags(bool aCompact, bool aBricked, bool aCropped)
+{
+  return (aCompact ? kFlagCompact : 0) | (aBricked ? kFlagBricked : 0) |
+    (aCropped ? kFlagCropped : 0);
+}
+
+uint64_t GridBytes(const SampleCacheHeader& aHeader)
+{
+  return static_cast<uint64_t>(GridVoxelCount(aHeader.nx, aHeader.ny,
+    aHeader.nz, aHeader.flags & kFlagBricked))*sizeof(unsigned int);
+}
+
+uint64_t AlignUp(uint64_t aValue)
+{
+  const uint64_t a = SampleCache::kArrayAlignment;
+  return (aValue + a - 1)/a*a;
+}
+
+// Fills in the offsets and file size from the dimensions and counts.
+void ComputeLayout(SampleCacheHeader* aHeader)
+{
+  const uint64_t gridBytes = GridBytes(*aHeader);
+
+  uint64_t offset = AlignUp(sizeof(SampleCacheHeader) +
+    aHeader->nKeys*sizeof(SampleCacheKey));
+  aHeader->voxelIndexOffset = offset;
+  if (aHeader->flags & kFlagCompact)
+  {
+    offset = AlignUp(offset + gridBytes);
+  }
+  aHeader->maskOffset = offset;
+  offset = AlignUp(offset + gridBytes);
+  aHeader->samplesOffset = offset;
+  aHeader->fiberStride = AlignUp(
+    static_cast<uint64_t>(aHeader->ns)*aHeader->nvoxels*sizeof(float));
+  aHeader->fileSize = offset + 3*aHeader->nFibers*aHeader->fiberStride;
+}
+
+bool WriteArray(std::ofstream& aOut, const void* aData, uint64_t aBytes,
+  uint64_t aOffset)
+{
+  aOut.seekp(aOffset);
+  aOut.write(static_cast<const char*>(aData), aBytes);
+  return aOut.good();
+}
+
+}
+
+bool SampleCache::KeyFile(const std::string& aFileName,
+  SampleCacheKey* aKey)
+{
+  struct stat fileStat;
+  if (stat(aFileName.c_str(), &fileStat) != 0)
+  {
+    return false;
+  }
+  std::ifstream in(aFileName.c_str(), std::ios::binary);
+  if (!in)
+  {
+    return false;
+  }
+  // FNV-1a over the blocks, the first at the start of the file and the
+  // last ending at its end (all of it for small files)
+  const uint64_t fileSize = fileStat.st_size;
+  const uint64_t span = fileSize > kHashBlockBytes ?
+    fileSize - kHashBlockBytes : 0;
+  std::vector<char> block(kHashBlockBytes);
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t b = 0; b < kHashBlocks; b++)
+  {
+    in.clear();
+    in.seekg(span*b/(kHashBlocks - 1));
+    in.read(block.data(), block.size());
+    for (std::streamsize i = 0; i < in.gcount(); i++)
+    {
+      hash ^= static_cast<unsigned char>(block[i]);
+      hash *= 1099511628211ULL;
+    }
+  }
+
+  aKey->size = fileStat.st_size;
+  aKey->mtimeNs = static_cast<int64_t>(fileStat.st_mtim.tv_sec)*1000000000 +
+    fileStat.st_mtim.tv_nsec;
+  aKey->hash = hash;
+  return true;
+}
+
+std::string SampleCache::FindImageFile(const std::string& aBasename)
+{
+  const char* extensions[] = {"", ".nii.gz", ".nii", ".img", ".img.gz"};
+  for (unsigned int e = 0; e < 5; e++)
+  {
+    std::string name = aBasename + extensions[e];
+    struct stat fileStat;
+    if (stat(name.c_str(), &fileStat) == 0 && S_ISREG(fileStat.st_mode))
+    {
+      return name;
+    }
+  }
+  return "";
+}
+
+bool SampleCache::Open(const std::string& aCacheName,
+  const std::vector<SampleCacheKey>& aKeys, bool aCompact, bool aBricked,
+  const GridBox* aCrop)
+{
+  if (!_file.Open(aCacheName))
+  {
+    return false;
+  }
+
+  SampleCacheHeader header;
+  bool current = _file.GetSize() >= sizeof(header);
+  if (current)
+  {
+    memcpy(&header, _file.GetData(), sizeof(header));
+    current = memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+      header.version == kVersion &&
+      header.flags == CacheFlags(aCompact, aBricked, aCrop != NULL) &&
+      header.nKeys == aKeys.size();
+  }
+  if (current && aCrop != NULL)
+  {
+    current = header.x0 == aCrop->x0 && header.y0 == aCrop->y0 &&
+      header.z0 == aCrop->z0 && header.nx == aCrop->nx &&
+      header.ny == aCrop->ny && header.nz == aCrop->nz;
+  }
+  if (current)
+  {
+    SampleCacheHeader expected = header;
+    ComputeLayout(&expected);
+    current = memcmp(&expected, &header, sizeof(header)) == 0 &&
+      header.fileSize == _file.GetSize() &&
+      memcmp(_file.GetData() + sizeof(header), aKeys.data(),
+        aKeys.size()*sizeof(SampleCacheKey)) == 0;
+  }
+
+  if (!current)
+  {
+    std::cout<<"Sample cache "<<aCacheName<<" is out of date"<<std::endl;
+    _file.Close();
+    return false;
+  }
+  return true;
+}
+
+void SampleCache::GetSamples(BedpostXData* aTheta, BedpostXData* aPhi,
+  BedpostXData* aF) const
+{
+  SampleCacheHeader header;
+  memcpy(&header, _file.GetData(), sizeof(header));
+
+  BedpostXData* targets[] = {aTheta, aPhi, aF};
+  for (unsigned int d = 0; d < 3; d++)
+  {
+    BedpostXData* target = targets[d];
+    target->nx = header.nx;
+    target->ny = header.ny;
+    target->nz = header.nz;
+    target->ns = header.ns;
+    target->nvoxels = header.nvoxels;
+    target->bricked = (header.flags & kFlagBricked) != 0;
+    target->x0 = header.x0;
+    target->y0 = header.y0;
+    target->z0 = header.z0;
+    target->data.clear();
+    for (unsigned int i = 0; i < header.nFibers; i++)
+    {
+      // read only mapping: samples are never written after loading
+      const char* fiber = _file.GetData() + header.samplesOffset +
+        (d*header.nFibers + i)*header.fiberStride;
+      target->data.push_back(
+        reinterpret_cast<float*>(const_cast<char*>(fiber)));
+    }
+  }
+}
+
+const unsigned int* SampleCache::GetVoxelIndex() const
+{
+  SampleCacheHeader header;
+  memcpy(&header, _file.GetData(), sizeof(header));
+  if (!(header.flags & kFlagCompact))
+  {
+    return NULL;
+  }
+  return reinterpret_cast<const unsigned int*>(
+    _file.GetData() + header.voxelIndexOffset);
+}
+
+const unsigned int* SampleCache::GetMaskVolume() const
+{
+  SampleCacheHeader header;
+  memcpy(&header, _file.GetData(), sizeof(header));
+  return reinterpret_cast<const unsigned int*>(
+    _file.GetData() + header.maskOffset);
+}
+
+size_t SampleCache::GetGridSize() const
+{
+  SampleCacheHeader header;
+  memcpy(&header, _file.GetData(), sizeof(header));
+  return GridBytes(header)/sizeof(unsigned int);
+}
+
+bool SampleCache::Write(const std::string& aCacheName,
+  const std::vector<SampleCacheKey>& aKeys,
+  const BedpostXData& aTheta, const BedpostXData& aPhi,
+  const BedpostXData& aF, const unsigned int* aVoxelIndex,
+  const unsigned int* aMaskVolume, bool aBricked, bool aCropped)
+{
+  SampleCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.flags = CacheFlags(aVoxelIndex != NULL, aBricked, aCropped);
+  header.nFibers = aTheta.data.size();
+  header.nx = aTheta.nx;
+  header.ny = aTheta.ny;
+  header.nz = aTheta.nz;
+  header.ns = aTheta.ns;
+  header.nvoxels = aTheta.nvoxels;
+  header.nKeys = aKeys.size();
+  header.x0 = aTheta.x0;
+  header.y0 = aTheta.y0;
+  header.z0 = aTheta.z0;
+  ComputeLayout(&header);
+
+  const uint64_t gridBytes = GridBytes(header);
+  const uint64_t sampleBytes =
+    static_cast<uint64_t>(header.ns)*header.nvoxels*sizeof(float);
+
+  const std::string tempName = aCacheName + ".tmp";
+  std::ofstream out(tempName.c_str(),
+    std::ios::binary | std::ios::trunc);
+  bool ok = out.good();
+  ok = ok && WriteArray(out, &header, sizeof(header), 0);
+  ok = ok && WriteArray(out, aKeys.data(),
+    aKeys.size()*sizeof(SampleCacheKey), sizeof(header));
+  if (aVoxelIndex != NULL)
+  {
+    ok = ok && WriteArray(out, aVoxelIndex, gridBytes,
+      header.voxelIndexOffset);
+  }
+  ok = ok && WriteArray(out, aMaskVolume, gridBytes, header.maskOffset);
+
+  const BedpostXData* sources[] = {&aTheta, &aPhi, &aF};
+  for (unsigned int d = 0; d < 3; d++)
+  {
+    for (unsigned int i = 0; i < header.nFibers; i++)
+    {
+      ok = ok && WriteArray(out, sources[d]->data.at(i), sampleBytes,
+        header.samplesOffset + (d*header.nFibers + i)*header.fiberStride);
+    }
+  }
+  // pad the last array out to its stride
+  if (ok && header.nFibers > 0 && sampleBytes < header.fiberStride)
+  {
+    char zero = 0;
+    ok = WriteArray(out, &zero, 1, header.fileSize - 1);
+  }
+  out.close();
+
+  if (!ok || std::rename(tempName.c_str(), aCacheName.c_str()) != 0)
+  {
+    std::cout<<"Could not write sample cache "<<aCacheName<<std::endl;
+    std::remove(tempName.c_str());
+    return false;
+  }
+  std::cout<<"Wrote sample cache "<<aCacheName<<" ("<<
+    header.fileSize/1e6<<" MB)"<<std::endl;
+  return true;
+}
+
+//EOF
@@ -0,0 +1,119 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* samplecache.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef  OCLPTX_SAMPLECACHE_H_
+#define  OCLPTX_SAMPLECACHE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "mappedfile.h"
+#include "customtypes.h"
+
+// Identifies one input file of a cache: its size, modification time
+// (ns) and a hash of kHashBlocks blocks of kHashBlockBytes spread evenly
+// from its first to its last byte. Hashing the whole of every bedpostX
+// file would cost as much as loading it; the blocks catch a rewrite in
+// place that kept the size and the mtime second.
+struct SampleCacheKey
+{
+  uint64_t size;
+  int64_t mtimeNs;
+  uint64_t hash;
+};
+
+// On-disk copy of the reordered (and, with --compact, compacted)
+// bedpostX samples plus the combined mask volume, so later runs on the
+// same subject can map them instead of decompressing and reordering the
+// NIfTI files again. The file is only used when its layout version,
+// compaction, bricking and crop settings and the keys of every input
+// file match.
+//
+// File layout (native byte order):
+//   SampleCacheHeader, then nKeys SampleCacheKeys
+//   voxel index (GridVoxelCount unsigned ints, compacted caches only)
+//   mask volume (GridVoxelCount unsigned ints)
+//   theta, then phi, then f samples, each fibre ns*nvoxels floats
+// Every array starts on a kArrayAlignment byte boundary.
+class SampleCache
+{
+  public:
+    static const uint32_t kVersion = 4;
+    static const size_t kHashBlocks = 64;
+    static const size_t kHashBlockBytes = 4096;
+    static const size_t kArrayAlignment = 4096;
+
+    SampleCache(){};
+
+    // Key of aFileName, false if it cannot be read.
+    static bool KeyFile(const std::string& aFileName, SampleCacheKey* aKey);
+    // The file NEWIMAGE would open for image aBasename (tries the .nii.gz,
+    // .nii and .img extensions), "" if there is none.
+    static std::string FindImageFile(const std::string& aBasename);
+
+    // Maps aCacheName if it is current for aKeys. Returns false (and
+    // stays closed) for a missing, stale or damaged cache. aCrop is the
+    // expected --crop box, NULL for a full grid.
+    bool Open(const std::string& aCacheName,
+      const std::vector<SampleCacheKey>& aKeys, bool aCompact,
+      bool aBricked, const GridBox* aCrop = NULL);
+    void Close() {_file.Close();}
+    bool IsOpen() const {return _file.IsOpen();}
+
+    // Points the containers at the mapped samples. The arrays belong to
+    // the mapping and are only valid while the cache is open.
+    void GetSamples(BedpostXData* aTheta, BedpostXData* aPhi,
+      BedpostXData* aF) const;
+    // Voxel index volume, NULL for an uncompacted cache.
+    const unsigned int* GetVoxelIndex() const;
+    const unsigned int* GetMaskVolume() const;
+    size_t GetGridSize() const;
+
+    // Writes a new cache (through a temporary file, so readers never see
+    // a partial one). Returns false on failure.
+    static bool Write(const std::string& aCacheName,
+      const std::vector<SampleCacheKey>& aKeys,
+      const BedpostXData& aTheta, const BedpostXData& aPhi,
+      const BedpostXData& aF, const unsigned int* aVoxelIndex,
+      const unsigned int* aMaskVolume, bool aBricked, bool aCropped);
+
+  private:
+    SampleCache(const SampleCache&);
+    SampleCache& operator=(const SampleCache&);
+
+    MappedFile _file;
+};
+
+#endif
+
+//EOF
@@ -32,9 +32,20 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include "samplemanager.h"
 #include "oclptxOptions.h"
+#include "niftireader.h"
+#include "halffloat.h"
+#include "voxelindex.h"
 
 //
 // Assorted Functions Declerations
@@ -47,82 +58,445 @@ std::string SampleManager::IntTostring(const int& value)
     return s.str();
 }
 
-//Private method: Used for loading data directly into member containers
-void SampleManager::LoadBedpostDataHelper(
-  const std::string& aThetaSampleName,
-  const std::string& aPhiSampleName,
-  const std::string& afSampleName,
-  const NEWIMAGE::volume<float>& aMask,
-  const int aFiberNum  )
+// Peak resident set size of the process so far, in kB.
+static long PeakResidentKb()
 {
-    NEWIMAGE::volume4D<float> loadedVolume4DTheta;
-    NEWIMAGE::volume4D<float> loadedVolume4DPhi;
-    NEWIMAGE::volume4D<float> loadedVolume4Df;
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+      return 0;
+    }
+    return usage.ru_maxrss;
+}
 
-    //Load Theta/Phi/f samples
-    NEWIMAGE::read_volume4D(loadedVolume4DTheta, aThetaSampleName);
-    NEWIMAGE::read_volume4D(loadedVolume4DPhi, aPhiSampleName);
-    NEWIMAGE::read_volume4D(loadedVolume4Df, afSampleName);
+//Private method: Loads every queued sample file on a pool of
+//aThreadCount threads. Each task owns a fixed fibre slot, so the
+//result does not depend on which thread finishes first.
+void SampleManager::LoadSampleFilesParallel(
+  std::vector<SampleFileTask>& aTasks,
+  unsigned int aThreadCount)
+{
+    if(aThreadCount == 0)
+    {
+      aThreadCount = std::thread::hardware_concurrency();
+    }
+    if(aThreadCount == 0 || aThreadCount > aTasks.size())
+    {
+      aThreadCount = aTasks.empty() ? 1 : aTasks.size();
+    }
 
-    if(aMask.xsize() > 0)
+    //Each load thread may inflate a BGZF file on threads of its own;
+    //together they get the cores (or --inflatethreads each, if fewer).
+    unsigned int cores = std::max(std::thread::hardware_concurrency(), 1u);
+    _inflateThreads = std::max(cores/aThreadCount, 1u);
+    if(_oclptxOptions.inflatethreads.value() > 0)
     {
-        //_thetaSamples.push_back(loadedVolume4DTheta.matrix(aMask));
-        //_phiSamples.push_back(loadedVolume4DPhi.matrix(aMask));
-        //_fSamples.push_back(loadedVolume4Df.matrix(aMask));
+      _inflateThreads = std::min(_inflateThreads,
+        static_cast<unsigned int>(_oclptxOptions.inflatethreads.value()));
     }
-    else
+    std::cout<<"Loading "<<aTasks.size()<<" sample files on "<<
+      aThreadCount<<" threads ("<<_inflateThreads<<
+      " to inflate each BGZF file)"<<std::endl;
+
+    std::atomic<unsigned int> nextTask(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]()
+    {
+      unsigned int t;
+      while((t = nextTask++) < aTasks.size())
+      {
+        SampleFileTask& task = aTasks.at(t);
+        auto fileStart = std::chrono::high_resolution_clock::now();
+        try
+        {
+          LoadSampleFile(task.fileName, *task.target, task.fiberNum);
+        }
+        catch(std::exception& e)
+        {
+          std::lock_guard<std::mutex> lock(_loadMutex);
+          std::cout<<"Error loading "<<task.fileName<<": "<<
+            e.what()<<std::endl;
+          failed = true;
+        }
+        auto fileEnd = std::chrono::high_resolution_clock::now();
+        task.seconds =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+            fileEnd-fileStart).count()/1000.0;
+      }
+    };
+
+    std::vector<std::thread> pool;
+    for(unsigned int i = 1; i < aThreadCount; i++)
+    {
+      pool.push_back(std::thread(worker));
+    }
+    worker();
+    for(unsigned int i = 0; i < pool.size(); i++)
     {
-        PopulateMemberParameters(loadedVolume4DTheta,
-          _thetaData, loadedVolume4DTheta[0], aFiberNum);
-        PopulateMemberParameters(loadedVolume4DPhi,
-          _phiData, loadedVolume4DPhi[0], aFiberNum);
-        PopulateMemberParameters(loadedVolume4Df,
-          _fData, loadedVolume4Df[0], aFiberNum);
+      pool.at(i).join();
+    }
+
+    for(unsigned int t = 0; t < aTasks.size(); t++)
+    {
+      std::cout<<"  "<<aTasks.at(t).fileName<<" (s): "<<
+        aTasks.at(t).seconds<<std::endl;
+    }
+    if(failed)
+    {
+      std::cout<<"Could not load samples. Exiting Program..."<<std::endl;
+      exit(1);
     }
 }
 
+//Private method: Loads one theta/phi/f sample file into aFiberNum of
+//aTargetContainer. Uncompressed float NIfTI files are memory mapped,
+//gzipped ones inflated in memory (block-parallel where possible), and
+//either is reordered in a single pass; anything else goes through
+//NEWIMAGE.
+void SampleManager::LoadSampleFile(
+  const std::string& aSampleName,
+  BedpostXData& aTargetContainer,
+  const int aFiberNum)
+{
+    NiftiReader reader;
+    reader.SelectVolumes(_oclptxOptions.subset.value(),
+      _oclptxOptions.randsubset.value(), _oclptxOptions.rseed.value());
+    auto openStart = std::chrono::high_resolution_clock::now();
+    if(!_oclptxOptions.nommap.value() &&
+      (reader.OpenMapped(aSampleName) || reader.OpenCompressed(
+        aSampleName, _inflateThreads)))
+    {
+      auto reorderStart = std::chrono::high_resolution_clock::now();
+      const NiftiInfo& info = reader.GetInfo();
+      float* target = AllocateFiberData(aTargetContainer, aFiberNum,
+        info.nx, info.ny, info.nz, reader.GetVolumeCount());
+      reader.CopyToBedpostLayout(target, GetVoxelIndexToArray(),
+        aTargetContainer.nvoxels, _bricked, _cropped ? &_gridBox : NULL);
+      auto reorderEnd = std::chrono::high_resolution_clock::now();
+
+      std::lock_guard<std::mutex> lock(_loadMutex);
+      std::cout<<"  "<<aSampleName<<" open/inflate (s): "<<
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+          reorderStart-openStart).count()/1000.0<<
+        " ("<<reader.GetInflatedBlocks()<<" parallel blocks), reorder (s): "<<
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+          reorderEnd-reorderStart).count()/1000.0<<std::endl;
+      return;
+    }
+
+    NEWIMAGE::volume4D<float> loadedVolume4D;
+    NEWIMAGE::read_volume4D(loadedVolume4D, aSampleName);
+    PopulateMemberParameters(loadedVolume4D, aTargetContainer, aFiberNum);
+}
+
+//Private method: Sets the container dimensions (those of the crop box
+//with --crop) and allocates the (zeroed) sample array for aFiberNum.
+//Called from the load pool.
+float* SampleManager::AllocateFiberData(
+  BedpostXData& aTargetContainer,
+  const int aFiberNum,
+  const int aNx, const int aNy, const int aNz, const int aNs)
+{
+    std::lock_guard<std::mutex> lock(_loadMutex);
+    GridBox box = {0, 0, 0, static_cast<unsigned int>(aNx),
+      static_cast<unsigned int>(aNy), static_cast<unsigned int>(aNz)};
+    if(_cropped)
+    {
+      if(aNx != _brainMask.xsize() || aNy != _brainMask.ysize() ||
+        aNz != _brainMask.zsize())
+      {
+        throw std::runtime_error(
+          "brain mask and samples have different dimensions");
+      }
+      box = _gridBox;
+    }
+    unsigned int nvoxels = GridVoxelCount(box.nx, box.ny, box.nz, _bricked);
+    if(_voxelIndex.data != NULL)
+    {
+      if(_voxelIndex.count != nvoxels)
+      {
+        throw std::runtime_error(
+          "brain mask and samples have different dimensions");
+      }
+      nvoxels = _nCompactVoxels;
+    }
+    aTargetContainer.nx = box.nx;
+    aTargetContainer.ny = box.ny;
+    aTargetContainer.nz = box.nz;
+    aTargetContainer.ns = aNs;
+    aTargetContainer.nvoxels = nvoxels;
+    aTargetContainer.bricked = _bricked;
+    aTargetContainer.x0 = box.x0;
+    aTargetContainer.y0 = box.y0;
+    aTargetContainer.z0 = box.z0;
+
+    if(aTargetContainer.data.size() <= static_cast<unsigned int>(aFiberNum))
+    {
+      aTargetContainer.data.resize(aFiberNum + 1, NULL);
+    }
+    float* target = _arena.Allocate<float>(static_cast<size_t>(aNs)*nvoxels);
+    aTargetContainer.data.at(aFiberNum) = target;
+    return target;
+}
+
+//Private method: The NEWIMAGE fallback of LoadSampleFile. Copies every
+//voxel of the grid (crop box), or only the in-mask voxels when
+//compacted, as NiftiReader::CopyToBedpostLayout does.
 void SampleManager::PopulateMemberParameters(
-  const NEWIMAGE::volume4D<float> aLoadedData,
+  const NEWIMAGE::volume4D<float>& aLoadedData,
   BedpostXData& aTargetContainer,
-  const NEWIMAGE::volume<float> aMaskParams,
   const int aFiberNum)
 {
 
-    const int ns = aLoadedData.tsize();
-    const int nx = aLoadedData.xsize();
-    const int ny = aLoadedData.ysize();
-    const int nz = aLoadedData.zsize();
+    //The same --subset volumes NiftiReader would pick.
+    const std::vector<unsigned int> volumes = NiftiReader::ChooseVolumes(
+      aLoadedData.tsize(), _oclptxOptions.subset.value(),
+      _oclptxOptions.randsubset.value(), _oclptxOptions.rseed.value());
+    const int ns = volumes.size();
 
-    aTargetContainer.data.push_back( new float[ns*nx*ny*nz] );
-    aTargetContainer.nx = nx;
-    aTargetContainer.ny = ny;
-    aTargetContainer.nz = nz;
-    aTargetContainer.ns = ns;
+    float* target = AllocateFiberData(aTargetContainer, aFiberNum,
+      aLoadedData.xsize(), aLoadedData.ysize(), aLoadedData.zsize(), ns);
+    const unsigned int nvoxels = aTargetContainer.nvoxels;
+    const int nx = aTargetContainer.nx;
+    const int ny = aTargetContainer.ny;
+    const int nz = aTargetContainer.nz;
+    const int x0 = aTargetContainer.x0;
+    const int y0 = aTargetContainer.y0;
+    const int z0 = aTargetContainer.z0;
 
-    int xoff = aLoadedData[0].minx() - aMaskParams.minx();
-    int yoff = aLoadedData[0].miny() - aMaskParams.miny();
-    int zoff = aLoadedData[0].minz() - aMaskParams.minz();
-    for (int z = aMaskParams.minz(); z <= aMaskParams.maxz(); z++)
+    for (int z = z0; z < z0 + nz; z++)
     {
-      for (int y = aMaskParams.miny(); y <= aMaskParams.maxy(); y++)
+      for (int y = y0; y < y0 + ny; y++)
       {
-        for (int x = aMaskParams.minx(); x <= aMaskParams.maxx(); x++)
+        for (int x = x0; x < x0 + nx; x++)
         {
-            if (aMaskParams(x,y,z) > 0)
+            unsigned int voxel = GridVoxelOffset(x - x0, y - y0, z - z0,
+              nx, ny, nz, _bricked);
+            if(_voxelIndex.data != NULL)
             {
-                for (int t = aLoadedData.mint();
-                  t <= aLoadedData.maxt(); t++)
+                voxel = _voxelIndex[voxel];
+                if(voxel == kVoxelOutsideMask)
                 {
-                    aTargetContainer.data.at(aFiberNum)[t*nx*ny*nz +
-                      x*nz*ny + y*nz + z] =
-                        aLoadedData[t](x+xoff,y+yoff,z+zoff);
+                    continue;
                 }
             }
+            for (int s = 0; s < ns; s++)
+            {
+                target[s*nvoxels + voxel] = aLoadedData[
+                  aLoadedData.mint() + volumes.at(s)](x,y,z);
+            }
         }
       }
   }
 }
 
+//Private method: Numbers the voxels inside aMaskName in storage order,
+//so compacted samples keep the spatial ordering of the full grid
+//(linear or bricked). With --crop, only the crop box is indexed.
+void SampleManager::BuildVoxelIndex(const std::string& aMaskName)
+{
+    NEWIMAGE::volume<short int> mask;
+    NEWIMAGE::read_volume(mask, aMaskName);
+
+    GridBox box = {0, 0, 0, static_cast<unsigned int>(mask.xsize()),
+      static_cast<unsigned int>(mask.ysize()),
+      static_cast<unsigned int>(mask.zsize())};
+    if(_cropped)
+    {
+      box = _gridBox;
+    }
+    const int sizeX = box.nx;
+    const int sizeY = box.ny;
+    const int sizeZ = box.nz;
+
+    //Mark the in-mask voxels, then number them in storage order (which
+    //is not the x/y/z loop order when bricked).
+    _voxelIndex = _arena.AllocateView<unsigned int>(
+      GridVoxelCount(sizeX, sizeY, sizeZ, _bricked));
+    std::fill(_voxelIndex.data, _voxelIndex.data + _voxelIndex.count,
+      kVoxelOutsideMask);
+    for (int x = 0; x < sizeX; x++)
+    {
+      for (int y = 0; y < sizeY; y++)
+      {
+        for (int z = 0; z < sizeZ; z++)
+        {
+          if (mask(box.x0 + x, box.y0 + y, box.z0 + z) > 0)
+          {
+            _voxelIndex[
+              GridVoxelOffset(x, y, z, sizeX, sizeY, sizeZ, _bricked)] = 0;
+          }
+        }
+      }
+    }
+    _nCompactVoxels = 0;
+    for (size_t v = 0; v < _voxelIndex.count; v++)
+    {
+      if (_voxelIndex[v] != kVoxelOutsideMask)
+      {
+        _voxelIndex[v] = _nCompactVoxels;
+        _nCompactVoxels++;
+      }
+    }
+    std::cout<<"Compacting samples to "<<_nCompactVoxels<<" of "<<
+      _voxelIndex.count<<" voxels"<<std::endl;
+}
+
+//Private method: Sets _gridBox to the part of the image the sample and
+//mask arrays will hold: with --crop the bounding box of the brain mask
+//plus one voxel on every side (clamped to the image), so a particle
+//that leaves the mask still reads samples and mask bits exactly as on
+//the full grid; otherwise the whole image.
+void SampleManager::ComputeGridBox()
+{
+    const int sizeX = _brainMask.xsize();
+    const int sizeY = _brainMask.ysize();
+    const int sizeZ = _brainMask.zsize();
+    GridBox full = {0, 0, 0, static_cast<unsigned int>(sizeX),
+      static_cast<unsigned int>(sizeY), static_cast<unsigned int>(sizeZ)};
+    _gridBox = full;
+    if(!_cropped)
+    {
+      return;
+    }
+
+    int minX = sizeX, minY = sizeY, minZ = sizeZ;
+    int maxX = -1, maxY = -1, maxZ = -1;
+    for (int z = 0; z < sizeZ; z++)
+    {
+      for (int y = 0; y < sizeY; y++)
+      {
+        for (int x = 0; x < sizeX; x++)
+        {
+          if (_brainMask(x,y,z) != 0)
+          {
+            minX = std::min(minX, x);
+            minY = std::min(minY, y);
+            minZ = std::min(minZ, z);
+            maxX = std::max(maxX, x);
+            maxY = std::max(maxY, y);
+            maxZ = std::max(maxZ, z);
+          }
+        }
+      }
+    }
+    if(maxX < 0)
+    {
+      std::cout<<"Brain mask is empty, not cropping"<<std::endl;
+      _cropped = false;
+      return;
+    }
+
+    minX = std::max(minX - 1, 0);
+    minY = std::max(minY - 1, 0);
+    minZ = std::max(minZ - 1, 0);
+    maxX = std::min(maxX + 1, sizeX - 1);
+    maxY = std::min(maxY + 1, sizeY - 1);
+    maxZ = std::min(maxZ + 1, sizeZ - 1);
+    _gridBox.x0 = minX;
+    _gridBox.y0 = minY;
+    _gridBox.z0 = minZ;
+    _gridBox.nx = maxX - minX + 1;
+    _gridBox.ny = maxY - minY + 1;
+    _gridBox.nz = maxZ - minZ + 1;
+
+    const double kept = static_cast<double>(_gridBox.nx)*_gridBox.ny*
+      _gridBox.nz/(static_cast<double>(sizeX)*sizeY*sizeZ);
+    std::cout<<"Cropping "<<sizeX<<"x"<<sizeY<<"x"<<sizeZ<<" grid to "<<
+      _gridBox.nx<<"x"<<_gridBox.ny<<"x"<<_gridBox.nz<<" at ("<<
+      _gridBox.x0<<", "<<_gridBox.y0<<", "<<_gridBox.z0<<"), "<<
+      100.0*kept<<"% of the voxels"<<std::endl;
+}
+
+//Private method: Waymask files named by --waypoints, in bit order.
+std::vector<std::string> SampleManager::GetWayMaskFileNames()
+{
+    std::vector<std::string> names;
+    if(_oclptxOptions.waypoints.set())
+    {
+      std::istringstream ss(_oclptxOptions.waypoints.value());
+      std::string wayMaskLocation;
+      while(std::getline(ss,wayMaskLocation,','))
+      {
+        names.push_back(wayMaskLocation);
+      }
+    }
+    return names;
+}
+
+//Private method: Keys every sample and mask input, then maps the
+//--cache file if it was written for exactly these inputs.
+bool SampleManager::LoadSampleCache(
+  const std::vector<SampleFileTask>& aTasks)
+{
+    std::vector<std::string> inputs;
+    for(unsigned int t = 0; t < aTasks.size(); t++)
+    {
+      inputs.push_back(aTasks.at(t).fileName);
+    }
+    inputs.push_back(_oclptxOptions.maskfile.value());
+    inputs.push_back(_oclptxOptions.seedref.value());
+    inputs.push_back(_oclptxOptions.rubbishfile.value());
+    inputs.push_back(_oclptxOptions.stopfile.value());
+    std::vector<std::string> wayMasks = GetWayMaskFileNames();
+    inputs.insert(inputs.end(), wayMasks.begin(), wayMasks.end());
+
+    _cacheKeys.clear();
+    for(unsigned int i = 0; i < inputs.size(); i++)
+    {
+      //Unset optional masks still take a (zero) key, so adding or
+      //dropping one invalidates the cache.
+      SampleCacheKey key = {0, 0, 0};
+      if(inputs.at(i) != "")
+      {
+        std::string fileName = SampleCache::FindImageFile(inputs.at(i));
+        if(fileName == "" || !SampleCache::KeyFile(fileName, &key))
+        {
+          std::cout<<"Cannot cache samples, "<<inputs.at(i)<<
+            " is not readable"<<std::endl;
+          _cacheKeys.clear();
+          return false;
+        }
+      }
+      _cacheKeys.push_back(key);
+    }
+    //The --subset choice is keyed like one more input.
+    SampleCacheKey subsetKey = {
+      static_cast<uint64_t>(std::max(_oclptxOptions.subset.value(), 0)),
+      _oclptxOptions.randsubset.value() ? 1 : 0,
+      _oclptxOptions.randsubset.value() ?
+        static_cast<uint64_t>(_oclptxOptions.rseed.value()) : 0};
+    _cacheKeys.push_back(subsetKey);
+
+    if(!_sampleCache.Open(_oclptxOptions.samplecache.value(),
+      _cacheKeys, _oclptxOptions.compact.value(), _bricked,
+      _cropped ? &_gridBox : NULL))
+    {
+      return false;
+    }
+    _sampleCache.GetSamples(&_thetaData, &_phiData, &_fData);
+
+    const unsigned int* voxelIndex = _sampleCache.GetVoxelIndex();
+    if(voxelIndex != NULL)
+    {
+      _voxelIndex = _arena.AllocateView<unsigned int>(
+        _sampleCache.GetGridSize());
+      std::copy(voxelIndex, voxelIndex + _voxelIndex.count,
+        _voxelIndex.data);
+      _nCompactVoxels = _thetaData.nvoxels;
+    }
+    return true;
+}
+
+//Private method: Saves the loaded samples and combined mask volume to
+//the --cache file for the next run.
+void SampleManager::WriteSampleCache()
+{
+    SampleCache::Write(_oclptxOptions.samplecache.value(), _cacheKeys,
+      _thetaData, _phiData, _fData, GetVoxelIndexToArray(),
+      GetMaskVolumeToArray(), _bricked, _cropped);
+}
+
 void SampleManager::LoadBedpostData(const std::string& aBasename)
 {
     std::cout<<"Loading Bedpost samples....."<<std::endl;
@@ -131,44 +505,35 @@ void SampleManager::LoadBedpostData(const std::string& aBasename)
       std::cout<< "Bad File Name"<<std::endl;
       return;
     }
+    auto loadStart = std::chrono::high_resolution_clock::now();
 
     //Set Particle Number and Max Steps
     _nParticles = _oclptxOptions.nparticles.value();
     _nMaxSteps = _oclptxOptions.nsteps.value();
+    _bricked = _oclptxOptions.bricked.value();
+    _cropped = _oclptxOptions.crop.value();
+    ComputeGridBox();
 
-    //Load Sample Data
-    std::string thetaSampleNames;
-    std::string phiSampleNames;
-    std::string fSampleNames;
+    //Find the fibre files first so every fibre has a fixed slot in the
+    //containers before any loading starts.
+    std::vector<std::string> fiberSuffixes;
 
     //Single Fiber Case.
     if(NEWIMAGE::fsl_imageexists(aBasename+"_thsamples"))
     {
-      thetaSampleNames = aBasename+"_thsamples";
-      phiSampleNames = aBasename+"_phisamples";
-      fSampleNames = aBasename+"_fsamples";
-      LoadBedpostDataHelper(
-        thetaSampleNames,phiSampleNames,fSampleNames);
+      fiberSuffixes.push_back("");
     }
     //Multiple Fiber Case.
     else
     {
       int fiberNum = 1;
       std::string fiberNumAsstring = IntTostring(fiberNum);
-      thetaSampleNames = aBasename+"_th"+fiberNumAsstring+"samples";
-      bool doesFiberExist = NEWIMAGE::fsl_imageexists(thetaSampleNames);
-      while(doesFiberExist)
+      while(NEWIMAGE::fsl_imageexists(
+        aBasename+"_th"+fiberNumAsstring+"samples"))
       {
-        phiSampleNames = aBasename+"_ph"+fiberNumAsstring+"samples";
-        fSampleNames = aBasename+"_f"+fiberNumAsstring+"samples";
-
-        LoadBedpostDataHelper(
-         thetaSampleNames,phiSampleNames,fSampleNames);
-
+        fiberSuffixes.push_back(fiberNumAsstring);
         fiberNum++;
         fiberNumAsstring = IntTostring(fiberNum);
-        thetaSampleNames = aBasename+"_th"+fiberNumAsstring+"samples";
-        doesFiberExist = NEWIMAGE::fsl_imageexists(thetaSampleNames);
       }
       if(fiberNum == 1)
       {
@@ -176,8 +541,60 @@ void SampleManager::LoadBedpostData(const std::string& aBasename)
            "Could not find samples. Exiting Program..."<<std::endl;
           exit(1);
       }
+    }
+
+    const unsigned int nFibers = fiberSuffixes.size();
+    _thetaData.data.assign(nFibers, NULL);
+    _phiData.data.assign(nFibers, NULL);
+    _fData.data.assign(nFibers, NULL);
+
+    std::vector<SampleFileTask> tasks;
+    for(unsigned int i = 0; i < nFibers; i++)
+    {
+      const std::string& suffix = fiberSuffixes.at(i);
+      SampleFileTask theta = {aBasename+"_th"+suffix+"samples",
+        &_thetaData, static_cast<int>(i), 0.0};
+      SampleFileTask phi = {aBasename+"_ph"+suffix+"samples",
+        &_phiData, static_cast<int>(i), 0.0};
+      SampleFileTask f = {aBasename+"_f"+suffix+"samples",
+        &_fData, static_cast<int>(i), 0.0};
+      //Single fibre files are named _thsamples/_phisamples/_fsamples.
+      if(suffix == "")
+      {
+        phi.fileName = aBasename+"_phisamples";
+      }
+      tasks.push_back(theta);
+      tasks.push_back(phi);
+      tasks.push_back(f);
+    }
+
+    if(_oclptxOptions.samplecache.value() != "" && LoadSampleCache(tasks))
+    {
+      std::cout<<"Mapped Samples from "<<
+        _oclptxOptions.samplecache.value()<<std::endl;
+    }
+    else
+    {
+      if(_oclptxOptions.compact.value())
+      {
+        BuildVoxelIndex(_oclptxOptions.maskfile.value());
+      }
+      LoadSampleFilesParallel(tasks, _oclptxOptions.loadthreads.value());
       std::cout<<"Finished Loading Samples from Bedpost"<<std::endl;
     }
+    if(_oclptxOptions.subset.value() > 0)
+    {
+      std::cout<<"Using "<<_thetaData.ns<<" samples per fibre ("<<
+        (_oclptxOptions.randsubset.value() ? "random" : "strided")<<
+        " --subset)"<<std::endl;
+    }
+
+    auto loadEnd = std::chrono::high_resolution_clock::now();
+    std::cout<<"Sample Load Time (s): "<<
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+        loadEnd-loadStart).count()/1000.0<<std::endl;
+    std::cout<<"Peak RSS After Load (MB): "<<
+      PeakResidentKb()/1024.0<<std::endl;
 }
 
 void SampleManager::ParseCommandLine(int argc, char** argv)
@@ -200,7 +617,7 @@ void SampleManager::ParseCommandLine(int argc, char** argv)
           exit(1);
         }
         std::cout<<"Running in simple mode"<<std::endl;
-        this->LoadBedpostData(_oclptxOptions.basename.value());
+        //The brain mask comes first: --crop sizes the sample grid by it.
         if(_oclptxOptions.seedref.value() == "")
         {
           NEWIMAGE::read_volume(_brainMask,
@@ -211,6 +628,19 @@ void SampleManager::ParseCommandLine(int argc, char** argv)
           NEWIMAGE::read_volume(_brainMask,
             _oclptxOptions.seedref.value());
         }
+        this->LoadBedpostData(_oclptxOptions.basename.value());
+        if(GetSampleLayout() == kPackedSamples)
+        {
+          this->BuildPackedSamples();
+        }
+        else if(GetSampleLayout() == kUnitVectorSamples)
+        {
+          this->BuildUnitVectorSamples();
+        }
+        else if(GetSampleLayout() == kCodebookSamples)
+        {
+          this->BuildCodebookSamples();
+        }
         if(_oclptxOptions.rubbishfile.value() != "")
         {
            NEWIMAGE::read_volume(_exclusionMask,
@@ -225,16 +655,29 @@ void SampleManager::ParseCommandLine(int argc, char** argv)
         }
         if(_oclptxOptions.waypoints.set())
         {
-          std::string waypoints = _oclptxOptions.waypoints.value();
-          std::istringstream ss(waypoints);
-          std::string wayMaskLocation;
-          while(std::getline(ss,wayMaskLocation,','))
+          std::vector<std::string> wayMaskNames = GetWayMaskFileNames();
+          for(unsigned int i = 0; i < wayMaskNames.size(); i++)
           {
             NEWIMAGE::volume<short int> vol;
-            NEWIMAGE::read_volume(vol, wayMaskLocation);
+            NEWIMAGE::read_volume(vol, wayMaskNames.at(i));
             _wayMasks.push_back(vol);
           }
           cout<<"Successfully loaded " << _wayMasks.size() << " WayMasks"<<endl;
+          if(_wayMasks.size() > kMaxWayMasks)
+          {
+            cout<<"At most " << kMaxWayMasks << " WayMasks are supported"
+              <<endl;
+            exit(1);
+          }
+        }
+        if(!_cacheKeys.empty() && !_sampleCache.IsOpen())
+        {
+          this->WriteSampleCache();
+        }
+        if(_oclptxOptions.mlockHost.value() && !_arena.Lock())
+        {
+          std::cout<<"Could not lock host memory (RLIMIT_MEMLOCK), "
+            "continuing unlocked"<<std::endl;
         }
         _showPaths = _oclptxOptions.showPaths.value();
         this->GenerateSeedParticles(_oclptxOptions.sampvox.value());
@@ -319,6 +762,10 @@ void SampleManager::GenerateSeedParticlesHelper(
       randomParticle.y += dy / _brainMask.ydim();
       randomParticle.z += dz / _brainMask.zdim();
     }
+    //Seeds are given in image voxels, the kernel works on the grid.
+    randomParticle.x -= _gridBox.x0;
+    randomParticle.y -= _gridBox.y0;
+    randomParticle.z -= _gridBox.z0;
     _seedParticles.push_back(randomParticle);
    }
 }
@@ -363,18 +810,180 @@ const std::vector<unsigned short int*> SampleManager::GetWayMasksToVector()
   return waymasks;
 }
 
+unsigned int SampleManager::GetWayMaskCount()
+{
+  return GetWayMaskFileNames().size();
+}
+
+void SampleManager::SaveDensityVolume(const unsigned int* aCounts)
+{
+  NEWIMAGE::volume<float> density(_brainMask.xsize(), _brainMask.ysize(),
+    _brainMask.zsize());
+  density.copyproperties(_brainMask);
+  density = 0.0f;
+
+  //Back from the (possibly cropped) grid to image voxels.
+  for (unsigned int z = 0; z < _gridBox.nz; z++)
+  {
+    for (unsigned int y = 0; y < _gridBox.ny; y++)
+    {
+      for (unsigned int x = 0; x < _gridBox.nx; x++)
+      {
+        density(_gridBox.x0 + x, _gridBox.y0 + y, _gridBox.z0 + z) =
+          aCounts[GridVoxelOffset(x, y, z, _gridBox.nx, _gridBox.ny,
+            _gridBox.nz, _bricked)];
+      }
+    }
+  }
+
+  const std::string dirName = _oclptxOptions.logdir.value();
+  mkdir(dirName.c_str(), 0755);
+  const std::string fileName = dirName + "/" + _oclptxOptions.outfile.value();
+  if(NEWIMAGE::save_volume(density, fileName) != 0)
+  {
+    std::cout<<"Error: could not write "<<fileName<<std::endl;
+    exit(1);
+  }
+  std::cout<<"Density map written to "<<fileName<<std::endl;
+}
+
+void SampleManager::GetVoxelToWorld(float* aMatrix)
+{
+  Matrix voxelToWorld = _brainMask.newimagevox2mm_mat();
+  for (int r = 0; r < 3; r++)
+  {
+    for (int c = 0; c < 4; c++)
+    {
+      aMatrix[4*r + c] = voxelToWorld(r + 1, c + 1);
+    }
+  }
+}
+
+const unsigned int* SampleManager::GetMaskVolumeToArray()
+{
+  if(_maskVolume != NULL)
+  {
+    return _maskVolume;
+  }
+  if(_sampleCache.IsOpen())
+  {
+    const size_t gridSize = _sampleCache.GetGridSize();
+    _maskVolume = _arena.Allocate<unsigned int>(gridSize);
+    std::copy(_sampleCache.GetMaskVolume(),
+      _sampleCache.GetMaskVolume() + gridSize, _maskVolume);
+    return _maskVolume;
+  }
+
+  const int sizeX = _gridBox.nx;
+  const int sizeY = _gridBox.ny;
+  const int sizeZ = _gridBox.nz;
+
+  const bool haveExclusion = MatchesBrainMask(_exclusionMask);
+  const bool haveTermination = MatchesBrainMask(_terminationMask);
+  std::vector<unsigned int> wayMaskIds;
+  for (unsigned int i = 0; i < _wayMasks.size(); i++)
+  {
+    if(MatchesBrainMask(_wayMasks.at(i)))
+    {
+      wayMaskIds.push_back(i);
+    }
+  }
+
+  unsigned int* target =
+    _arena.Allocate<unsigned int>(
+      GridVoxelCount(sizeX, sizeY, sizeZ, _bricked));
+
+  for (int x = 0; x < sizeX; x++)
+  {
+    for (int y = 0; y < sizeY; y++)
+    {
+      for (int z = 0; z < sizeZ; z++)
+      {
+        const int ix = _gridBox.x0 + x;
+        const int iy = _gridBox.y0 + y;
+        const int iz = _gridBox.z0 + z;
+        unsigned int bits = 0;
+        if(_brainMask(ix,iy,iz) != 0)
+        {
+          bits |= kMaskBrain;
+        }
+        if(haveExclusion && _exclusionMask(ix,iy,iz) != 0)
+        {
+          bits |= kMaskExclusion;
+        }
+        if(haveTermination && _terminationMask(ix,iy,iz) != 0)
+        {
+          bits |= kMaskTermination;
+        }
+        for (unsigned int i = 0; i < wayMaskIds.size(); i++)
+        {
+          const unsigned int id = wayMaskIds.at(i);
+          if(_wayMasks.at(id)(ix,iy,iz) != 0)
+          {
+            bits |= 1u << (kMaskWaypointShift + id);
+          }
+        }
+        target[GridVoxelOffset(x, y, z, sizeX, sizeY, sizeZ, _bricked)] =
+          bits;
+      }
+    }
+  }
+  _maskVolume = target;
+  return _maskVolume;
+}
+
+unsigned int SampleManager::GetMaskWordBytes()
+{
+  const unsigned int* maskVolume = GetMaskVolumeToArray();
+  const size_t gridSize = _sampleCache.IsOpen() ?
+    _sampleCache.GetGridSize() :
+    GridVoxelCount(_gridBox.nx, _gridBox.ny, _gridBox.nz, _bricked);
+  unsigned int bits = 0;
+  for (size_t v = 0; v < gridSize; v++)
+  {
+    bits |= maskVolume[v];
+  }
+  if(bits <= 0xFF)
+  {
+    return 1;
+  }
+  return bits <= 0xFFFF ? 2 : 4;
+}
+
+//Private method: True if aMask was loaded and shares the brain mask
+//grid. A loaded mask on another grid is fatal.
+bool SampleManager::MatchesBrainMask(
+  const NEWIMAGE::volume<short int>& aMask)
+{
+  if(aMask.xsize() == 0)
+  {
+    return false;
+  }
+  if(aMask.xsize() != _brainMask.xsize() ||
+    aMask.ysize() != _brainMask.ysize() ||
+    aMask.zsize() != _brainMask.zsize())
+  {
+    cout<<"Mask dimensions do not match the brain mask"<<endl;
+    exit(1);
+  }
+  return true;
+}
 
 unsigned short int* SampleManager::GetMaskToArray(NEWIMAGE::volume<short int> aMask)
 {
-  const int maxZ = aMask.maxz();
-  const int maxY = aMask.maxy();
-  const int maxX = aMask.maxx();
-  const int minZ = aMask.minz();
-  const int minY = aMask.miny();
-  const int minX = aMask.minx();
-  const int sizeX = aMask.xsize();
-  const int sizeY = aMask.ysize();
-  const int sizeZ = aMask.zsize();
+  //Only the part of the mask inside the grid box is kept.
+  const int minZ = std::max(aMask.minz(), static_cast<int>(_gridBox.z0));
+  const int minY = std::max(aMask.miny(), static_cast<int>(_gridBox.y0));
+  const int minX = std::max(aMask.minx(), static_cast<int>(_gridBox.x0));
+  const int maxZ = std::min(aMask.maxz(),
+    static_cast<int>(_gridBox.z0 + _gridBox.nz) - 1);
+  const int maxY = std::min(aMask.maxy(),
+    static_cast<int>(_gridBox.y0 + _gridBox.ny) - 1);
+  const int maxX = std::min(aMask.maxx(),
+    static_cast<int>(_gridBox.x0 + _gridBox.nx) - 1);
+  const int sizeX = _gridBox.nx;
+  const int sizeY = _gridBox.ny;
+  const int sizeZ = _gridBox.nz;
   std::cout << "Mask Size "<< "x = " << aMask.xsize()<< " y= " <<
     aMask.ysize()<< " z = "<< aMask.zsize()<<endl;
   std::cout << "Mask Min "<< "x = " << aMask.minx()<< " y= " <<
@@ -383,7 +992,7 @@ unsigned short int* SampleManager::GetMaskToArray(NEWIMAGE::volume<short int> aM
     aMask.maxy()<< " z = "<< aMask.maxz()<<endl;    
 
   unsigned short int* target =
-    new unsigned short int[sizeX * sizeY * sizeZ];
+    new unsigned short int[GridVoxelCount(sizeX, sizeY, sizeZ, _bricked)]();
 
   for (int z = minZ; z <= maxZ; z++)
   {
@@ -391,7 +1000,9 @@ unsigned short int* SampleManager::GetMaskToArray(NEWIMAGE::volume<short int> aM
     {
       for (int x = minX; x <= maxX; x++)
       {
-            target[x*sizeY*sizeZ + y*sizeZ + z] = aMask(x,y,z);
+            target[GridVoxelOffset(x - _gridBox.x0, y - _gridBox.y0,
+              z - _gridBox.z0, sizeX, sizeY, sizeZ, _bricked)] =
+              aMask(x,y,z);
       }
     }
   }
@@ -403,11 +1014,11 @@ float const SampleManager::GetThetaData(
 {
   if(_thetaData.data.size()>0)
   {
-    int nx = _thetaData.nx;
-    int ny = _thetaData.ny;
-    int nz = _thetaData.nz;
-    return _thetaData.data.at(aFiberNum)[(aSamp)*(nx*ny*nz) +
-      (aX)*(nz*ny) + (aY)*nz + (aZ)];
+    long offset = GetSampleOffset(_thetaData, aSamp, aX, aY, aZ);
+    if(offset >= 0)
+    {
+      return _thetaData.data.at(aFiberNum)[offset];
+    }
   }
   return 0.0f;
 }
@@ -417,11 +1028,11 @@ float const SampleManager::GetPhiData(
 {
   if(_phiData.data.size()>0)
   {
-    int nx = _phiData.nx;
-    int ny = _phiData.ny;
-    int nz = _phiData.nz;
-    return _phiData.data.at(aFiberNum)[(aSamp)*(nx*ny*nz) +
-      (aX)*(nz*ny) + (aY)*nz + (aZ)];
+    long offset = GetSampleOffset(_phiData, aSamp, aX, aY, aZ);
+    if(offset >= 0)
+    {
+      return _phiData.data.at(aFiberNum)[offset];
+    }
   }
   return 0.0f;
 }
@@ -431,15 +1042,48 @@ float const SampleManager::GetfData(int aFiberNum,
 {
   if(_fData.data.size()>0)
   {
-    int nx = _fData.nx;
-    int ny = _fData.ny;
-    int nz = _fData.nz;
-    return _fData.data.at(aFiberNum)[(aSamp)*(nx*ny*nz) +
-      (aX)*(nz*ny) + (aY)*nz + (aZ)];
+    long offset = GetSampleOffset(_fData, aSamp, aX, aY, aZ);
+    if(offset >= 0)
+    {
+      return _fData.data.at(aFiberNum)[offset];
+    }
   }
   return 0.0f;
 }
 
+//Private method: Position of a sample in a BedpostXData array, or -1
+//for voxels dropped by mask compaction or cropping. aX, aY and aZ are
+//image voxels.
+long SampleManager::GetSampleOffset(const BedpostXData& aContainer,
+  int aSamp, int aX, int aY, int aZ)
+{
+  const int x = aX - static_cast<int>(aContainer.x0);
+  const int y = aY - static_cast<int>(aContainer.y0);
+  const int z = aZ - static_cast<int>(aContainer.z0);
+  if(x < 0 || y < 0 || z < 0 || x >= static_cast<int>(aContainer.nx) ||
+    y >= static_cast<int>(aContainer.ny) ||
+    z >= static_cast<int>(aContainer.nz))
+  {
+    return -1;
+  }
+  unsigned int voxel = GridVoxelOffset(x, y, z,
+    aContainer.nx, aContainer.ny, aContainer.nz, aContainer.bricked);
+  if(_voxelIndex.data != NULL)
+  {
+    voxel = _voxelIndex[voxel];
+    if(voxel == kVoxelOutsideMask)
+    {
+      return -1;
+    }
+  }
+  return static_cast<long>(aSamp)*aContainer.nvoxels + voxel;
+}
+
+const unsigned int* SampleManager::GetVoxelIndexToArray()
+{
+  return _voxelIndex.data;
+}
+
 unsigned short int const SampleManager::GetBrainMask(
   int aX, int aY, int aZ)
 {
@@ -472,6 +1116,243 @@ const BedpostXData* SampleManager::GetFDataPtr()
   }
   return NULL;
 }
+
+//Interleaves the loaded theta/phi/f samples into one float4 record per
+//(voxel, sample), keeping the BedpostXData indexing.
+void SampleManager::BuildPackedSamples()
+{
+  BuildPackedRecords(_packedData, false);
+}
+
+//Converts the loaded angles to unit direction vectors once, so the
+//kernel does no trig per step. Records are (x, y, z, f).
+void SampleManager::BuildUnitVectorSamples()
+{
+  BuildPackedRecords(_unitVectorData, true);
+}
+
+void SampleManager::BuildPackedRecords(
+  PackedSampleData& aTarget, bool aUnitVectors)
+{
+  if(aTarget.data.size() > 0 || _thetaData.data.size() == 0)
+  {
+    return;
+  }
+
+  aTarget.nx = _thetaData.nx;
+  aTarget.ny = _thetaData.ny;
+  aTarget.nz = _thetaData.nz;
+  aTarget.ns = _thetaData.ns;
+  aTarget.nvoxels = _thetaData.nvoxels;
+  aTarget.bricked = _thetaData.bricked;
+  aTarget.x0 = _thetaData.x0;
+  aTarget.y0 = _thetaData.y0;
+  aTarget.z0 = _thetaData.z0;
+  aTarget.unit_vectors = aUnitVectors;
+
+  const size_t nrecords =
+    static_cast<size_t>(_thetaData.ns)*_thetaData.nvoxels;
+  for (unsigned int i = 0; i < _thetaData.data.size(); i++)
+  {
+    const float* theta = _thetaData.data.at(i);
+    const float* phi = _phiData.data.at(i);
+    const float* f = _fData.data.at(i);
+    float4* packed = _arena.Allocate<float4>(nrecords);
+    for (size_t r = 0; r < nrecords; r++)
+    {
+      if(aUnitVectors)
+      {
+        const float sinTheta = std::sin(theta[r]);
+        packed[r].x = std::cos(phi[r])*sinTheta;
+        packed[r].y = std::sin(phi[r])*sinTheta;
+        packed[r].z = std::cos(theta[r]);
+        packed[r].t = f[r];
+      }
+      else
+      {
+        packed[r].x = theta[r];
+        packed[r].y = phi[r];
+        packed[r].z = f[r];
+        packed[r].t = 0.0f;
+      }
+    }
+    aTarget.data.push_back(packed);
+  }
+}
+
+const PackedSampleData* SampleManager::GetPackedDataPtr()
+{
+  if(_packedData.data.size() > 0)
+  {
+    return &_packedData;
+  }
+  return NULL;
+}
+
+const PackedSampleData* SampleManager::GetUnitVectorDataPtr()
+{
+  if(_unitVectorData.data.size() > 0)
+  {
+    return &_unitVectorData;
+  }
+  return NULL;
+}
+
+//Maps every sample direction to its nearest codebook entry and f to 8
+//bits. Reports the angular error introduced and the device memory
+//saved over float theta/phi/f buffers.
+void SampleManager::BuildCodebookSamples()
+{
+  if(_codebookData.data.size() > 0 || _thetaData.data.size() == 0)
+  {
+    return;
+  }
+
+  _codebookData.nx = _thetaData.nx;
+  _codebookData.ny = _thetaData.ny;
+  _codebookData.nz = _thetaData.nz;
+  _codebookData.ns = _thetaData.ns;
+  _codebookData.nvoxels = _thetaData.nvoxels;
+  _codebookData.bricked = _thetaData.bricked;
+  _codebookData.x0 = _thetaData.x0;
+  _codebookData.y0 = _thetaData.y0;
+  _codebookData.z0 = _thetaData.z0;
+
+  //Error histogram in 0.1 degree bins, last bin is everything above.
+  const unsigned int nBins = 11;
+  std::vector<size_t> histogram(nBins, 0);
+  double maxAngle = 0.0;
+  double sumAngle = 0.0;
+  float maxFError = 0.0f;
+
+  const size_t nrecords =
+    static_cast<size_t>(_thetaData.ns)*_thetaData.nvoxels;
+  for (unsigned int i = 0; i < _thetaData.data.size(); i++)
+  {
+    const float* theta = _thetaData.data.at(i);
+    const float* phi = _phiData.data.at(i);
+    const float* f = _fData.data.at(i);
+    unsigned int* codes = _arena.Allocate<unsigned int>(nrecords);
+    for (size_t r = 0; r < nrecords; r++)
+    {
+      const float sinTheta = std::sin(theta[r]);
+      const float x = std::cos(phi[r])*sinTheta;
+      const float y = std::sin(phi[r])*sinTheta;
+      const float z = std::cos(theta[r]);
+      const unsigned short direction = _codebook.Encode(x, y, z);
+
+      float clampedF = std::min(std::max(f[r], 0.0f), 1.0f);
+      const unsigned int quantizedF =
+        static_cast<unsigned int>(clampedF*255.0f + 0.5f);
+      codes[r] = direction | (quantizedF << 16);
+
+      const float4& entry = _codebook.Decode(direction);
+      double dot = std::min(1.0,
+        static_cast<double>(entry.x*x + entry.y*y + entry.z*z));
+      double angle = std::acos(dot)*180.0/M_PI;
+      histogram.at(std::min(static_cast<unsigned int>(angle*10.0),
+        nBins - 1))++;
+      maxAngle = std::max(maxAngle, angle);
+      sumAngle += angle;
+      maxFError = std::max(maxFError,
+        std::fabs(quantizedF/255.0f - clampedF));
+    }
+    _codebookData.data.push_back(codes);
+  }
+
+  const size_t total = nrecords*_thetaData.data.size();
+  std::cout<<"Codebook Angular Error (degrees), "<<total<<
+    " samples:"<<std::endl;
+  for (unsigned int b = 0; b < nBins; b++)
+  {
+    std::cout<<"  ";
+    if(b < nBins - 1)
+    {
+      std::cout<<b/10.0<<"-"<<(b + 1)/10.0;
+    }
+    else
+    {
+      std::cout<<">"<<b/10.0;
+    }
+    std::cout<<": "<<histogram.at(b)<<" ("<<
+      (total > 0 ? 100.0*histogram.at(b)/total : 0.0)<<"%)"<<std::endl;
+  }
+  std::cout<<"  mean "<<(total > 0 ? sumAngle/total : 0.0)<<
+    ", max "<<maxAngle<<", max f error "<<maxFError<<std::endl;
+
+  const double floatBytes = 3.0*sizeof(float)*total;
+  const double codebookBytes = sizeof(unsigned int)*total +
+    sizeof(float4)*DirectionCodebook::kNumEntries;
+  std::cout<<"Device Sample Memory (MB): float theta/phi/f "<<
+    floatBytes/1e6<<", codebook "<<codebookBytes/1e6<<std::endl;
+}
+
+const CodebookSampleData* SampleManager::GetCodebookDataPtr()
+{
+  if(_codebookData.data.size() > 0)
+  {
+    return &_codebookData;
+  }
+  return NULL;
+}
+
+void SampleManager::ConvertSamplesToHalf()
+{
+  const size_t nrecords =
+    static_cast<size_t>(_thetaData.ns)*_thetaData.nvoxels;
+
+  ConvertToHalf(_thetaData.data, nrecords, _thetaData.half_data);
+  ConvertToHalf(_phiData.data, nrecords, _phiData.half_data);
+  ConvertToHalf(_fData.data, nrecords, _fData.half_data);
+
+  PackedSampleData* packed[] = {&_packedData, &_unitVectorData};
+  for (unsigned int p = 0; p < 2; p++)
+  {
+    std::vector<float*> records;
+    for (unsigned int i = 0; i < packed[p]->data.size(); i++)
+    {
+      records.push_back(&(packed[p]->data.at(i)->x));
+    }
+    ConvertToHalf(records, 4*nrecords, packed[p]->half_data);
+  }
+}
+
+//Private method: Half copies of aCount floats from each aSource array.
+void SampleManager::ConvertToHalf(const std::vector<float*>& aSource,
+  size_t aCount, std::vector<unsigned short*>& aTarget)
+{
+  if(aTarget.size() > 0)
+  {
+    return;
+  }
+  for (unsigned int i = 0; i < aSource.size(); i++)
+  {
+    unsigned short* half = _arena.Allocate<unsigned short>(aCount);
+    for (size_t r = 0; r < aCount; r++)
+    {
+      half[r] = FloatToHalf(aSource.at(i)[r]);
+    }
+    aTarget.push_back(half);
+  }
+}
+
+SampleLayout SampleManager::GetSampleLayout()
+{
+  if(_oclptxOptions.codebook.value())
+  {
+    return kCodebookSamples;
+  }
+  if(_oclptxOptions.unitvec.value())
+  {
+    return kUnitVectorSamples;
+  }
+  if(_oclptxOptions.packed.value())
+  {
+    return kPackedSamples;
+  }
+  return kSeparateSamples;
+}
+
 //*********************************************************************
 // samplemanager Constructors/Destructors/Initializers
 //*********************************************************************
@@ -489,25 +1370,14 @@ SampleManager& SampleManager::GetInstance()
 
 //Private Constructor.
 SampleManager::SampleManager():_oclptxOptions(
-  oclptxOptions::getInstance()){}
+  oclptxOptions::getInstance()), _inflateThreads(1), _voxelIndex(),
+  _nCompactVoxels(0), _bricked(false), _cropped(false), _gridBox(),
+  _maskVolume(NULL){}
 
 SampleManager::~SampleManager()
 {
-    for (unsigned int i = 0; i < _thetaData.data.size(); i++)
-    {
-        delete[] _thetaData.data.at(i);
-    }
-
-    for (unsigned int i = 0; i < _phiData.data.size(); i++)
-    {
-        delete[] _phiData.data.at(i);
-    }
-
-    for (unsigned int i = 0; i < _fData.data.size(); i++)
-    {
-        delete[] _fData.data.at(i);
-    }
-
+    //Sample, layout and mask arrays are released with _arena (or the
+    //sample cache mapping).
     delete _manager;
 }
 
@@ -35,11 +35,15 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <mutex>
 
 #include "newimage/newimageall.h"
 #include "miscmaths/miscmaths.h"
 #include "oclptxOptions.h"
 #include "customtypes.h"
+#include "directioncodebook.h"
+#include "samplecache.h"
+#include "hostarena.h"
 
 class SampleManager
 {
@@ -77,6 +81,19 @@ class SampleManager
     const NEWIMAGE::volume<short int>* GetTerminationMask();
     const unsigned short int* GetTerminationMaskToArray();
     const std::vector<unsigned short int*> GetWayMasksToVector();
+    // Waymasks named by --waypoints, loaded or not (with --cache).
+    unsigned int GetWayMaskCount();
+    // Every mask folded into one bitfield volume (kMaskBrain,
+    // kMaskExclusion, kMaskTermination, waymask i at bit
+    // kMaskWaypointShift + i), laid out like GetBrainMaskToArray().
+    // Built once, in a single pass, into the host arena.
+    const unsigned int* GetMaskVolumeToArray();
+    // Bytes per mask word the device needs for the bits set anywhere
+    // in the mask volume: 1 (up to 5 waymasks), 2 (up to 13) or 4.
+    unsigned int GetMaskWordBytes();
+    // Voxel -> compacted sample index volume (same layout as the masks),
+    // NULL unless samples were compacted with --compact.
+    const unsigned int* GetVoxelIndexToArray();
 
 
     // Getters: 
@@ -85,7 +102,8 @@ class SampleManager
     int const GetNumMaxSteps() {return _nMaxSteps;}
 
     // Getters: Randomly seeded particles (uses midpoint
-    //  of _brainMask if no seedfile is specified)
+    //  of _brainMask if no seedfile is specified), in grid voxels
+    //  (image voxels minus the GetGridBox() origin)
     std::vector<float4> * const GetSeedParticles()
     {
       return &_seedParticles;
@@ -99,9 +117,47 @@ class SampleManager
     //  nx ny nz = spacial dimensions stored in BedpostXData,
     // and aY aX, aZ = inputed spacial coordinates.
     // See definition of GetThetaData(...) above for example.
+    // With --compact the samples are stored only for brain mask voxels
+    // and the voxel is translated through GetVoxelIndexToArray() first:
+    // data.at(aFiberNum)[(aSamp)*nvoxels + voxelIndex[...]]
+    // With --crop, nx ny nz are those of the crop box and aX aY aZ
+    // count from its origin (x0, y0, z0); the Get*Data() getters still
+    // take image coordinates.
     const BedpostXData* GetThetaDataPtr();
     const BedpostXData* GetPhiDataPtr();
     const BedpostXData* GetFDataPtr();
+
+    // Packed (theta, phi, f) records, NULL until BuildPackedSamples()
+    // has run. Indexed like BedpostXData.
+    void BuildPackedSamples();
+    const PackedSampleData* GetPackedDataPtr();
+    // Packed (x, y, z, f) unit vector records, NULL until
+    // BuildUnitVectorSamples() has run.
+    void BuildUnitVectorSamples();
+    const PackedSampleData* GetUnitVectorDataPtr();
+    // Quantised direction/f codes, NULL until BuildCodebookSamples()
+    // has run. Prints the angular error histogram of the quantisation.
+    void BuildCodebookSamples();
+    const CodebookSampleData* GetCodebookDataPtr();
+    const DirectionCodebook& GetDirectionCodebook() {return _codebook;}
+    // Part of the image covered by the sample and mask arrays: the
+    // brain mask bounding box with --crop, otherwise the whole image.
+    const GridBox& GetGridBox() {return _gridBox;}
+    // Writes visit counts on the sample grid (GridVoxelOffset order, as
+    // OclPtxHandler::DensityToHost() returns them) to --dir/--out, in
+    // the brain mask's full image frame.
+    void SaveDensityVolume(const unsigned int* aCounts);
+    // Top three rows of the brain mask's voxel to mm matrix, row major.
+    void GetVoxelToWorld(float* aMatrix);
+    // Host memory behind the sample, layout and mask arrays.
+    const HostArena& GetHostArena() {return _arena;}
+    // Fills half_data of the loaded float samples and any packed or
+    // unit vector records built so far (--fp16). Float data is kept
+    // for the host getters.
+    void ConvertSamplesToHalf();
+    // Layout requested on the command line (--packed, --unitvec,
+    // --codebook).
+    SampleLayout GetSampleLayout();
     
     //OclptxOptions and custom options
     const oclptxOptions& GetOclptxOptions(){return _oclptxOptions;}
@@ -110,23 +166,46 @@ class SampleManager
   private:
     SampleManager();
     void LoadBedpostData(const std::string& aBasename);
-    void LoadBedpostDataHelper(
-      const std::string& aThetaSampleName,
-      const std::string& aPhiSampleName,
-      const std::string& afSampleName,
-      const NEWIMAGE::volume<float>& aMask =
-        NEWIMAGE::volume<float>(),
-      const int aFiberNum = 0);
+
+    // One theta, phi or f file of one fibre, run by the load pool.
+    struct SampleFileTask
+    {
+      std::string fileName;
+      BedpostXData* target;
+      int fiberNum;
+      double seconds;   // filled in once loaded
+    };
+    void LoadSampleFilesParallel(
+      std::vector<SampleFileTask>& aTasks,
+      unsigned int aThreadCount);
+    void LoadSampleFile(
+      const std::string& aSampleName,
+      BedpostXData& aTargetContainer,
+      const int aFiberNum);
+    float* AllocateFiberData(
+      BedpostXData& aTargetContainer,
+      const int aFiberNum,
+      const int aNx, const int aNy, const int aNz, const int aNs);
     void PopulateMemberParameters(
-      const NEWIMAGE::volume4D<float> aLoadedData,
+      const NEWIMAGE::volume4D<float>& aLoadedData,
       BedpostXData& aTargetContainer,
-      const NEWIMAGE::volume<float> aMaskParams,
       const int aFiberNum);
+    void BuildVoxelIndex(const std::string& aMaskName);
+    void ComputeGridBox();
+    std::vector<std::string> GetWayMaskFileNames();
+    bool LoadSampleCache(const std::vector<SampleFileTask>& aTasks);
+    void WriteSampleCache();
+    void BuildPackedRecords(PackedSampleData& aTarget, bool aUnitVectors);
+    void ConvertToHalf(const std::vector<float*>& aSource,
+      size_t aCount, std::vector<unsigned short*>& aTarget);
+    long GetSampleOffset(const BedpostXData& aContainer,
+      int aSamp, int aX, int aY, int aZ);
     void GenerateSeedParticles(float aSampleVoxel);
     void GenerateSeedParticlesHelper(
       float4 aSeed, float aSampleVoxel);
     std::string IntTostring(const int& value);
     unsigned short int* GetMaskToArray(NEWIMAGE::volume<short int> aMask);
+    bool MatchesBrainMask(const NEWIMAGE::volume<short int>& aMask);
 
     //Statics
     static SampleManager* _manager;
@@ -137,6 +216,29 @@ class SampleManager
     BedpostXData _thetaData;
     BedpostXData _phiData;
     BedpostXData _fData;
+    PackedSampleData _packedData;
+    PackedSampleData _unitVectorData;
+    CodebookSampleData _codebookData;
+    DirectionCodebook _codebook;
+    std::mutex _loadMutex;
+    //Inflate threads per .nii.gz file, so that with the load threads
+    //they do not exceed the cores.
+    unsigned int _inflateThreads;
+    //Backs every sample, layout and mask array below.
+    HostArena _arena;
+    //Preprocessed sample cache (--cache). While open, the theta, phi
+    //and f arrays point into its mapping.
+    SampleCache _sampleCache;
+    std::vector<SampleCacheKey> _cacheKeys;
+    //Mask compaction, in the arena (data is NULL unless --compact)
+    ArenaView<unsigned int> _voxelIndex;
+    unsigned int _nCompactVoxels;
+    //Voxel order of every grid array (--bricked, see voxelindex.h)
+    bool _bricked;
+    //Crop box of every grid array (--crop)
+    bool _cropped;
+    GridBox _gridBox;
+    unsigned int* _maskVolume;
     NEWIMAGE::volume<short int> _brainMask;
     NEWIMAGE::volume<short int> _exclusionMask;
     NEWIMAGE::volume<short int> _terminationMask;
@@ -0,0 +1,207 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* streamlinecodec.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+#include "streamlinecodec.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+const char kMagic[8] = {'O', 'C', 'L', 'P', 'T', 'X', 'P', '1'};
+
+// rounded positions per step length
+const float kStepDivisions = 16.0f;
+
+void AppendVarint(std::string* aOut, uint32_t aValue)
+{
+  while (aValue >= 0x80)
+  {
+    aOut->push_back(static_cast<char>((aValue & 0x7F) | 0x80));
+    aValue >>= 7;
+  }
+  aOut->push_back(static_cast<char>(aValue));
+}
+
+void AppendZigzag(std::string* aOut, int32_t aValue)
+{
+  AppendVarint(aOut, (static_cast<uint32_t>(aValue) << 1) ^
+    static_cast<uint32_t>(aValue >> 31));
+}
+
+bool ReadVarint(gzFile aFile, uint32_t* aValue)
+{
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7)
+  {
+    int byte = gzgetc(aFile);
+    if (byte < 0)
+    {
+      return false;
+    }
+    value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0)
+    {
+      *aValue = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ReadZigzag(gzFile aFile, int32_t* aValue)
+{
+  uint32_t value;
+  if (!ReadVarint(aFile, &value))
+  {
+    return false;
+  }
+  *aValue = static_cast<int32_t>(value >> 1) ^
+    -static_cast<int32_t>(value & 1);
+  return true;
+}
+
+void ReadOrExit(gzFile aFile, void* aData, unsigned int aSize)
+{
+  if (gzread(aFile, aData, aSize) != static_cast<int>(aSize))
+  {
+    std::cout<<"Error: truncated packed path header"<<std::endl;
+    exit(1);
+  }
+}
+}
+
+StreamlineCodec::StreamlineCodec(float aStepLength):
+  _quantum(aStepLength/kStepDivisions)
+{
+}
+
+void StreamlineCodec::Encode(const float4* aPath, unsigned int aPoints,
+  std::string* aOut) const
+{
+  AppendVarint(aOut, aPoints);
+
+  int32_t last[3] = {0, 0, 0};
+  int32_t lastStep[3] = {0, 0, 0};
+  for (unsigned int p = 0; p < aPoints; p++)
+  {
+    const float coords[3] = {aPath[p].x, aPath[p].y, aPath[p].z};
+    for (int c = 0; c < 3; c++)
+    {
+      int32_t rounded = static_cast<int32_t>(
+        std::floor(coords[c]/_quantum + 0.5f));
+      int32_t step = rounded - last[c];
+      AppendZigzag(aOut, step - lastStep[c]);
+      last[c] = rounded;
+      lastStep[c] = (p == 0) ? 0 : step;
+    }
+  }
+}
+
+std::string StreamlineCodec::Header(const float* aVoxelToWorld,
+  uint64_t aCount) const
+{
+  std::string header(kMagic, sizeof(kMagic));
+  header.append(reinterpret_cast<const char*>(&_quantum), sizeof(float));
+  header.append(reinterpret_cast<const char*>(aVoxelToWorld),
+    12*sizeof(float));
+  header.append(reinterpret_cast<const char*>(&aCount), sizeof(uint64_t));
+  return header;
+}
+
+size_t StreamlineCodec::CountOffset()
+{
+  return sizeof(kMagic) + 13*sizeof(float);
+}
+
+void StreamlineCodec::AppendEnd(std::string* aOut)
+{
+  AppendVarint(aOut, 0);
+}
+
+StreamlineCodec StreamlineCodec::ReadHeader(gzFile aFile,
+  float* aVoxelToWorld, uint64_t* aCount)
+{
+  char magic[sizeof(kMagic)];
+  ReadOrExit(aFile, magic, sizeof(magic));
+  if (memcmp(magic, kMagic, sizeof(kMagic)) != 0)
+  {
+    std::cout<<"Error: not an oclptx packed path file"<<std::endl;
+    exit(1);
+  }
+
+  StreamlineCodec codec;
+  ReadOrExit(aFile, &codec._quantum, sizeof(float));
+  ReadOrExit(aFile, aVoxelToWorld, 12*sizeof(float));
+  ReadOrExit(aFile, aCount, sizeof(uint64_t));
+  return codec;
+}
+
+bool StreamlineCodec::Decode(gzFile aFile, std::vector<float4>* aPath) const
+{
+  uint32_t points;
+  if (!ReadVarint(aFile, &points) || points == 0)
+  {
+    return false;
+  }
+
+  aPath->resize(points);
+  int32_t last[3] = {0, 0, 0};
+  int32_t lastStep[3] = {0, 0, 0};
+  for (unsigned int p = 0; p < points; p++)
+  {
+    float coords[3];
+    for (int c = 0; c < 3; c++)
+    {
+      int32_t residual;
+      if (!ReadZigzag(aFile, &residual))
+      {
+        std::cout<<"Error: truncated packed path"<<std::endl;
+        exit(1);
+      }
+      int32_t step = lastStep[c] + residual;
+      last[c] += step;
+      lastStep[c] = (p == 0) ? 0 : step;
+      coords[c] = last[c]*_quantum;
+    }
+    aPath->at(p).x = coords[0];
+    aPath->at(p).y = coords[1];
+    aPath->at(p).z = coords[2];
+  }
+  return true;
+}
+
+//EOF
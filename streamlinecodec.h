@@ -0,0 +1,98 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* streamlinecodec.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef  OCLPTX_STREAMLINECODEC_H_
+#define  OCLPTX_STREAMLINECODEC_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "customtypes.h"
+
+// Compact streamline encoding for kPackedPaths files.
+//
+// Points (image voxels) are rounded to a fixed-point grid of
+// GetQuantum() voxels, 1/16 of the step length, so no coordinate is
+// off by more than step length/32 (0.0078 voxels at basic.cl's 0.25).
+// Rounding absolute positions (not the steps) keeps the error from
+// accumulating along a path.
+//
+// Each streamline is stored as its point count, then per point and
+// coordinate a zigzag varint: the step between rounded points, less
+// the streamline's previous step (the first point and step are stored
+// as they are). Steps are within +-17 and the residuals within +-34,
+// one byte each: 3 bytes per point against 16 for a float4. Paths bend
+// slowly, so the residuals are mostly small and --pathgzip takes the
+// file to roughly 8-10x smaller than float4 paths; without it the
+// saving is the 16 to 3 bytes per point alone.
+//
+// File layout (little endian): the 8 byte magic "OCLPTXP1", float
+// quantum, float voxel to mm matrix (top three rows, row major),
+// uint64 streamline count, then the streamlines, then a point count
+// of 0.
+class StreamlineCodec
+{
+  public:
+    explicit StreamlineCodec(float aStepLength);
+
+    float GetQuantum() const {return _quantum;}
+
+    // Appends one streamline of aPoints (> 0) positions to aOut.
+    void Encode(const float4* aPath, unsigned int aPoints,
+      std::string* aOut) const;
+
+    // Header bytes, and where the count sits in them.
+    std::string Header(const float* aVoxelToWorld, uint64_t aCount) const;
+    static size_t CountOffset();
+    // End of data marker.
+    static void AppendEnd(std::string* aOut);
+
+    // Reads a header written by Header(), the file positioned at its
+    // start (plain or gzip). Returns a codec for the file, or exits if
+    // it is not one.
+    static StreamlineCodec ReadHeader(gzFile aFile, float* aVoxelToWorld,
+      uint64_t* aCount);
+    // Next streamline of aFile into aPath; false at the end marker.
+    bool Decode(gzFile aFile, std::vector<float4>* aPath) const;
+
+  private:
+    StreamlineCodec():_quantum(1.0f) {}
+
+    float _quantum;
+};
+
+#endif
+
+//EOF
@@ -0,0 +1,323 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* streamlinewriter.cc
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+
+#include "streamlinewriter.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+namespace
+{
+// The header is padded to a fixed size so the count can be filled in
+// place when the file is closed. Data is little endian, as on every
+// host oclptx runs on.
+const size_t kHeaderBytes = 128;
+const char kCountKey[] = "count: ";
+const int kCountDigits = 20;
+
+// 4 MB of points (or text) per write
+const size_t kBufferFloats = 1 << 20;
+const size_t kBufferChars = 4 << 20;
+
+std::string CountField(uint64_t aCount)
+{
+  char field[kCountDigits + 1];
+  snprintf(field, sizeof(field), "%020llu",
+    static_cast<unsigned long long>(aCount));
+  return std::string(field);
+}
+
+std::string Header(uint64_t aCount)
+{
+  std::ostringstream header;
+  header << "mrtrix tracks\n" << "datatype: Float32LE\n" <<
+    kCountKey << CountField(aCount) << "\n" <<
+    "file: . " << kHeaderBytes << "\n" << "END\n";
+
+  std::string text = header.str();
+  text.resize(kHeaderBytes, '\0');
+  return text;
+}
+
+// One csv row, values as std::ostream prints floats
+void AppendRow(std::string* aText, const float* aValues, unsigned int aCount)
+{
+  char value[32];
+  for (unsigned int i = 0; i < aCount; i++)
+  {
+    snprintf(value, sizeof(value), "%g", aValues[i]);
+    aText->append(value);
+    aText->push_back(i + 1 < aCount ? ',' : '\n');
+  }
+}
+}
+
+StreamlineWriter::StreamlineWriter():_format(kTckPaths), _gzFile(NULL),
+  _gridOrigin(), _codec(kStepLength), _count(0), _points(0),
+  _headerCount(0), _bytes(0)
+{
+  for (int i = 0; i < 12; i++)
+  {
+    _voxelToWorld[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+    _pointTransform[i] = _voxelToWorld[i];
+  }
+}
+
+StreamlineWriter::~StreamlineWriter()
+{
+  if (IsOpen())
+  {
+    Close();
+  }
+}
+
+void StreamlineWriter::SetVoxelToWorld(const float* aMatrix)
+{
+  for (int i = 0; i < 12; i++)
+  {
+    _voxelToWorld[i] = aMatrix[i];
+  }
+}
+
+void StreamlineWriter::SetGridOrigin(const float4& aOrigin)
+{
+  _gridOrigin = aOrigin;
+}
+
+void StreamlineWriter::Open(const std::string& aFileName,
+  PathFormat aFormat, bool aCompress, uint64_t aCount)
+{
+  _fileName = aFileName;
+  _format = aFormat;
+  if (aCompress)
+  {
+    // fast deflate, the writer should keep up with the device
+    _gzFile = gzopen(aFileName.c_str(), "wb1");
+  }
+  else
+  {
+    _file.open(aFileName.c_str(),
+      std::ios::out | std::ios::binary | std::ios::trunc);
+  }
+  if (!IsOpen())
+  {
+    std::cout<<"Error: could not create "<<aFileName<<std::endl;
+    exit(1);
+  }
+
+  // grid voxels to image voxels, then on to mm for .tck
+  float* m = _pointTransform;
+  for (int i = 0; i < 12; i++)
+  {
+    m[i] = (_format == kTckPaths) ? _voxelToWorld[i] :
+      ((i % 5 == 0) ? 1.0f : 0.0f);
+  }
+  for (int r = 0; r < 3; r++)
+  {
+    m[4*r + 3] += m[4*r]*_gridOrigin.x + m[4*r + 1]*_gridOrigin.y +
+      m[4*r + 2]*_gridOrigin.z;
+  }
+
+  _count = 0;
+  _points = 0;
+  _bytes = 0;
+  _headerCount = aCompress ? aCount : 0;
+  if (_format == kTckPaths)
+  {
+    const std::string header = Header(_headerCount);
+    WriteBytes(header.data(), header.size());
+    _buffer.reserve(kBufferFloats + 3);
+  }
+  else if (_format == kPackedPaths)
+  {
+    const std::string header = _codec.Header(_voxelToWorld, _headerCount);
+    WriteBytes(header.data(), header.size());
+    _text.reserve(kBufferChars + 4096);
+  }
+  else
+  {
+    _text.reserve(kBufferChars + 4096);
+  }
+}
+
+void StreamlineWriter::WriteStreamline(const float4* aPath,
+  unsigned int aPoints)
+{
+  const float* m = _pointTransform;
+  _count++;
+  _points += aPoints;
+
+  if (_format == kCsvPaths)
+  {
+    std::vector<float> rows(3*static_cast<size_t>(aPoints));
+    for (unsigned int p = 0; p < aPoints; p++)
+    {
+      const float4& v = aPath[p];
+      rows[p] = m[0]*v.x + m[1]*v.y + m[2]*v.z + m[3];
+      rows[aPoints + p] = m[4]*v.x + m[5]*v.y + m[6]*v.z + m[7];
+      rows[2*aPoints + p] = m[8]*v.x + m[9]*v.y + m[10]*v.z + m[11];
+    }
+    for (int r = 0; r < 3; r++)
+    {
+      AppendRow(&_text, rows.data() + r*static_cast<size_t>(aPoints),
+        aPoints);
+    }
+  }
+  else if (_format == kPackedPaths)
+  {
+    // only the crop origin to add, the codec rounds image voxels
+    _packedPoints.resize(aPoints);
+    for (unsigned int p = 0; p < aPoints; p++)
+    {
+      _packedPoints[p].x = aPath[p].x + m[3];
+      _packedPoints[p].y = aPath[p].y + m[7];
+      _packedPoints[p].z = aPath[p].z + m[11];
+    }
+    _codec.Encode(_packedPoints.data(), aPoints, &_text);
+  }
+  if (_format != kTckPaths)
+  {
+    if (_text.size() >= kBufferChars)
+    {
+      Flush();
+    }
+    return;
+  }
+
+  for (unsigned int p = 0; p < aPoints; p++)
+  {
+    const float4& v = aPath[p];
+    _buffer.push_back(m[0]*v.x + m[1]*v.y + m[2]*v.z + m[3]);
+    _buffer.push_back(m[4]*v.x + m[5]*v.y + m[6]*v.z + m[7]);
+    _buffer.push_back(m[8]*v.x + m[9]*v.y + m[10]*v.z + m[11]);
+    if (_buffer.size() >= kBufferFloats)
+    {
+      Flush();
+    }
+  }
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  _buffer.insert(_buffer.end(), 3, nan);
+}
+
+void StreamlineWriter::Close()
+{
+  if (_format == kTckPaths)
+  {
+    const float inf = std::numeric_limits<float>::infinity();
+    _buffer.insert(_buffer.end(), 3, inf);
+  }
+  else if (_format == kPackedPaths)
+  {
+    StreamlineCodec::AppendEnd(&_text);
+  }
+  Flush();
+
+  bool failed = false;
+  if (_gzFile != NULL)
+  {
+    failed = gzclose(_gzFile) != Z_OK;
+    _gzFile = NULL;
+    if (_format != kCsvPaths && _headerCount != _count)
+    {
+      std::cout<<"Warning: "<<_fileName<<" header says "<<_headerCount<<
+        " streamlines, "<<_count<<" were written\n";
+    }
+  }
+  else
+  {
+    if (_format == kTckPaths)
+    {
+      PatchCount(Header(0).find(kCountKey) + sizeof(kCountKey) - 1,
+        CountField(_count));
+    }
+    else if (_format == kPackedPaths)
+    {
+      PatchCount(StreamlineCodec::CountOffset(), std::string(
+        reinterpret_cast<const char*>(&_count), sizeof(uint64_t)));
+    }
+    _file.close();
+    failed = _file.fail();
+  }
+
+  if (failed)
+  {
+    std::cout<<"Error: could not write "<<_fileName<<std::endl;
+    exit(1);
+  }
+}
+
+//Private method: writes out the buffered points or text.
+void StreamlineWriter::Flush()
+{
+  WriteBytes(reinterpret_cast<const char*>(_buffer.data()),
+    _buffer.size()*sizeof(float));
+  _buffer.clear();
+  WriteBytes(_text.data(), _text.size());
+  _text.clear();
+}
+
+//Private method: to the plain or gzip file.
+void StreamlineWriter::WriteBytes(const char* aData, size_t aSize)
+{
+  if (aSize == 0)
+  {
+    return;
+  }
+  if (_gzFile != NULL)
+  {
+    if (gzwrite(_gzFile, aData, static_cast<unsigned int>(aSize)) == 0)
+    {
+      std::cout<<"Error: could not write "<<_fileName<<std::endl;
+      exit(1);
+    }
+  }
+  else
+  {
+    _file.write(aData, aSize);
+  }
+  _bytes += aSize;
+}
+
+//Private method: overwrites header bytes of an uncompressed file.
+void StreamlineWriter::PatchCount(size_t aOffset, const std::string& aCount)
+{
+  _file.seekp(aOffset);
+  _file.write(aCount.data(), aCount.size());
+}
+
+//EOF
@@ -0,0 +1,117 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* streamlinewriter.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+
+#ifndef  OCLPTX_STREAMLINEWRITER_H_
+#define  OCLPTX_STREAMLINEWRITER_H_
+
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "customtypes.h"
+#include "streamlinecodec.h"
+
+// Writes streamlines to a file, in large blocks from a buffer.
+//
+// kTckPaths: an MRtrix .tck file, a text header then float32 x, y, z
+// triples, a NaN triple after each streamline and an Inf triple at the
+// end.
+// kCsvPaths: three text rows per streamline, its x, y and z values
+// separated by commas.
+// kPackedPaths: see StreamlineCodec.
+//
+// Points come in grid voxels, offset from image voxels by
+// SetGridOrigin(). .tck points are written in world space (mm),
+// through SetVoxelToWorld(); csv and packed points stay in image
+// voxels, with the matrix kept in the packed header. With compression
+// the file is one gzip stream.
+class StreamlineWriter
+{
+  public:
+    StreamlineWriter();
+    ~StreamlineWriter();
+
+    // Image voxel to mm, the top three rows of the 4x4 matrix, row
+    // major. Identity if unset.
+    void SetVoxelToWorld(const float* aMatrix);
+    // Image voxel of grid voxel (0, 0, 0) (--crop).
+    void SetGridOrigin(const float4& aOrigin);
+
+    // Creates aFileName and writes the header. Exits if it cannot.
+    // aCount is only needed with aCompress and kTckPaths or
+    // kPackedPaths: a gzip stream cannot be patched, so the header gets
+    // aCount up front instead of the count written.
+    void Open(const std::string& aFileName, PathFormat aFormat,
+      bool aCompress, uint64_t aCount);
+    bool IsOpen() const {return _file.is_open() || _gzFile != NULL;}
+
+    // Appends one streamline of aPoints (> 0) positions.
+    void WriteStreamline(const float4* aPath, unsigned int aPoints);
+
+    // Writes the end marker and the final count. The file is only a
+    // valid .tck file after this.
+    void Close();
+
+    uint64_t GetCount() const {return _count;}
+    uint64_t GetPoints() const {return _points;}
+    // Bytes handed to the file, before compression.
+    uint64_t GetBytes() const {return _bytes;}
+
+  private:
+    void Flush();
+    void WriteBytes(const char* aData, size_t aSize);
+
+    void PatchCount(size_t aOffset, const std::string& aCount);
+
+    PathFormat _format;
+    std::ofstream _file;
+    gzFile _gzFile;
+    std::string _fileName;
+    std::vector<float> _buffer;
+    std::string _text;
+    float _voxelToWorld[12];
+    float4 _gridOrigin;
+    float _pointTransform[12];  // grid voxels to the file's frame
+    StreamlineCodec _codec;
+    std::vector<float4> _packedPoints;
+    uint64_t _count;
+    uint64_t _points;
+    uint64_t _headerCount;
+    uint64_t _bytes;
+};
+
+#endif
+
+//EOF
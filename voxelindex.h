@@ -0,0 +1,112 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+/* voxelindex.h
+ *
+ *
+ * Part of
+ *    oclptx
+ * OpenCL-based, GPU accelerated probtrackx algorithm module, to be used
+ * with FSL - FMRIB's Software Library
+ *
+ * This file is part of oclptx.
+ *
+ * oclptx is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * oclptx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with oclptx.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef  OCLPTX_VOXELINDEX_H_
+#define  OCLPTX_VOXELINDEX_H_
+
+// Voxel -> array offset for every volume on the sample grid (samples,
+// masks, voxel index). Shared verbatim between the host and the
+// kernels: OclEnv prepends this file to basic.cl, so it must stay
+// plain C that both C++ and OpenCL C accept.
+//
+// Linear:  x*ny*nz + y*nz + z, the FSL/bedpostX-derived default.
+// Bricked: the grid is padded to whole 8x8x8 bricks, bricks are stored
+//          in the linear order above, and the 512 voxels of a brick in
+//          Morton (z-order) order, so a step in any direction usually
+//          stays within the same few cache lines.
+
+#ifdef __OPENCL_VERSION__
+#define OCLPTX_INDEX_FN
+#else
+#define OCLPTX_INDEX_FN inline
+#endif
+
+#define OCLPTX_BRICK_BITS 3
+#define OCLPTX_BRICK_SIZE 8
+#define OCLPTX_BRICK_VOXELS 512
+
+// Spreads the low 3 bits of v to bits 0, 3 and 6.
+OCLPTX_INDEX_FN unsigned int MortonSpread3(unsigned int v)
+{
+  return (v & 1) | ((v & 2) << 2) | ((v & 4) << 4);
+}
+
+OCLPTX_INDEX_FN unsigned int BricksAlong(unsigned int n)
+{
+  return (n + OCLPTX_BRICK_SIZE - 1) >> OCLPTX_BRICK_BITS;
+}
+
+OCLPTX_INDEX_FN unsigned int LinearVoxelOffset(unsigned int x,
+  unsigned int y, unsigned int z, unsigned int nx, unsigned int ny,
+  unsigned int nz)
+{
+  (void) nx; // x is the slowest axis
+  return x*ny*nz + y*nz + z;
+}
+
+OCLPTX_INDEX_FN unsigned int BrickedVoxelOffset(unsigned int x,
+  unsigned int y, unsigned int z, unsigned int nx, unsigned int ny,
+  unsigned int nz)
+{
+  (void) nx; // x is the slowest axis
+  unsigned int brick =
+    ((x >> OCLPTX_BRICK_BITS)*BricksAlong(ny) + (y >> OCLPTX_BRICK_BITS))*
+      BricksAlong(nz) + (z >> OCLPTX_BRICK_BITS);
+  unsigned int inBrick =
+    (MortonSpread3(x & (OCLPTX_BRICK_SIZE - 1)) << 2) |
+    (MortonSpread3(y & (OCLPTX_BRICK_SIZE - 1)) << 1) |
+    MortonSpread3(z & (OCLPTX_BRICK_SIZE - 1));
+  return brick*OCLPTX_BRICK_VOXELS + inBrick;
+}
+
+// Array length needed for an nx*ny*nz grid.
+OCLPTX_INDEX_FN unsigned int GridVoxelCount(unsigned int nx,
+  unsigned int ny, unsigned int nz, int bricked)
+{
+  if (bricked)
+    return BricksAlong(nx)*BricksAlong(ny)*BricksAlong(nz)*
+      OCLPTX_BRICK_VOXELS;
+  return nx*ny*nz;
+}
+
+OCLPTX_INDEX_FN unsigned int GridVoxelOffset(unsigned int x,
+  unsigned int y, unsigned int z, unsigned int nx, unsigned int ny,
+  unsigned int nz, int bricked)
+{
+  if (bricked)
+    return BrickedVoxelOffset(x, y, z, nx, ny, nz);
+  return LinearVoxelOffset(x, y, z, nx, ny, nz);
+}
+
+#endif
+
+//EOF